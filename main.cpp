@@ -3,6 +3,35 @@
 #include <sstream>
 #include <limits>
 #include <cctype>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -47,269 +76,7267 @@ public:
   }
 };
 
+// Instrumentation of the hot paths. Building with -DSPARSE_STATS=0 compiles every counter and timer away.
+// Heap allocations are only counted when building with -DSPARSE_ALLOC_COUNT=1, which replaces the global
+// operator new and delete; otherwise the heap counters stay at zero
+#ifndef SPARSE_STATS
+#define SPARSE_STATS 1
+#endif
+#ifndef SPARSE_ALLOC_COUNT
+#define SPARSE_ALLOC_COUNT 0
+#endif
+
+#if SPARSE_STATS
+#define STATS_ONLY(...) __VA_ARGS__
+#else
+#define STATS_ONLY(...)
+#endif
+
+// Heap allocation counters. With SPARSE_ALLOC_COUNT every form of the global operator new is counted
+// (the array forms call the single ones); the operators are kept out of line so the compiler never
+// pairs the malloc with a visible delete. Every allocation then pays two atomic adds, so this is meant
+// for benchmark builds only
+static atomic<long long> allocationCount(0);
+static atomic<long long> allocationBytes(0);
+
+#if SPARSE_ALLOC_COUNT
+// Counts and performs one allocation. Returns nullptr if the memory is not available
+static void* countedAllocate(size_t size, size_t alignment) {
+  allocationCount.fetch_add(1, memory_order_relaxed);
+  allocationBytes.fetch_add(size, memory_order_relaxed);
+  size = size == 0 ? 1 : size;
+  if (alignment <= alignof(max_align_t)) {
+    return malloc(size);
+  }
+  return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  void* memory = countedAllocate(size, 0);
+  if (memory == nullptr) {
+    throw bad_alloc();
+  }
+  return memory;
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept {
+  return countedAllocate(size, 0);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment) {
+  void* memory = countedAllocate(size, (size_t)alignment);
+  if (memory == nullptr) {
+    throw bad_alloc();
+  }
+  return memory;
+}
+
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+  return countedAllocate(size, (size_t)alignment);
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, const nothrow_t&) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, align_val_t) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept {
+  free(memory);
+}
+#endif
+
+// OperationStats holds the totals of one kind of operation since the last reset
+struct OperationStats {
+  long long calls;
+  double seconds;
+  long long entries; // Entries produced
+};
+
+// SparseStats collects process-wide counters from the hot paths. Kernels count into locals and publish
+// once per operation (or per task on the thread pool), so the counters cost a few relaxed atomic adds
+// per call. Point access is tallied per thread instead and published in batches (see PointTally)
+class SparseStats {
+public:
+  enum Operation {
+    INSERT, TRANSPOSE, ADD, SUBTRACT, MULTIPLY,
+    COMPRESSED_TRANSPOSE, COMPRESSED_ADD, COMPRESSED_MULTIPLY, LAZY_EVALUATE, SPMV, LOAD,
+    PLAN_BUILD, PLAN_EXECUTE, BSR_ADD, BSR_MULTIPLY, OUT_OF_CORE_MULTIPLY, MASKED_MULTIPLY, CHAIN_PLAN,
+    REORDER, PERMUTE, INCREMENTAL_UPDATE, PRUNED_MULTIPLY, NUM_OPERATIONS
+  };
+  enum Counter {
+    INSERT_NODES_VISITED,   // Nodes walked to index rows and columns for point access
+    PARTIAL_PRODUCTS,       // Products a(i,k) * b(k,j) generated by multiplications
+    LONGEST_PRODUCT_ROW,    // Most partial products generated for a single result row
+    ACCUMULATOR_COLLISIONS, // Occupied slots probed past in hashed accumulators
+    ARENA_BLOCKS,           // Blocks allocated by node arenas
+    ARENA_BYTES,            // Bytes reserved by node arenas
+    PRUNED_ENTRIES,         // Product entries dropped by pruned multiplications
+    NUM_COUNTERS
+  };
+  static bool enabled();
+  static void record(Operation op, long long nanoseconds, long long entries, long long numCalls = 1);
+  static void add(Counter counter, long long n);
+  static void raise(Counter counter, long long n);
+  static OperationStats operation(Operation op);
+  static long long counter(Counter counter);
+  static bool countsAllocations();
+  static long long heapAllocations();
+  static long long heapBytes();
+  static void reset();
+  static string toJSON();
+private:
+  static atomic<long long> calls[NUM_OPERATIONS];
+  static atomic<long long> nanoseconds[NUM_OPERATIONS];
+  static atomic<long long> entries[NUM_OPERATIONS];
+  static atomic<long long> counters[NUM_COUNTERS];
+  static atomic<long long> heapAllocationBase;
+  static atomic<long long> heapByteBase;
+};
+
+atomic<long long> SparseStats::calls[SparseStats::NUM_OPERATIONS];
+atomic<long long> SparseStats::nanoseconds[SparseStats::NUM_OPERATIONS];
+atomic<long long> SparseStats::entries[SparseStats::NUM_OPERATIONS];
+atomic<long long> SparseStats::counters[SparseStats::NUM_COUNTERS];
+atomic<long long> SparseStats::heapAllocationBase(0);
+atomic<long long> SparseStats::heapByteBase(0);
+
+#if SPARSE_STATS
+// PointTally counts the inserts of one thread and the nodes its point accesses walked in plain integers.
+// They are published to SparseStats every FLUSH_INTERVAL inserts, when the thread reads or resets the
+// statistics and when it exits, so a single insert costs no atomic operation. Counts of other threads
+// that are still running may lag behind by less than FLUSH_INTERVAL inserts
+struct PointTally {
+  static constexpr long long FLUSH_INTERVAL = 1024;
+  long long inserts = 0;
+  long long visited = 0;
+  ~PointTally();
+  void countInsert();
+  void flush();
+};
+
+static thread_local PointTally pointTally;
+
+// Destructor publishes what is left when the thread exits
+PointTally::~PointTally() {
+  flush();
+}
+
+// Counts one insert, publishing the tally when the batch is full
+void PointTally::countInsert() {
+  if (++inserts == FLUSH_INTERVAL) {
+    flush();
+  }
+}
+
+// Publishes the tally to SparseStats and restarts it
+void PointTally::flush() {
+  if (inserts > 0) {
+    SparseStats::record(SparseStats::INSERT, 0, inserts, inserts);
+  }
+  if (visited > 0) {
+    SparseStats::add(SparseStats::INSERT_NODES_VISITED, visited);
+  }
+  inserts = 0;
+  visited = 0;
+}
+#endif
+
+// StatsTimer records the wall time of one operation from its construction to its destruction
+class StatsTimer {
+public:
+  StatsTimer(SparseStats::Operation op);
+  ~StatsTimer();
+  void setEntries(long long n);
+private:
+  SparseStats::Operation op;
+  chrono::steady_clock::time_point start;
+  long long entries;
+};
+
+// Returns true if the counters and timers were compiled in
+bool SparseStats::enabled() {
+  return SPARSE_STATS != 0;
+}
+
+// Adds calls of an operation (one by default) with their wall time and the number of entries they produced
+void SparseStats::record(Operation op, long long ns, long long produced, long long numCalls) {
+  calls[op].fetch_add(numCalls, memory_order_relaxed);
+  nanoseconds[op].fetch_add(ns, memory_order_relaxed);
+  entries[op].fetch_add(produced, memory_order_relaxed);
+}
+
+// Adds n to a counter
+void SparseStats::add(Counter counter, long long n) {
+  counters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+// Raises a maximum counter to n if it is lower
+void SparseStats::raise(Counter counter, long long n) {
+  long long current = counters[counter].load(memory_order_relaxed);
+  while (current < n && !counters[counter].compare_exchange_weak(current, n, memory_order_relaxed)) {}
+}
+
+// Returns the totals of one kind of operation
+OperationStats SparseStats::operation(Operation op) {
+  STATS_ONLY(pointTally.flush());
+  return OperationStats{calls[op].load(), nanoseconds[op].load() / 1e9, entries[op].load()};
+}
+
+// Returns the value of a counter
+long long SparseStats::counter(Counter c) {
+  STATS_ONLY(pointTally.flush());
+  return counters[c].load();
+}
+
+// Returns the number of heap allocations since the last reset
+long long SparseStats::heapAllocations() {
+  return allocationCount.load() - heapAllocationBase.load();
+}
+
+// Returns true if the build counts heap allocations (SPARSE_ALLOC_COUNT)
+bool SparseStats::countsAllocations() {
+  return SPARSE_ALLOC_COUNT != 0;
+}
+
+// Returns the number of heap bytes allocated since the last reset
+long long SparseStats::heapBytes() {
+  return allocationBytes.load() - heapByteBase.load();
+}
+
+// Sets every counter back to zero, including the point access tally of the calling thread
+void SparseStats::reset() {
+  STATS_ONLY(pointTally.flush());
+  for (int op = 0; op < NUM_OPERATIONS; op++) {
+    calls[op] = 0;
+    nanoseconds[op] = 0;
+    entries[op] = 0;
+  }
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    counters[c] = 0;
+  }
+  heapAllocationBase = allocationCount.load();
+  heapByteBase = allocationBytes.load();
+}
+
+// Returns every counter as a JSON object. Operations that were never called are left out
+string SparseStats::toJSON() {
+  static const char* operationNames[NUM_OPERATIONS] = {
+    "insert", "transpose", "add", "subtract", "multiply",
+    "compressed_transpose", "compressed_add", "compressed_multiply", "lazy_evaluate", "spmv", "load",
+    "plan_build", "plan_execute", "bsr_add", "bsr_multiply", "out_of_core_multiply", "masked_multiply", "chain_plan",
+    "reorder", "permute", "incremental_update", "pruned_multiply"
+  };
+  static const char* counterNames[NUM_COUNTERS] = {
+    "insert_nodes_visited", "partial_products", "longest_product_row", "accumulator_collisions",
+    "arena_blocks", "arena_bytes", "pruned_entries"
+  };
+
+  ostringstream json;
+  json << "{\n  \"enabled\": " << (enabled() ? "true" : "false") << ",\n  \"operations\": {";
+  bool first = true;
+  for (int op = 0; op < NUM_OPERATIONS; op++) {
+    OperationStats stats = operation((Operation)op);
+    if (stats.calls == 0) {
+      continue;
+    }
+    json << (first ? "\n" : ",\n") << "    \"" << operationNames[op] << "\": {\"calls\": " << stats.calls
+         << ", \"seconds\": " << stats.seconds << ", \"entries\": " << stats.entries << "}";
+    first = false;
+  }
+  json << (first ? "},\n" : "\n  },\n") << "  \"counters\": {\n";
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    json << "    \"" << counterNames[c] << "\": " << counter((Counter)c) << ",\n";
+  }
+  if (countsAllocations()) {
+    json << "    \"heap_allocations\": " << heapAllocations() << ",\n    \"heap_bytes\": " << heapBytes() << ",\n";
+  }
+  json << "    \"heap_counted\": " << (countsAllocations() ? "true" : "false") << "\n  }\n}\n";
+  return json.str();
+}
+
+// Constructor starts the clock
+StatsTimer::StatsTimer(SparseStats::Operation op) : op(op), start(chrono::steady_clock::now()), entries(0) {}
+
+// Destructor stops the clock and records the call
+StatsTimer::~StatsTimer() {
+  long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+  SparseStats::record(op, ns, entries);
+}
+
+// Sets the number of entries produced by the operation
+void StatsTimer::setEntries(long long n) {
+  entries = n;
+}
+
+// NodePool is an arena that hands out the Internal and Header nodes of one matrix from large contiguous
+// blocks. Individual nodes are never returned to the system: release() keeps an internal node on a free
+// list for reuse, reset() recycles every node while keeping the blocks, and the destructor frees the
+// blocks in O(blocks)
+class NodePool {
+public:
+  NodePool();
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+  ~NodePool();
+  Internal* newInternal(int row, int col, int value);
+  Internal* newInternals(size_t count);
+  Header* newHeader(int row, int col);
+  void release(Internal* node);
+  void reset();
+  void swap(NodePool& other);
+  size_t bytesReserved() const;
+  size_t bytesUsed() const;
+  size_t liveInternals() const;
+private:
+  static constexpr size_t FIRST_BLOCK = 4096; // Size of the first block in bytes
+  static constexpr size_t MAX_BLOCK = 8 << 20; // Blocks stop doubling at this size
+  vector<pair<char*, size_t>> blocks;         // Start and size of every block
+  size_t currentBlock;                        // Block that the cursor points into
+  char* cursor;                               // Next free byte of the current block
+  char* limit;                                // End of the current block
+  Node* freeList;                             // Released internal nodes, linked through right
+  size_t reserved;                            // Total size of all blocks
+  size_t used;                                // Bytes handed out and not released
+  size_t internals;                           // Internal nodes handed out and not released
+  void* allocate(size_t bytes);
+};
+
+// Constructor creates an empty pool; the first block is allocated on first use
+NodePool::NodePool() {
+  currentBlock = 0;
+  cursor = limit = nullptr;
+  freeList = nullptr;
+  reserved = used = 0;
+  internals = 0;
+}
+
+// Destructor frees every block at once. Nodes have trivial destructors, so none are run
+NodePool::~NodePool() {
+  for (size_t b = 0; b < blocks.size(); b++) {
+    delete[] blocks[b].first;
+  }
+}
+
+// Allocates an internal node, reusing a released one if there is any
+Internal* NodePool::newInternal(int row, int col, int value) {
+  void* memory;
+  if (freeList != nullptr) {
+    memory = freeList;
+    freeList = freeList->right;
+    used += sizeof(Internal);
+  }
+  else {
+    memory = allocate(sizeof(Internal));
+  }
+  internals++;
+  return new (memory) Internal(row, col, value);
+}
+
+// Allocates room for count internal nodes in one contiguous run and returns its start. The nodes are
+// not constructed: the caller builds each one in place, which lets several threads fill one run
+Internal* NodePool::newInternals(size_t count) {
+  if (count == 0) {
+    return nullptr;
+  }
+  internals += count;
+  return static_cast<Internal*>(allocate(count * sizeof(Internal)));
+}
+
+// Allocates a header node
+Header* NodePool::newHeader(int row, int col) {
+  return new (allocate(sizeof(Header))) Header(row, col);
+}
+
+// Returns an internal node that is no longer linked into the matrix to the free list
+void NodePool::release(Internal* node) {
+  node->right = freeList;
+  freeList = node;
+  used -= sizeof(Internal);
+  internals--;
+}
+
+// Recycles every node of the pool while keeping its blocks for the next allocations
+void NodePool::reset() {
+  currentBlock = 0;
+  cursor = blocks.empty() ? nullptr : blocks[0].first;
+  limit = blocks.empty() ? nullptr : blocks[0].first + blocks[0].second;
+  freeList = nullptr;
+  used = 0;
+  internals = 0;
+}
+
+// Exchanges the blocks and nodes of two pools
+void NodePool::swap(NodePool& other) {
+  blocks.swap(other.blocks);
+  std::swap(currentBlock, other.currentBlock);
+  std::swap(cursor, other.cursor);
+  std::swap(limit, other.limit);
+  std::swap(freeList, other.freeList);
+  std::swap(reserved, other.reserved);
+  std::swap(used, other.used);
+  std::swap(internals, other.internals);
+}
+
+// Returns the total size of the blocks owned by the pool
+size_t NodePool::bytesReserved() const {
+  return reserved;
+}
+
+// Returns the number of bytes taken by live nodes
+size_t NodePool::bytesUsed() const {
+  return used;
+}
+
+// Returns the number of internal nodes in use, which is the number of entries of the owning matrix
+size_t NodePool::liveInternals() const {
+  return internals;
+}
+
+// Bump-allocates the given number of bytes, moving to the next block (or creating one) when the
+// current block is full
+void* NodePool::allocate(size_t bytes) {
+  bytes = (bytes + alignof(Node) - 1) & ~(alignof(Node) - 1);
+  while (cursor == nullptr || cursor + bytes > limit) {
+    if (cursor != nullptr && currentBlock + 1 < blocks.size()) {
+      // Reuse a block kept by reset()
+      currentBlock++;
+    }
+    else {
+      size_t size = blocks.empty() ? FIRST_BLOCK : min(blocks.back().second * 2, MAX_BLOCK);
+      blocks.push_back(make_pair(new char[max(size, bytes)], max(size, bytes)));
+      reserved += blocks.back().second;
+      STATS_ONLY(SparseStats::add(SparseStats::ARENA_BLOCKS, 1));
+      STATS_ONLY(SparseStats::add(SparseStats::ARENA_BYTES, blocks.back().second));
+      currentBlock = blocks.size() - 1;
+    }
+    cursor = blocks[currentBlock].first;
+    limit = cursor + blocks[currentBlock].second;
+  }
+
+  void* memory = cursor;
+  cursor += bytes;
+  used += bytes;
+  return memory;
+}
+
+// SliceIndex speeds up point access to the long rows (or columns) of a matrix. For every slice that a
+// point access had to walk past WALK_LIMIT nodes it keeps the nodes of the slice with their columns (or
+// rows) in sorted contiguous arrays, so a position is found by binary search instead of a walk along
+// the list. Short slices are cheaper to walk and are never indexed. Code that relinks a slice outside
+// the point-access functions invalidates it.
+// Nodes linked into an indexed slice are not shifted into the sorted arrays one by one: a node near the
+// end of the arrays is placed directly, and any other node waits in a small unsorted pending list
+// that lookups scan. The pending nodes are merged into the arrays in one pass on the first lookup
+// after the list outgrows the square root of the slice, so a run of inserts into the middle of a long
+// slice costs O(sqrt n) each instead of an O(n) shift.
+// Lookups build and merge slices even from const functions such as SparseMatrix::get, so an index is
+// not thread-safe: concurrent reads of one matrix through point access need external locking
+class SliceIndex {
+public:
+  static constexpr int WALK_LIMIT = 16; // Nodes walked before a slice is indexed
+  struct Slice {
+    vector<int> keys;    // Column (row slices) or row (column slices) of the sorted nodes, increasing
+    vector<Node*> nodes; // Node of every key
+    vector<pair<int, Node*>> pending; // Keys and nodes linked since the last merge, in any order
+    int find(int key) const;
+    Node* before(int key, Node* header);
+    void merge();
+  };
+  Slice* built(int s) const;
+  Slice& build(int s, Node* header, int numSlices, bool rowList);
+  void insert(int s, int key, Node* node);
+  void erase(int s, int key);
+  void invalidate(int s);
+  void clear();
+  void swap(SliceIndex& other);
+private:
+  vector<unique_ptr<Slice>> slices; // Indexed slices by number; empty until a slice is indexed
+};
+
+// Returns the position of the first key that is not less than the given one
+int SliceIndex::Slice::find(int key) const {
+  return lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+}
+
+// Returns the node with the largest key below the given one, or header if there is none. Pending nodes
+// are merged first once there are more of them than the square root of the slice, which balances the
+// scans of the pending list against the O(n) merges
+Node* SliceIndex::Slice::before(int key, Node* header) {
+  if ((int)pending.size() > max(WALK_LIMIT, (int)sqrt((double)keys.size()))) {
+    merge();
+  }
+  int pos = find(key);
+  Node* node = pos == 0 ? header : nodes[pos - 1];
+  int best = pos == 0 ? -1 : keys[pos - 1];
+  for (const pair<int, Node*>& entry : pending) {
+    if (entry.first < key && entry.first > best) {
+      best = entry.first;
+      node = entry.second;
+    }
+  }
+  return node;
+}
+
+// Merges the pending nodes into the sorted arrays, filling them from the back so no other storage is needed
+void SliceIndex::Slice::merge() {
+  sort(pending.begin(), pending.end());
+  size_t p = keys.size(), q = pending.size();
+  keys.resize(p + q);
+  nodes.resize(p + q);
+  for (size_t e = p + q; q > 0; e--) {
+    if (p > 0 && keys[p - 1] > pending[q - 1].first) {
+      keys[e - 1] = keys[p - 1];
+      nodes[e - 1] = nodes[p - 1];
+      p--;
+    }
+    else {
+      keys[e - 1] = pending[q - 1].first;
+      nodes[e - 1] = pending[q - 1].second;
+      q--;
+    }
+  }
+  pending.clear();
+}
+
+// Returns the index of slice s, or nullptr if it has not been built
+SliceIndex::Slice* SliceIndex::built(int s) const {
+  return slices.empty() ? nullptr : slices[s].get();
+}
+
+// Indexes slice s by walking the list that starts at header. rowList selects the row lists (right
+// links, keyed by column) over the column lists (down links, keyed by row)
+SliceIndex::Slice& SliceIndex::build(int s, Node* header, int numSlices, bool rowList) {
+  if (slices.empty()) {
+    slices.resize(numSlices);
+  }
+  slices[s].reset(new Slice());
+  Slice& slice = *slices[s];
+  for (Node* node = rowList ? header->right : header->down; node != nullptr; node = rowList ? node->right : node->down) {
+    slice.keys.push_back(rowList ? node->col : node->row);
+    slice.nodes.push_back(node);
+  }
+  STATS_ONLY(SparseStats::add(SparseStats::INSERT_NODES_VISITED, slice.nodes.size()));
+  return slice;
+}
+
+// Records a node linked into slice s, if the slice is indexed: placed into the sorted arrays if at most
+// WALK_LIMIT keys go after it, and otherwise left pending until the next merge
+void SliceIndex::insert(int s, int key, Node* node) {
+  Slice* slice = built(s);
+  if (slice == nullptr) {
+    return;
+  }
+  int pos = slice->find(key);
+  if ((int)slice->keys.size() - pos <= WALK_LIMIT) {
+    slice->keys.insert(slice->keys.begin() + pos, key);
+    slice->nodes.insert(slice->nodes.begin() + pos, node);
+  }
+  else {
+    slice->pending.emplace_back(key, node);
+  }
+}
+
+// Forgets the node with the given key after it was unlinked from slice s, if the slice is indexed
+void SliceIndex::erase(int s, int key) {
+  Slice* slice = built(s);
+  if (slice == nullptr) {
+    return;
+  }
+  int pos = slice->find(key);
+  if (pos < (int)slice->keys.size() && slice->keys[pos] == key) {
+    slice->keys.erase(slice->keys.begin() + pos);
+    slice->nodes.erase(slice->nodes.begin() + pos);
+    return;
+  }
+  vector<pair<int, Node*>>& pending = slice->pending;
+  for (size_t e = 0; e < pending.size(); e++) {
+    if (pending[e].first == key) {
+      pending[e] = pending.back();
+      pending.pop_back();
+      return;
+    }
+  }
+}
+
+// Drops the index of slice s after its list has been changed
+void SliceIndex::invalidate(int s) {
+  if (!slices.empty()) {
+    slices[s].reset();
+  }
+}
+
+// Drops every slice index
+void SliceIndex::clear() {
+  slices.clear();
+}
+
+// Exchanges two indexes
+void SliceIndex::swap(SliceIndex& other) {
+  slices.swap(other.slices);
+}
+
+// SparseAccumulator gathers the partial products of one output row during a row-wise (Gustavson)
+// multiplication. Narrow matrices use a dense scratch array with a list of touched columns, wide ones
+// use an open-addressing hash table keyed by column, so the scratch space never depends on the
+// width of the result when the rows are short. Callers that know how many entries a row is expected
+// to hold pass it as expectedFill, which also picks the hash table for rows that would touch only a
+// small part of a dense array too large for the cache
+class SparseAccumulator {
+public:
+  static constexpr int DENSE_LIMIT = 1 << 20;  // Widest result that still gets a dense scratch array
+  static constexpr int CACHED_WIDTH = 1 << 16; // Widest dense scratch array that stays in cache
+  static constexpr int SPARSE_RATIO = 64;      // Rows filling less than 1/SPARSE_RATIO of a wide result are hashed
+  SparseAccumulator(int numCols, int expectedFill = 0);
+  bool usesHash() const;
+  void add(int col, int value);
+  int size() const;
+  void clear();
+  void drainTo(int* cols, int* vals);
+  void drain(vector<int>& cols, vector<int>& vals);
+  long long takeCollisions();
+private:
+  bool hashed;
+  vector<int> accum;    // Dense mode: running sum of every column
+  vector<char> occupied; // Dense mode: whether the column has been touched in this row
+  vector<int> touched;   // Columns (dense mode) or slots (hash mode) touched in this row
+  vector<int> keys;      // Hash mode: column stored in each slot, or -1 if the slot is empty
+  vector<int> sums;      // Hash mode: running sum stored in each slot
+  int count;             // Hash mode: number of occupied slots
+  int shift;             // Hash mode: 32 - log2 of the table size, to keep the top bits of the hash
+  long long collisions;  // Hash mode: occupied slots probed past since the last takeCollisions()
+  size_t slotOf(int col) const;
+  void grow();
+};
+
+// Constructor picks the accumulator mode from the number of columns of the result and, if known, the
+// number of entries expected per row. The hash table starts with room for twice the expected fill
+SparseAccumulator::SparseAccumulator(int numCols, int expectedFill) {
+  hashed = numCols > DENSE_LIMIT ||
+           (numCols > CACHED_WIDTH && expectedFill > 0 && (long long)expectedFill * SPARSE_RATIO < numCols);
+  count = 0;
+  shift = 0;
+  collisions = 0;
+  if (hashed) {
+    int bits = 6;
+    while (bits < 30 && (1 << bits) < 2 * (long long)expectedFill) {
+      bits++;
+    }
+    keys.assign((size_t)1 << bits, -1);
+    sums.assign((size_t)1 << bits, 0);
+    shift = 32 - bits;
+  }
+  else {
+    accum.assign(numCols, 0);
+    occupied.assign(numCols, 0);
+  }
+}
+
+// Returns true if the accumulator is using the hash table
+bool SparseAccumulator::usesHash() const {
+  return hashed;
+}
+
+// Adds a partial product to the given column of the current row
+void SparseAccumulator::add(int col, int value) {
+  if (!hashed) {
+    if (!occupied[col]) {
+      occupied[col] = 1;
+      touched.push_back(col);
+    }
+    accum[col] += value;
+    return;
+  }
+
+  // Linear probing from the multiplicative hash of the column
+  size_t mask = keys.size() - 1;
+  size_t slot = slotOf(col);
+  while (keys[slot] != -1 && keys[slot] != col) {
+    slot = (slot + 1) & mask;
+    STATS_ONLY(collisions++);
+  }
+  if (keys[slot] == -1) {
+    keys[slot] = col;
+    sums[slot] = value;
+    touched.push_back(slot);
+    count++;
+    if (2 * count > (int)keys.size()) {
+      grow(); // Keep the load factor at or below one half
+    }
+  }
+  else {
+    sums[slot] += value;
+  }
+}
+
+// Returns the number of distinct columns in the current row
+int SparseAccumulator::size() const {
+  return touched.size();
+}
+
+// Discards the current row without emitting it
+void SparseAccumulator::clear() {
+  for (int t : touched) {
+    if (hashed) {
+      keys[t] = -1;
+    }
+    else {
+      accum[t] = 0;
+      occupied[t] = 0;
+    }
+  }
+  touched.clear();
+  count = 0;
+}
+
+// Writes the entries of the current row to cols/vals sorted by column and clears the accumulator.
+// Both arrays must have room for size() entries
+void SparseAccumulator::drainTo(int* cols, int* vals) {
+  if (hashed) {
+    // Order the occupied slots by the column they hold
+    sort(touched.begin(), touched.end(), [this](int x, int y) { return keys[x] < keys[y]; });
+    for (size_t e = 0; e < touched.size(); e++) {
+      cols[e] = keys[touched[e]];
+      vals[e] = sums[touched[e]];
+    }
+  }
+  else {
+    sort(touched.begin(), touched.end());
+    for (size_t e = 0; e < touched.size(); e++) {
+      cols[e] = touched[e];
+      vals[e] = accum[touched[e]];
+    }
+  }
+  clear();
+}
+
+// Appends the entries of the current row to cols/vals sorted by column and clears the accumulator
+void SparseAccumulator::drain(vector<int>& cols, vector<int>& vals) {
+  size_t start = cols.size();
+  cols.resize(start + size());
+  vals.resize(start + size());
+  drainTo(cols.data() + start, vals.data() + start);
+}
+
+// Returns the number of collisions counted since the last call and restarts the count
+long long SparseAccumulator::takeCollisions() {
+  long long n = collisions;
+  collisions = 0;
+  return n;
+}
+
+// Returns the home slot of a column: the top bits of its Fibonacci hash. The low bits of the product
+// depend only on the low bits of the column, so columns strided by a power of two would share them
+size_t SparseAccumulator::slotOf(int col) const {
+  return (uint32_t)((uint32_t)col * 2654435761u) >> shift;
+}
+
+// Doubles the hash table and reinserts the occupied slots
+void SparseAccumulator::grow() {
+  vector<int> oldKeys(keys.size() * 2, -1);
+  vector<int> oldSums(sums.size() * 2, 0);
+  vector<int> oldTouched;
+  oldKeys.swap(keys);
+  oldSums.swap(sums);
+  oldTouched.swap(touched);
+  shift--;
+
+  size_t mask = keys.size() - 1;
+  for (int old : oldTouched) {
+    size_t slot = slotOf(oldKeys[old]);
+    while (keys[slot] != -1) {
+      slot = (slot + 1) & mask;
+    }
+    keys[slot] = oldKeys[old];
+    sums[slot] = oldSums[old];
+    touched.push_back(slot);
+  }
+}
+
+// ThreadPool runs batches of independent tasks on a fixed set of worker threads. Every thread starts
+// with a contiguous range of the tasks and takes them one at a time from the front; a thread whose
+// range is empty steals the back half of another thread's range, so uneven task costs still keep
+// every thread busy. The calling thread takes part as thread 0
+class ThreadPool {
+public:
+  static ThreadPool& instance();
+  ~ThreadPool();
+  int numThreads() const;
+  void setNumThreads(int n);
+  void parallelFor(int numTasks, const function<void(int task, int thread)>& body);
+private:
+  struct TaskRange {
+    mutex lock;
+    int begin, end;
+  };
+  int threadCount;
+  vector<thread> workers;
+  unique_ptr<TaskRange[]> ranges;
+  const function<void(int, int)>* currentBody;
+  mutex stateMutex;
+  mutex callMutex;
+  condition_variable wakeup;
+  condition_variable finished;
+  unsigned long generation;
+  int active;
+  bool stopping;
+  ThreadPool();
+  void startWorkers();
+  void stopWorkers();
+  void workerLoop(int id, unsigned long seen);
+  void runTasks(int id);
+  bool takeTask(int id, int& task);
+  bool stealTasks(int id);
+};
+
+static thread_local bool insidePoolTask = false; // Set while a thread is running a pool task
+
+// Returns the process-wide pool
+ThreadPool& ThreadPool::instance() {
+  static ThreadPool pool;
+  return pool;
+}
+
+// Constructor defaults to one thread per hardware thread; workers start on the first parallel call
+ThreadPool::ThreadPool() {
+  threadCount = max(1u, thread::hardware_concurrency());
+  currentBody = nullptr;
+  generation = 0;
+  active = 0;
+  stopping = false;
+}
+
+// Destructor stops and joins the workers
+ThreadPool::~ThreadPool() {
+  stopWorkers();
+}
+
+// Returns the number of threads that take part in a parallel call, including the caller
+int ThreadPool::numThreads() const {
+  return threadCount;
+}
+
+// Sets the number of threads used by parallel calls; 0 or less selects one per hardware thread
+void ThreadPool::setNumThreads(int n) {
+  lock_guard<mutex> call(callMutex);
+  stopWorkers();
+  threadCount = n > 0 ? n : max(1u, thread::hardware_concurrency());
+}
+
+// Runs body(task, thread) for every task in [0, numTasks) and returns when all of them are done.
+// thread is in [0, numThreads()) and identifies the thread running the task, for per-thread scratch
+// space. Calls made from inside a task run serially on the calling thread
+void ThreadPool::parallelFor(int numTasks, const function<void(int task, int thread)>& body) {
+  if (numTasks <= 0) {
+    return;
+  }
+  if (threadCount == 1 || numTasks == 1 || insidePoolTask) {
+    for (int task = 0; task < numTasks; task++) {
+      body(task, 0);
+    }
+    return;
+  }
+
+  lock_guard<mutex> call(callMutex);
+  if (workers.empty()) {
+    startWorkers();
+  }
+
+  // Deal out the tasks as one contiguous range per thread
+  for (int t = 0; t < threadCount; t++) {
+    ranges[t].begin = (long long)numTasks * t / threadCount;
+    ranges[t].end = (long long)numTasks * (t + 1) / threadCount;
+  }
+  currentBody = &body;
+  {
+    lock_guard<mutex> state(stateMutex);
+    generation++;
+    active = threadCount - 1;
+  }
+  wakeup.notify_all();
+
+  runTasks(0);
+
+  unique_lock<mutex> state(stateMutex);
+  finished.wait(state, [this] { return active == 0; });
+  currentBody = nullptr;
+}
+
+// Creates the worker threads and their task ranges
+void ThreadPool::startWorkers() {
+  ranges.reset(new TaskRange[threadCount]);
+  {
+    lock_guard<mutex> state(stateMutex);
+    stopping = false;
+  }
+  for (int t = 1; t < threadCount; t++) {
+    workers.push_back(thread(&ThreadPool::workerLoop, this, t, generation));
+  }
+}
+
+// Signals the worker threads to exit and joins them
+void ThreadPool::stopWorkers() {
+  {
+    lock_guard<mutex> state(stateMutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  workers.clear();
+}
+
+// Main loop of a worker thread: wait for a batch newer than seen, run tasks until none are left, report back
+void ThreadPool::workerLoop(int id, unsigned long seen) {
+  while (true) {
+    {
+      unique_lock<mutex> state(stateMutex);
+      wakeup.wait(state, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+    }
+
+    runTasks(id);
+
+    lock_guard<mutex> state(stateMutex);
+    if (--active == 0) {
+      finished.notify_one();
+    }
+  }
+}
+
+// Runs tasks from the thread's own range, stealing more until every range is empty
+void ThreadPool::runTasks(int id) {
+  insidePoolTask = true;
+  int task;
+  while (takeTask(id, task) || (stealTasks(id) && takeTask(id, task))) {
+    (*currentBody)(task, id);
+  }
+  insidePoolTask = false;
+}
+
+// Takes the next task from the front of the thread's own range
+bool ThreadPool::takeTask(int id, int& task) {
+  lock_guard<mutex> guard(ranges[id].lock);
+  if (ranges[id].begin == ranges[id].end) {
+    return false;
+  }
+  task = ranges[id].begin++;
+  return true;
+}
+
+// Moves the back half of the first non-empty range of another thread into the thread's own range.
+// Returns false once every other range is empty
+bool ThreadPool::stealTasks(int id) {
+  for (int offset = 1; offset < threadCount; offset++) {
+    TaskRange& victim = ranges[(id + offset) % threadCount];
+    int begin, end;
+    {
+      lock_guard<mutex> guard(victim.lock);
+      int remaining = victim.end - victim.begin;
+      if (remaining == 0) {
+        continue;
+      }
+      begin = victim.begin + remaining / 2;
+      end = victim.end;
+      victim.end = begin;
+    }
+
+    lock_guard<mutex> guard(ranges[id].lock);
+    ranges[id].begin = begin;
+    ranges[id].end = end;
+    return true;
+  }
+  return false;
+}
+
+// BufferedWriter formats output into a large buffer and hands it to a FILE in big chunks, so writing a
+// token costs a few byte copies instead of a stream call, and nothing is flushed until the buffer fills
+class BufferedWriter {
+public:
+  BufferedWriter(FILE* out, size_t capacity = 1 << 20);
+  BufferedWriter(const BufferedWriter&) = delete;
+  BufferedWriter& operator=(const BufferedWriter&) = delete;
+  ~BufferedWriter();
+  void put(char c);
+  void write(const char* text, size_t length);
+  void write(const char* text);
+  void write(long long value);
+  void write(double value);
+  bool flush();
+private:
+  FILE* out;
+  vector<char> buffer;
+  size_t used;  // Bytes of the buffer holding output not yet handed to the FILE
+  bool failed;  // Set once a write to the FILE has failed
+  void makeRoom(size_t bytes);
+};
+
+// Constructor creates an empty buffer for the given FILE
+BufferedWriter::BufferedWriter(FILE* out, size_t capacity) : out(out), buffer(max(capacity, (size_t)64)), used(0), failed(false) {}
+
+// Destructor hands any remaining output to the FILE
+BufferedWriter::~BufferedWriter() {
+  flush();
+}
+
+// Writes one character
+void BufferedWriter::put(char c) {
+  makeRoom(1);
+  buffer[used++] = c;
+}
+
+// Writes the given bytes
+void BufferedWriter::write(const char* text, size_t length) {
+  if (length > buffer.size()) {
+    flush();
+    failed |= fwrite(text, 1, length, out) != length;
+    return;
+  }
+  makeRoom(length);
+  memcpy(buffer.data() + used, text, length);
+  used += length;
+}
+
+// Writes a null-terminated string
+void BufferedWriter::write(const char* text) {
+  write(text, strlen(text));
+}
+
+// Writes an integer in decimal
+void BufferedWriter::write(long long value) {
+  makeRoom(24);
+  used = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value).ptr - buffer.data();
+}
+
+// Writes a floating point number in the shortest form that reads back to the same value
+void BufferedWriter::write(double value) {
+  makeRoom(32);
+  used = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value).ptr - buffer.data();
+}
+
+// Hands the buffered output to the FILE. Returns false if any write has failed so far
+bool BufferedWriter::flush() {
+  if (used > 0) {
+    failed |= fwrite(buffer.data(), 1, used, out) != used;
+    used = 0;
+  }
+  return !failed;
+}
+
+// Flushes the buffer if it has less than the given number of free bytes
+void BufferedWriter::makeRoom(size_t bytes) {
+  if (buffer.size() - used < bytes) {
+    flush();
+  }
+}
+
+// Returns true if a product whose left operand has the given number of entries is large enough to be
+// worth splitting across the thread pool
+static bool multiplyInParallel(long long leftNnz) {
+  return ThreadPool::instance().numThreads() > 1 && leftNnz >= 8192;
+}
+
+// CompressedView is a non-owning view of compressed sparse arrays. The entries of major index i are
+// idx[ptr[i] .. ptr[i+1]) and val[ptr[i] .. ptr[i+1]), sorted by minor index. For CSR storage the
+// major dimension is the row, for CSC storage it is the column
+struct CompressedView {
+  int numMajor, numMinor;
+  const int* ptr;
+  const int* idx;
+  const int* val;
+};
+
+// CSRMatrix stores a sparse matrix in compressed sparse row form using contiguous arrays
+class CSRMatrix {
+public:
+  int numRows, numCols;
+  vector<int> rowPtr; // Row i occupies positions rowPtr[i] .. rowPtr[i+1]-1 of colIdx and values
+  vector<int> colIdx;
+  vector<int> values;
+  CSRMatrix();
+  CSRMatrix(int rows, int cols);
+  int nnz() const;
+  CompressedView view() const;
+  CSRMatrix transpose() const;
+  CSRMatrix operator+(const CSRMatrix& other) const;
+  CSRMatrix operator-(const CSRMatrix& other) const;
+  CSRMatrix operator*(const CSRMatrix& other) const;
+  void multiplyVector(const vector<double>& x, vector<double>& y) const;
+  void multiplyTransposeVector(const vector<double>& x, vector<double>& y) const;
+  void multiplyDense(const vector<double>& x, int k, vector<double>& y) const;
+  void dropZeros();
+  void print() const;
+};
+
+// CSCMatrix stores a sparse matrix in compressed sparse column form using contiguous arrays
+class CSCMatrix {
+public:
+  int numRows, numCols;
+  vector<int> colPtr; // Column j occupies positions colPtr[j] .. colPtr[j+1]-1 of rowIdx and values
+  vector<int> rowIdx;
+  vector<int> values;
+  CSCMatrix();
+  CSCMatrix(int rows, int cols);
+  CSCMatrix(const CSRMatrix& csr);
+  int nnz() const;
+  CompressedView view() const;
+  CSRMatrix toCSR() const;
+  CSCMatrix transpose() const;
+  CSCMatrix operator+(const CSCMatrix& other) const;
+  CSCMatrix operator-(const CSCMatrix& other) const;
+  CSCMatrix operator*(const CSCMatrix& other) const;
+  void print() const;
+};
+
+// MultiplyPlan computes the pattern of a CSR product A*B once so that products of operands with the same
+// patterns but new values only redo the numeric work. The symbolic phase records the result pattern and,
+// for every partial product a(i,k) * b(k,j) in the order the numeric phase forms it, the position of
+// (i, j) in the result arrays; execute() then does one multiply-add per partial product with no
+// accumulator, search or sort. The plan keeps the operand patterns and refuses operands that differ
+class MultiplyPlan {
+public:
+  MultiplyPlan();
+  MultiplyPlan(const CompressedView& a, const CompressedView& b);
+  MultiplyPlan(const CSRMatrix& a, const CSRMatrix& b);
+  bool matches(const CompressedView& a, const CompressedView& b) const;
+  bool execute(const CompressedView& a, const CompressedView& b, CSRMatrix& result) const;
+  bool execute(const CSRMatrix& a, const CSRMatrix& b, CSRMatrix& result) const;
+  int nnz() const;
+  long long products() const;
+private:
+  int numRows, numInner, numCols;
+  vector<int> aPtr, aIdx;       // Pattern of the left operand
+  vector<int> bPtr, bIdx;       // Pattern of the right operand
+  vector<int> rowPtr, colIdx;   // Pattern of the product
+  vector<long long> productPtr; // Partial products of row i are slots[productPtr[i] .. productPtr[i+1])
+  vector<int> slots;            // Position in colIdx of the result entry of every partial product
+};
+
+// BSRMatrix stores a sparse matrix in block sparse row form: the matrix is tiled into blockSize x blockSize
+// blocks and every block holding an entry is stored whole, column-major, in values. Matrices made of small
+// dense blocks, such as finite-element matrices with several unknowns per mesh node, keep one column
+// index per block instead of one node or index per entry. The kernels work on whole blocks, with loops
+// specialized at compile time for block sizes 2, 3, 4, 6 and 8
+class BSRMatrix {
+public:
+  int numRows, numCols;
+  int blockSize;
+  int numBlockRows, numBlockCols; // The last block row and column may reach past the matrix
+  vector<int> blockRowPtr;        // Block row i holds blocks blockRowPtr[i] .. blockRowPtr[i+1]-1
+  vector<int> blockColIdx;
+  vector<int> values;             // blockSize * blockSize values per block; (r, c) is at c * blockSize + r
+  BSRMatrix();
+  BSRMatrix(int rows, int cols, int blockSize);
+  BSRMatrix(const CSRMatrix& csr, int blockSize = 0);
+  static int detectBlockSize(const CSRMatrix& csr);
+  int numBlocks() const;
+  CSRMatrix toCSR() const;
+  BSRMatrix operator+(const BSRMatrix& other) const;
+  BSRMatrix operator-(const BSRMatrix& other) const;
+  BSRMatrix operator*(const BSRMatrix& other) const;
+  void multiplyVector(const vector<double>& x, vector<double>& y) const;
+  void print() const;
+};
+
+class TransposedView;
+template <class Derived>
+struct LazyExpression;
+
+// PruneOptions selects the entries a pruned product keeps in every row. An entry is dropped if its
+// magnitude is below threshold or below relative times the largest magnitude in its row, and of the
+// rest only the topK of largest magnitude are kept, ties going to the lower column. Zero values turn
+// a rule off; with all of them off the pruned product equals the plain one
+struct PruneOptions {
+  int threshold = 0;
+  double relative = 0;
+  int topK = 0;
+};
+
 // SparseMatrix class represents the sparse matrix and its operations
 class SparseMatrix {
 private:
-  int numRows, numCols;
-  Header** rowHeaders;
-  Header** colHeaders;
+  int numRows, numCols;
+  Header** rowHeaders;
+  Header** colHeaders;
+  NodePool pool; // Owns every node of the matrix
+  mutable SliceIndex rowIndex; // Sorted nodes of the rows used by point access
+  mutable SliceIndex colIndex; // Sorted nodes of the columns used by point access
+public:
+  SparseMatrix();
+  SparseMatrix(int rows, int cols);
+  SparseMatrix(const CSRMatrix& csr);
+  SparseMatrix(const CSCMatrix& csc);
+  SparseMatrix(const BSRMatrix& bsr);
+  SparseMatrix(const CompressedView& csr);
+  SparseMatrix(const SparseMatrix& other);
+  SparseMatrix(SparseMatrix&& other) noexcept;
+  ~SparseMatrix();
+  SparseMatrix& operator=(const SparseMatrix& other);
+  SparseMatrix& operator=(SparseMatrix&& other) noexcept;
+  void swap(SparseMatrix& other) noexcept;
+  int getRows() const;
+  int getCols() const;
+  int nnz() const;
+  void insert(int row, int col, int value);
+  int get(int row, int col) const;
+  void set(int row, int col, int value);
+  bool erase(int row, int col);
+  void replaceRow(int row, const int* cols, const int* vals, int count);
+  void print() const;
+  void printWindow(int firstRow, int firstCol, int rows, int cols, FILE* out = stdout) const;
+  bool writeCoordinate(FILE* out, bool matrixMarket = true) const;
+  SparseMatrix transpose() const;
+  TransposedView transposedView() const;
+  SparseMatrix operator+(const SparseMatrix& other) const;
+  SparseMatrix operator-(const SparseMatrix& other) const;
+  SparseMatrix operator*(const SparseMatrix& other) const;
+  SparseMatrix operator+(const TransposedView& other) const;
+  SparseMatrix operator-(const TransposedView& other) const;
+  SparseMatrix operator*(const TransposedView& other) const;
+  SparseMatrix multiplyMasked(const SparseMatrix& other, const SparseMatrix& mask, bool complement = false) const;
+  SparseMatrix multiplyPruned(const SparseMatrix& other, const PruneOptions& options) const;
+  SparseMatrix& operator+=(const SparseMatrix& other);
+  SparseMatrix& operator-=(const SparseMatrix& other);
+  SparseMatrix& operator*=(int factor);
+  SparseMatrix& axpy(int alpha, const SparseMatrix& other);
+  template <class E>
+  SparseMatrix& operator+=(const LazyExpression<E>& expr);
+  template <class E>
+  SparseMatrix& operator-=(const LazyExpression<E>& expr);
+  CSRMatrix toCSR() const;
+  CSCMatrix toCSC() const;
+  BSRMatrix toBSR(int blockSize = 0) const;
+  SparseMatrix permute(const vector<int>& rowOrder, const vector<int>& colOrder) const;
+  bool saveSnapshot(const string& path, string& error) const;
+  vector<double> multiplyVector(const vector<double>& x) const;
+  vector<double> multiplyTransposeVector(const vector<double>& x) const;
+  void clear();
+  void assign(const CSRMatrix& csr);
+  size_t bytesReserved() const;
+  size_t bytesUsed() const;
+  static void setNumThreads(int n);
+  static int getNumThreads();
+private:
+  struct RowAccess;
+  struct ColumnAccess;
+  friend class TransposedView;
+  friend class LazyMatrix;
+  friend class IncrementalProduct;
+  template <class Left, class Right, class Emit>
+  static void mergeRows(const Left& a, const Right& b, int i, int sign, Emit emit);
+  template <class Left, class Right>
+  static SparseMatrix addAccess(const Left& a, const Right& b, int sign);
+  template <class Left, class Right>
+  static SparseMatrix multiplyAccess(const Left& a, const Right& b);
+  template <class E>
+  void mergeExpression(const E& expr, int sign);
+  template <class ForRow>
+  void mergeRow(int row, ForRow forRow, vector<Node*>& colAbove);
+  Node* predecessor(SliceIndex& index, int s, Node* header, int numSlices, int key, bool rowList) const;
+  void createHeaders();
+  void appendNode(Node*& rowTail, int row, int col, int value, vector<Node*>& colTail);
+  void appendRow(int row, const int* cols, const int* vals, int count, vector<Node*>& colTail);
+  void linkCSR(const CompressedView& csr);
+};
+
+// SnapshotHeader starts a binary snapshot file. The CSR arrays follow it, each starting at a 64-byte
+// aligned offset so they can be used in place once the file is mapped
+struct SnapshotHeader {
+  char magic[8];         // "SPMXSNAP"
+  uint32_t version;      // SNAPSHOT_VERSION when written
+  uint32_t byteOrder;    // 0x01020304 in the byte order of the machine that wrote the file
+  uint32_t valueType;    // SNAPSHOT_INT32
+  uint32_t indexType;    // SNAPSHOT_INT32
+  int64_t rows, cols, nnz;
+  uint64_t rowPtrOffset; // Byte offsets of the arrays from the start of the file
+  uint64_t colIdxOffset;
+  uint64_t valuesOffset;
+  uint64_t fileSize;
+};
+
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_INT32 = 1;
+
+// MappedMatrix opens a binary snapshot with mmap and exposes its CSR arrays without copying them. Opening
+// checks the row pointers and column indices in one sequential pass; the values are read lazily on first
+// access, and processes that map the same file share one page-cached copy
+class MappedMatrix {
+public:
+  MappedMatrix();
+  MappedMatrix(const MappedMatrix&) = delete;
+  MappedMatrix& operator=(const MappedMatrix&) = delete;
+  ~MappedMatrix();
+  bool open(const string& path, string& error);
+  void close();
+  bool isOpen() const;
+  int getRows() const;
+  int getCols() const;
+  int nnz() const;
+  CompressedView view() const;
+  SparseMatrix toSparseMatrix() const;
+private:
+  void* mapping;
+  size_t mappedSize;
+  const SnapshotHeader* header;
+};
+
+bool saveSnapshot(const CompressedView& csr, const string& path, string& error);
+bool isSnapshotFile(const string& path);
+CSRMatrix addCSR(const CompressedView& a, const CompressedView& b);
+CSRMatrix subtractCSR(const CompressedView& a, const CompressedView& b);
+CSRMatrix multiplyCSR(const CompressedView& a, const CompressedView& b);
+CSRMatrix transposeCSR(const CompressedView& a);
+CSRMatrix multiplyMaskedCSR(const CompressedView& a, const CompressedView& b, const CompressedView& mask,
+                            bool complement = false);
+CSRMatrix multiplyPrunedCSR(const CompressedView& a, const CompressedView& b, const PruneOptions& options);
+
+// ChainStep is one product computed by multiplyChain: the product of matrices first .. split times the
+// product of matrices split+1 .. last, with the planner's estimates next to the measured values
+struct ChainStep {
+  int first, split, last;
+  long long estimatedProducts; // Partial products the planner expected
+  long long estimatedNnz;      // Entries of the result the planner expected
+  long long products;          // Partial products computed
+  long long nnz;               // Entries of the result
+};
+
+// ChainReport describes how multiplyChain computed a chain: the parenthesization it chose, its estimated
+// cost next to that of multiplying left to right, and the steps in the order they were computed. Costs
+// are counted in partial products
+struct ChainReport {
+  string order;              // For example "(M0 * (M1 * M2))"
+  long long estimatedCost;   // Estimated partial products of the chosen order
+  long long leftToRightCost; // Estimated partial products of ((M0 * M1) * M2) ...
+  long long cost;            // Partial products computed
+  double planSeconds;        // Time spent estimating and choosing the order
+  double multiplySeconds;    // Time spent multiplying
+  vector<ChainStep> steps;
+};
+
+bool multiplyChainCSR(const vector<CompressedView>& chain, CSRMatrix& result, string& error,
+                      ChainReport* report = nullptr);
+bool multiplyChain(const vector<const SparseMatrix*>& chain, SparseMatrix& result, string& error,
+                   ChainReport* report = nullptr);
+
+// OrderingMetrics measures how far the entries of a matrix lie from the diagonal. The bandwidth is the
+// largest |i - j| of an entry (i, j), and the profile the sum over the rows of the distance from the
+// first entry at or left of the diagonal to the diagonal. Smaller values mean that the rows a product
+// or SpMV touches together are stored close together
+struct OrderingMetrics {
+  long long bandwidth;
+  long long profile;
+};
+
+// Orderings list the old index of every new index: row or column order[k] of the matrix becomes row or
+// column k of the permuted one. The orderings below work on the symmetrized pattern of a square matrix
+vector<int> reverseCuthillMcKee(const CompressedView& a);
+vector<int> degreeOrdering(const CompressedView& a);
+vector<int> partitionOrdering(const CompressedView& a, int parts);
+vector<int> inversePermutation(const vector<int>& order);
+CSRMatrix permuteCSR(const CompressedView& a, const vector<int>& rowOrder, const vector<int>& colOrder);
+OrderingMetrics orderingMetrics(const CompressedView& a);
+
+// IncrementalProduct keeps the product C = A * B current while A and B change. Changes are logged by
+// setLeft and setRight and applied by update, which recomputes only the rows of C that can have
+// changed: the changed rows of A, and the rows of A with an entry in a column k whose row k of B
+// changed. The recomputed rows replace the old ones in place, so C is never rebuilt from scratch
+// unless most of its rows are affected
+class IncrementalProduct {
+public:
+  IncrementalProduct(const SparseMatrix& left, const SparseMatrix& right);
+  void setLeft(int row, int col, int value);
+  void setRight(int row, int col, int value);
+  size_t pending() const;
+  int update();
+  const SparseMatrix& left() const;
+  const SparseMatrix& right() const;
+  const SparseMatrix& product() const;
+private:
+  // One logged change: the entry (row, col) of A, or of B if right is set, becomes value
+  struct Change {
+    bool right;
+    int row, col, value;
+  };
+  SparseMatrix a, b, c;
+  vector<Change> changes;      // Changes logged since the last update
+  vector<char> affected;       // Marks the rows of C collected for recomputation
+  SparseAccumulator accumulator;
+};
+
+// OutOfCoreStats reports what multiplyOutOfCore did. The wait times show which stage limited the
+// pipeline: a compute stage that waits for panels is bound by the reads, one that waits for room in
+// the write queue is bound by the writes
+struct OutOfCoreStats {
+  int panels;              // Row panels the left operand was read in
+  long long nnz;           // Entries of the result
+  long long bytesRead;     // Bytes read from the left operand
+  long long bytesWritten;  // Bytes written to the result file, spooled values included
+  double readWaitSeconds;  // Time the compute stage waited for a panel to be read
+  double writeWaitSeconds; // Time the compute stage waited for a result panel to be taken
+};
+
+bool multiplyOutOfCore(const string& leftPath, const string& rightPath, const string& outputPath,
+                       size_t memoryBudget, string& error, OutOfCoreStats* stats = nullptr);
+void spmv(const CompressedView& a, const double* x, double* y);
+void spmvTranspose(const CompressedView& a, const double* x, double* y);
+void spmm(const CompressedView& a, const double* x, int k, double* y);
+const char* spmvKernelName();
+const char* bsrKernelName();
+
+// TransposedView presents a SparseMatrix as its transpose without copying it: row i of the view is
+// column i of the matrix, read through the down pointers. It can be used directly as an operand of
+// the arithmetic operators
+class TransposedView {
+public:
+  TransposedView(const SparseMatrix& matrix);
+  int getRows() const;
+  int getCols() const;
+  SparseMatrix materialize() const;
+  SparseMatrix operator+(const SparseMatrix& other) const;
+  SparseMatrix operator-(const SparseMatrix& other) const;
+  SparseMatrix operator*(const SparseMatrix& other) const;
+  SparseMatrix operator*(const TransposedView& other) const;
+private:
+  const SparseMatrix& matrix;
+  friend class SparseMatrix;
+  friend class LazyMatrix;
+};
+
+// Triplet holds one (row, column, value) entry of a matrix in coordinate (COO) form
+struct Triplet {
+  int row, col, value;
+};
+
+// COOBuilder collects entries in coordinate form, in any order, and builds a matrix from them in
+// O(nnz + rows + cols): the entries are ordered with two counting sorts, duplicates are merged, and
+// the linked list is linked in a single pass
+class COOBuilder {
+public:
+  enum DuplicatePolicy {
+    SUM_DUPLICATES, // Entries at the same position are added together
+    KEEP_LAST       // The entry added last wins
+  };
+  COOBuilder(int rows, int cols, DuplicatePolicy policy = SUM_DUPLICATES);
+  void setSize(int rows, int cols);
+  void reserve(size_t count);
+  void add(int row, int col, int value);
+  void add(const vector<Triplet>& batch);
+  size_t size() const;
+  CSRMatrix toCSR() const;
+  SparseMatrix build() const;
+private:
+  int numRows, numCols;
+  DuplicatePolicy policy;
+  vector<Triplet> entries;
+};
+
+// Default constructor initializes the sparse matrix with 0 rows, 0 columns, and NULL headers
+SparseMatrix::SparseMatrix() {
+  numRows = 0;
+  numCols = 0;
+  colHeaders = NULL;
+  rowHeaders = NULL;
+}
+
+// Constructor with parameters initializes the sparse matrix with specified rows and columns
+SparseMatrix::SparseMatrix(int rows, int cols) {
+  numRows = rows;
+  numCols = cols;
+  colHeaders = new Header*[numCols];
+  rowHeaders = new Header*[numRows];
+  createHeaders();
+}
+
+// Constructor that converts a CSR matrix into the linked list representation
+SparseMatrix::SparseMatrix(const CSRMatrix& csr) : SparseMatrix(csr.numRows, csr.numCols) {
+  linkCSR(csr.view());
+}
+
+// Constructor that converts a CSC matrix into the linked list representation
+SparseMatrix::SparseMatrix(const CSCMatrix& csc) : SparseMatrix(csc.numRows, csc.numCols) {
+  linkCSR(csc.toCSR().view());
+}
+
+// Constructor that converts a BSR matrix into the linked list representation, leaving out the zeros
+// stored inside its blocks
+SparseMatrix::SparseMatrix(const BSRMatrix& bsr) : SparseMatrix(bsr.numRows, bsr.numCols) {
+  linkCSR(bsr.toCSR().view());
+}
+
+// Constructor that copies compressed sparse row arrays, such as those of a MappedMatrix, into the linked list
+SparseMatrix::SparseMatrix(const CompressedView& csr) : SparseMatrix(csr.numMajor, csr.numMinor) {
+  linkCSR(csr);
+}
+
+// Copy constructor that links a copy of every node of the other matrix in a single pass
+SparseMatrix::SparseMatrix(const SparseMatrix& other) : SparseMatrix(other.numRows, other.numCols) {
+  vector<Node*> colTail(colHeaders, colHeaders + numCols);
+  for (int i = 0; i < numRows; i++) {
+    Node* rowTail = rowHeaders[i];
+    for (Node* node = other.rowHeaders[i]->right; node != nullptr; node = node->right) {
+      appendNode(rowTail, i, node->col, node->value, colTail);
+    }
+  }
+}
+
+// Move constructor that takes over the headers and nodes of the other matrix, leaving it with 0 rows
+// and 0 columns
+SparseMatrix::SparseMatrix(SparseMatrix&& other) noexcept : SparseMatrix() {
+  swap(other);
+}
+
+// Destructor for freeing the memory occupied by the sparse matrix. The pool frees every node at once
+SparseMatrix::~SparseMatrix() {
+  delete[] rowHeaders; // Delete the array of row headers
+  delete[] colHeaders; // Delete the array of column headers
+}
+
+// Copy assignment replaces the matrix with a copy of the other one
+SparseMatrix& SparseMatrix::operator=(const SparseMatrix& other) {
+  if (this != &other) {
+    SparseMatrix copy(other);
+    swap(copy);
+  }
+  return *this;
+}
+
+// Move assignment takes over the other matrix and frees the previous contents, leaving the other
+// matrix with 0 rows and 0 columns
+SparseMatrix& SparseMatrix::operator=(SparseMatrix&& other) noexcept {
+  if (this != &other) {
+    SparseMatrix previous(std::move(*this));
+    swap(other);
+  }
+  return *this;
+}
+
+// Exchanges the contents of two matrices without copying any node
+void SparseMatrix::swap(SparseMatrix& other) noexcept {
+  std::swap(numRows, other.numRows);
+  std::swap(numCols, other.numCols);
+  std::swap(rowHeaders, other.rowHeaders);
+  std::swap(colHeaders, other.colHeaders);
+  pool.swap(other.pool);
+  rowIndex.swap(other.rowIndex);
+  colIndex.swap(other.colIndex);
+}
+
+// Returns the number of rows
+int SparseMatrix::getRows() const {
+  return numRows;
+}
+
+// Returns the number of columns
+int SparseMatrix::getCols() const {
+  return numCols;
+}
+
+// Returns the number of stored entries, counted by the node pool without walking the lists
+int SparseMatrix::nnz() const {
+  return pool.liveInternals();
+}
+
+// Creates the row and column headers from the pool
+void SparseMatrix::createHeaders() {
+  // Create column headers and set the column index
+  for (int i = 0; i < numCols; i++) {
+    colHeaders[i] = pool.newHeader(-1, i);
+  }
+
+  // Create row headers and set the row index
+  for (int i = 0; i < numRows; i++) {
+    rowHeaders[i] = pool.newHeader(i, -1);
+  }
+}
+
+// Removes every entry while keeping the pool's blocks, so the matrix can be refilled without new allocations
+void SparseMatrix::clear() {
+  pool.reset();
+  rowIndex.clear();
+  colIndex.clear();
+  createHeaders();
+}
+
+// Replaces every entry with the entries of CSR arrays of the same shape, linked in a single pass
+void SparseMatrix::assign(const CSRMatrix& csr) {
+  clear();
+  linkCSR(csr.view());
+}
+
+// Returns the number of bytes the matrix has reserved for its nodes
+size_t SparseMatrix::bytesReserved() const {
+  return pool.bytesReserved();
+}
+
+// Returns the number of bytes taken by the nodes of the matrix
+size_t SparseMatrix::bytesUsed() const {
+  return pool.bytesUsed();
+}
+
+// Returns the last node of a row (rowList) or column list that comes before the given key, or the
+// header if there is none. Lists are walked from the header up to WALK_LIMIT nodes; longer lists are
+// indexed on the way and searched by binary search from then on
+Node* SparseMatrix::predecessor(SliceIndex& index, int s, Node* header, int numSlices, int key, bool rowList) const {
+  SliceIndex::Slice* slice = index.built(s);
+  if (slice == nullptr) {
+    Node* node = header;
+    int steps = 0;
+    for (Node* next = rowList ? node->right : node->down; next != nullptr && (rowList ? next->col : next->row) < key; next = rowList ? node->right : node->down) {
+      if (steps == SliceIndex::WALK_LIMIT) {
+        break;
+      }
+      node = next;
+      steps++;
+    }
+    STATS_ONLY(pointTally.visited += steps);
+    if (steps < SliceIndex::WALK_LIMIT) {
+      return node;
+    }
+    slice = &index.build(s, header, numSlices, rowList);
+  }
+  return slice->before(key, header);
+}
+
+// Function for inserting a new internal node with the given row, column, and value into the sparse matrix.
+// If the position already holds a node, its value is replaced instead. Long rows and columns are searched
+// through the slice indexes, so an insert costs O(log n) plus its share of the batched index updates
+void SparseMatrix::insert(int row, int col, int value) {
+  // Inserts are counted in the thread's tally but not timed: reading the clock costs more than a short insert
+  STATS_ONLY(pointTally.countInsert());
+
+  // Find the node left of the new one in its row, and update the node already at this position, if any
+  Node* currRowHeader = predecessor(rowIndex, row, rowHeaders[row], numRows, col, true);
+  if (currRowHeader->right != NULL && currRowHeader->right->col == col) {
+    currRowHeader->right->value = value;
+    return;
+  }
+
+  // Find the node above the new one in its column
+  Node* currColHeader = predecessor(colIndex, col, colHeaders[col], numCols, row, false);
+
+  // Create a new interrnal node with the given row, column, and value
+  Internal* node = pool.newInternal(row, col, value);
+
+  // Insert the new node into the row
+  node->right = currRowHeader->right;
+  currRowHeader->right = node;
+  node->left = currRowHeader;
+
+  // Update the links of the neighboring nodes
+  if (node->right != NULL) {
+    node->right->left = node;
+  }
+
+  // Insert the new node into the column
+  node->down = currColHeader->down;
+  currColHeader->down = node;
+  node->up = currColHeader;
+
+  // Update the links of the neighboring nodes
+  if (node->down != NULL) {
+    node->down->up = node;
+  }
+
+  rowIndex.insert(row, col, node);
+  colIndex.insert(col, row, node);
+}
+
+// Returns the value at the given position, or 0 if the position holds no entry
+int SparseMatrix::get(int row, int col) const {
+  Node* left = predecessor(rowIndex, row, rowHeaders[row], numRows, col, true);
+  return left->right != nullptr && left->right->col == col ? left->right->value : 0;
+}
+
+// Stores a value at the given position, updating the node in place if there is one. Setting a value of
+// 0 removes the entry
+void SparseMatrix::set(int row, int col, int value) {
+  if (value == 0) {
+    erase(row, col);
+  }
+  else {
+    insert(row, col, value);
+  }
+}
+
+// Removes the entry at the given position, unlinking it from its row and column lists and returning
+// the node to the pool. Returns false if the position holds no entry
+bool SparseMatrix::erase(int row, int col) {
+  Node* left = predecessor(rowIndex, row, rowHeaders[row], numRows, col, true);
+  Node* node = left->right;
+  if (node == nullptr || node->col != col) {
+    return false;
+  }
+
+  // Unlink the node from its row and its column
+  node->left->right = node->right;
+  if (node->right != nullptr) {
+    node->right->left = node->left;
+  }
+  node->up->down = node->down;
+  if (node->down != nullptr) {
+    node->down->up = node->up;
+  }
+
+  rowIndex.erase(row, col);
+  colIndex.erase(col, row);
+  pool.release(static_cast<Internal*>(node));
+  return true;
+}
+
+// Function for transposing the current matrix, creating a new matrix with swapped dimensions.
+// Column j of this matrix, read top to bottom, is row j of the result in column order, so every node is
+// appended to the result once and the transpose takes O(nnz + rows + cols)
+SparseMatrix SparseMatrix::transpose() const {
+  // Create a new matrix with the swapped dimensions
+  STATS_ONLY(StatsTimer timer(SparseStats::TRANSPOSE));
+  SparseMatrix result(numCols, numRows);
+  vector<Node*> colTail(result.colHeaders, result.colHeaders + numRows);
+  STATS_ONLY(long long entries = 0);
+
+  for (int j = 0; j < numCols; j++) {
+    Node* rowTail = result.rowHeaders[j];
+    for (Node* node = colHeaders[j]->down; node != nullptr; node = node->down) {
+      result.appendNode(rowTail, j, node->row, node->value, colTail);
+      STATS_ONLY(entries++);
+    }
+  }
+  STATS_ONLY(timer.setEntries(entries));
+  return result; // Return the transposed matrix
+}
+
+// Returns a view that presents this matrix as its transpose without copying it
+TransposedView SparseMatrix::transposedView() const {
+  return TransposedView(*this);
+}
+
+// RowAccess reads the rows of a matrix through the row lists
+struct SparseMatrix::RowAccess {
+  const SparseMatrix& m;
+  int rows() const { return m.numRows; }
+  int cols() const { return m.numCols; }
+  Node* first(int i) const { return m.rowHeaders[i]->right; }
+  static Node* next(Node* node) { return node->right; }
+  static int col(Node* node) { return node->col; }
+  int nnz() const { return m.nnz(); }
+  CSRMatrix toCSR() const { return m.toCSR(); }
+};
+
+// ColumnAccess reads the rows of the transpose of a matrix through its column lists
+struct SparseMatrix::ColumnAccess {
+  const SparseMatrix& m;
+  int rows() const { return m.numCols; }
+  int cols() const { return m.numRows; }
+  Node* first(int i) const { return m.colHeaders[i]->down; }
+  static Node* next(Node* node) { return node->down; }
+  static int col(Node* node) { return node->row; }
+  int nnz() const { return m.nnz(); }
+
+  // The CSC arrays of a matrix are the CSR arrays of its transpose
+  CSRMatrix toCSR() const {
+    CSCMatrix csc = m.toCSC();
+    CSRMatrix result(m.numCols, m.numRows);
+    result.rowPtr.swap(csc.colPtr);
+    result.colIdx.swap(csc.rowIdx);
+    result.values.swap(csc.values);
+    return result;
+  }
+};
+
+// Merges row i of two operands with two pointers, calling emit(col, value) in column order for every
+// position of a + sign * b. Positions whose sum is exactly zero, such as 1 + -1, are left out
+template <class Left, class Right, class Emit>
+void SparseMatrix::mergeRows(const Left& a, const Right& b, int i, int sign, Emit emit) {
+  Node* node1 = a.first(i); // Get the first node in the current row of the first matrix
+  Node* node2 = b.first(i); // Get the first node in the current row of the second matrix
+
+  while (node1 != nullptr || node2 != nullptr) {
+    int col, value;
+    // If node1 is null or node2 has a smaller column index, take node2 (negated when subtracting)
+    if (node1 == nullptr || (node2 != nullptr && Right::col(node2) < Left::col(node1))) {
+      col = Right::col(node2);
+      value = sign * node2->value;
+      node2 = Right::next(node2);
+    }
+    // If node2 is null or node1 has a smaller column index, take node1
+    else if (node2 == nullptr || Left::col(node1) < Right::col(node2)) {
+      col = Left::col(node1);
+      value = node1->value;
+      node1 = Left::next(node1);
+    }
+    // If both nodes have the same column index, combine their values
+    else {
+      col = Left::col(node1);
+      value = node1->value + sign * node2->value;
+      node1 = Left::next(node1);
+      node2 = Right::next(node2);
+    }
+    if (value != 0) {
+      emit(col, value);
+    }
+  }
+}
+
+// Adds (sign = 1) or subtracts (sign = -1) two operands row by row. With several threads, a symbolic
+// pass counts the entries of every result row, a prefix sum turns the counts into offsets into one
+// exactly sized run of nodes, and a numeric pass builds and links every row in its place; the column
+// links are then threaded in one pass over the run, which holds the nodes in row order
+template <class Left, class Right>
+SparseMatrix SparseMatrix::addAccess(const Left& a, const Right& b, int sign) {
+  STATS_ONLY(StatsTimer timer(sign > 0 ? SparseStats::ADD : SparseStats::SUBTRACT));
+
+  // Create a new SparseMatrix object for storing the result
+  SparseMatrix result(a.rows(), a.cols());
+  vector<Node*> colTail(result.colHeaders, result.colHeaders + a.cols());
+  int numRows = a.rows();
+  ThreadPool& threads = ThreadPool::instance();
+
+  if (threads.numThreads() == 1 || numRows < 1024) {
+    STATS_ONLY(long long entries = 0);
+    for (int i = 0; i < numRows; i++) {
+      Node* rowTail = result.rowHeaders[i];
+      mergeRows(a, b, i, sign, [&](int col, int value) {
+        result.appendNode(rowTail, i, col, value, colTail);
+        STATS_ONLY(entries++);
+      });
+    }
+    STATS_ONLY(timer.setEntries(entries));
+    return result; // Return the result matrix
+  }
+
+  int grain = max(1, numRows / (threads.numThreads() * 64)); // Rows per task
+  int numTasks = (numRows + grain - 1) / grain;
+  vector<int> ptr(numRows + 1, 0);
+
+  // Symbolic pass: count the entries of every result row
+  threads.parallelFor(numTasks, [&](int task, int) {
+    int last = min(numRows, (task + 1) * grain);
+    for (int i = task * grain; i < last; i++) {
+      int count = 0;
+      mergeRows(a, b, i, sign, [&](int, int) { count++; });
+      ptr[i + 1] = count;
+    }
+  });
+
+  for (int i = 0; i < numRows; i++) {
+    ptr[i + 1] += ptr[i];
+  }
+  Internal* nodes = result.pool.newInternals(ptr[numRows]);
+
+  // Numeric pass: build the nodes of every row in their preallocated places and link the row
+  threads.parallelFor(numTasks, [&](int task, int) {
+    int last = min(numRows, (task + 1) * grain);
+    for (int i = task * grain; i < last; i++) {
+      Internal* next = nodes + ptr[i];
+      Node* rowTail = result.rowHeaders[i];
+      mergeRows(a, b, i, sign, [&](int col, int value) {
+        Internal* node = new (next++) Internal(i, col, value);
+        node->left = rowTail;
+        rowTail->right = node;
+        rowTail = node;
+      });
+    }
+  });
+
+  // Append every node to the end of its column, top row first
+  for (int e = 0; e < ptr[numRows]; e++) {
+    Internal* node = nodes + e;
+    node->up = colTail[node->col];
+    colTail[node->col]->down = node;
+    colTail[node->col] = node;
+  }
+  STATS_ONLY(timer.setEntries(ptr[numRows]));
+  return result; // Return the result matrix
+}
+
+// Multiplies two operands. Each result row is accumulated on its own (Gustavson's algorithm) and then
+// appended in one sorted pass
+template <class Left, class Right>
+SparseMatrix SparseMatrix::multiplyAccess(const Left& a, const Right& b) {
+  STATS_ONLY(StatsTimer timer(SparseStats::MULTIPLY));
+
+  // Large products are computed on the thread pool from compressed copies of the operands. The entry
+  // count is kept by the node pool, so small products never pay for the copies
+  if (multiplyInParallel(a.nnz())) {
+    CSRMatrix product = a.toCSR() * b.toCSR();
+    STATS_ONLY(timer.setEntries(product.nnz()));
+    return SparseMatrix(product);
+  }
+
+  // Create a new SparseMatrix object for storing the result
+  SparseMatrix result(a.rows(), b.cols());
+  SparseAccumulator accumulator(b.cols());
+  vector<Node*> colTail(result.colHeaders, result.colHeaders + b.cols());
+  vector<int> cols, vals;
+  STATS_ONLY(long long entries = 0, products = 0, longestRow = 0);
+
+  for (int i = 0; i < a.rows(); i++) {
+    STATS_ONLY(long long rowProducts = 0);
+    // Add the row of the second operand selected by every node in the current row of the first
+    for (Node* node1 = a.first(i); node1 != nullptr; node1 = Left::next(node1)) {
+      for (Node* node2 = b.first(Left::col(node1)); node2 != nullptr; node2 = Right::next(node2)) {
+        accumulator.add(Right::col(node2), node1->value * node2->value);
+        STATS_ONLY(rowProducts++);
+      }
+    }
+    STATS_ONLY(products += rowProducts);
+    STATS_ONLY(longestRow = max(longestRow, rowProducts));
+    STATS_ONLY(entries += accumulator.size());
+
+    // Emit the finished row in column order
+    cols.clear();
+    vals.clear();
+    accumulator.drain(cols, vals);
+    result.appendRow(i, cols.data(), vals.data(), cols.size(), colTail);
+  }
+  STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+  STATS_ONLY(SparseStats::raise(SparseStats::LONGEST_PRODUCT_ROW, longestRow));
+  STATS_ONLY(SparseStats::add(SparseStats::ACCUMULATOR_COLLISIONS, accumulator.takeCollisions()));
+  STATS_ONLY(timer.setEntries(entries));
+  return result; // Return the result matrix
+}
+
+// Operator overloading for matrix addition: Adds the first matrix and second matrix
+SparseMatrix SparseMatrix::operator+(const SparseMatrix& other) const {
+  return addAccess(RowAccess{*this}, RowAccess{other}, 1);
+}
+
+// Operator overloading for matrix subtraction: Subtracts the second matrix from the first matrix
+SparseMatrix SparseMatrix::operator-(const SparseMatrix& other) const {
+  return addAccess(RowAccess{*this}, RowAccess{other}, -1);
+}
+
+// Operator overloading for matrix multiplication: Multiplies the first matrix with the second matrix
+SparseMatrix SparseMatrix::operator*(const SparseMatrix& other) const {
+  return multiplyAccess(RowAccess{*this}, RowAccess{other});
+}
+
+// Adds a transposed view to the matrix
+SparseMatrix SparseMatrix::operator+(const TransposedView& other) const {
+  return addAccess(RowAccess{*this}, ColumnAccess{other.matrix}, 1);
+}
+
+// Subtracts a transposed view from the matrix
+SparseMatrix SparseMatrix::operator-(const TransposedView& other) const {
+  return addAccess(RowAccess{*this}, ColumnAccess{other.matrix}, -1);
+}
+
+// Multiplies the matrix by a transposed view
+SparseMatrix SparseMatrix::operator*(const TransposedView& other) const {
+  return multiplyAccess(RowAccess{*this}, ColumnAccess{other.matrix});
+}
+
+// Multiplies the matrix by another one, keeping only the entries of every result row that pass the
+// pruning options. Throws invalid_argument if the shapes do not match. See multiplyPrunedCSR
+SparseMatrix SparseMatrix::multiplyPruned(const SparseMatrix& other, const PruneOptions& options) const {
+  if (numCols != other.numRows) {
+    throw invalid_argument("multiplyPruned: a " + to_string(numRows) + "x" + to_string(numCols) + " matrix times a " +
+                           to_string(other.numRows) + "x" + to_string(other.numCols) + " matrix");
+  }
+  CSRMatrix left = toCSR(), right = other.toCSR();
+  return SparseMatrix(multiplyPrunedCSR(left.view(), right.view(), options));
+}
+
+// Multiplies the matrix by another one at the positions selected by a mask with the shape of the
+// product: only positions where the mask holds an entry are computed, or, with complement, only those
+// where it holds none. The values of the mask are ignored. Throws invalid_argument if the shapes do not
+// match. See multiplyMaskedCSR
+SparseMatrix SparseMatrix::multiplyMasked(const SparseMatrix& other, const SparseMatrix& mask, bool complement) const {
+  if (numCols != other.numRows || mask.numRows != numRows || mask.numCols != other.numCols) {
+    throw invalid_argument("multiplyMasked: a " + to_string(numRows) + "x" + to_string(numCols) + " matrix times a " +
+                           to_string(other.numRows) + "x" + to_string(other.numCols) + " matrix with a " +
+                           to_string(mask.numRows) + "x" + to_string(mask.numCols) + " mask");
+  }
+  CSRMatrix left = toCSR(), right = other.toCSR(), selected = mask.toCSR();
+  return SparseMatrix(multiplyMaskedCSR(left.view(), right.view(), selected.view(), complement));
+}
+
+// Constructor wraps a matrix without copying it; the matrix must outlive the view
+TransposedView::TransposedView(const SparseMatrix& matrix) : matrix(matrix) {}
+
+// Returns the number of rows of the view
+int TransposedView::getRows() const {
+  return matrix.numCols;
+}
+
+// Returns the number of columns of the view
+int TransposedView::getCols() const {
+  return matrix.numRows;
+}
+
+// Copies the view into a new matrix
+SparseMatrix TransposedView::materialize() const {
+  return matrix.transpose();
+}
+
+// Adds a matrix to the view
+SparseMatrix TransposedView::operator+(const SparseMatrix& other) const {
+  return SparseMatrix::addAccess(SparseMatrix::ColumnAccess{matrix}, SparseMatrix::RowAccess{other}, 1);
+}
+
+// Subtracts a matrix from the view
+SparseMatrix TransposedView::operator-(const SparseMatrix& other) const {
+  return SparseMatrix::addAccess(SparseMatrix::ColumnAccess{matrix}, SparseMatrix::RowAccess{other}, -1);
+}
+
+// Multiplies the view by a matrix
+SparseMatrix TransposedView::operator*(const SparseMatrix& other) const {
+  return SparseMatrix::multiplyAccess(SparseMatrix::ColumnAccess{matrix}, SparseMatrix::RowAccess{other});
+}
+
+// Multiplies the view by another transposed view
+SparseMatrix TransposedView::operator*(const TransposedView& other) const {
+  return SparseMatrix::multiplyAccess(SparseMatrix::ColumnAccess{matrix}, SparseMatrix::ColumnAccess{other.matrix});
+}
+
+// Sets the number of threads used by large additions, subtractions and multiplications; 0 or less uses every hardware thread
+void SparseMatrix::setNumThreads(int n) {
+  ThreadPool::instance().setNumThreads(n);
+}
+
+// Returns the number of threads used by large additions, subtractions and multiplications
+int SparseMatrix::getNumThreads() {
+  return ThreadPool::instance().numThreads();
+}
+
+// Converts the linked list into compressed sparse row arrays by walking each row once
+CSRMatrix SparseMatrix::toCSR() const {
+  CSRMatrix csr(numRows, numCols);
+  for (int i = 0; i < numRows; i++) {
+    for (Node* node = rowHeaders[i]->right; node != nullptr; node = node->right) {
+      csr.colIdx.push_back(node->col);
+      csr.values.push_back(node->value);
+    }
+    csr.rowPtr[i + 1] = csr.colIdx.size();
+  }
+  return csr;
+}
+
+// Converts the linked list into compressed sparse column arrays by walking each column once
+CSCMatrix SparseMatrix::toCSC() const {
+  CSCMatrix csc(numRows, numCols);
+  for (int j = 0; j < numCols; j++) {
+    for (Node* node = colHeaders[j]->down; node != nullptr; node = node->down) {
+      csc.rowIdx.push_back(node->row);
+      csc.values.push_back(node->value);
+    }
+    csc.colPtr[j + 1] = csc.rowIdx.size();
+  }
+  return csc;
+}
+
+// Converts the matrix into block sparse row form. A block size of 0 or less picks one with
+// BSRMatrix::detectBlockSize
+BSRMatrix SparseMatrix::toBSR(int blockSize) const {
+  return BSRMatrix(toCSR(), blockSize);
+}
+
+// Returns the matrix with its rows and columns reordered: row rowOrder[i] and column colOrder[j] become
+// row i and column j. The entries are sorted into place by permuteCSR and the result is linked in one
+// pass, without point inserts. Permuting the result with the inverse orders restores the matrix
+SparseMatrix SparseMatrix::permute(const vector<int>& rowOrder, const vector<int>& colOrder) const {
+  CSRMatrix csr = toCSR();
+  return SparseMatrix(permuteCSR(csr.view(), rowOrder, colOrder));
+}
+
+// Appends a new node after rowTail, which must be the last node of its row, and after the last node of
+// its column. Nodes must be appended in row-major order for the lists to stay sorted
+void SparseMatrix::appendNode(Node*& rowTail, int row, int col, int value, vector<Node*>& colTail) {
+  Internal* node = pool.newInternal(row, col, value);
+
+  // Append the node to the end of its row
+  node->left = rowTail;
+  rowTail->right = node;
+  rowTail = node;
+
+  // Append the node to the end of its column
+  node->up = colTail[col];
+  colTail[col]->down = node;
+  colTail[col] = node;
+}
+
+// Appends sorted entries to the end of an empty row. colTail holds the last node of every column, so
+// rows must be appended in increasing order for the columns to stay sorted
+void SparseMatrix::appendRow(int row, const int* cols, const int* vals, int count, vector<Node*>& colTail) {
+  Node* rowTail = rowHeaders[row];
+  for (int e = 0; e < count; e++) {
+    appendNode(rowTail, row, cols[e], vals[e], colTail);
+  }
+}
+
+// Links the entries of CSR arrays into an empty matrix of the same shape in a single pass
+void SparseMatrix::linkCSR(const CompressedView& csr) {
+  vector<Node*> colTail(colHeaders, colHeaders + numCols);
+  for (int i = 0; i < numRows; i++) {
+    int start = csr.ptr[i];
+    appendRow(i, csr.idx + start, csr.val + start, csr.ptr[i + 1] - start, colTail);
+  }
+}
+
+// Prints the sparse matrix in a readable format
+void SparseMatrix::print() const {
+  printWindow(0, 0, numRows, numCols);
+}
+
+// Prints the block of rows firstRow .. firstRow+rows-1 and columns firstCol .. firstCol+cols-1 in the
+// dense layout of print(), clipped to the matrix. Only the rows of the window are visited, so a small
+// preview of a huge matrix is cheap
+void SparseMatrix::printWindow(int firstRow, int firstCol, int rows, int cols, FILE* out) const {
+  BufferedWriter writer(out);
+  int lastRow = min(numRows, firstRow + rows);
+  int lastCol = min(numCols, firstCol + cols);
+  for (int i = max(0, firstRow); i < lastRow; i++) {
+    Node* node = rowHeaders[i]->right; // Get the first node in the current row of the sparse matrix
+    while (node != nullptr && node->col < firstCol) {
+      node = node->right; // Skip the nodes left of the window
+    }
+
+    for (int j = max(0, firstCol); j < lastCol; j++) {
+      // If there is a node and its column index matches the current column index, print its value
+      if (node != nullptr && node->col == j) {
+        writer.write((long long)node->value);
+        writer.put('\t');
+        node = node->right; // Move to the next node in the row
+      }
+      // Otherwise the position holds no entry, so print 0
+      else {
+        writer.write("0\t", 2);
+      }
+    }
+    writer.put('\n'); // Move to the next row
+  }
+}
+
+// Writes only the entries, one 1-based "row column value" line each, in row-major order. With
+// matrixMarket the lines are preceded by a Matrix Market integer coordinate header, otherwise they are
+// plain triplets. Returns false if writing failed
+bool SparseMatrix::writeCoordinate(FILE* out, bool matrixMarket) const {
+  BufferedWriter writer(out);
+  if (matrixMarket) {
+    long long nnz = 0;
+    for (int i = 0; i < numRows; i++) {
+      for (Node* node = rowHeaders[i]->right; node != nullptr; node = node->right) {
+        nnz++;
+      }
+    }
+    writer.write("%%MatrixMarket matrix coordinate integer general\n");
+    writer.write((long long)numRows);
+    writer.put(' ');
+    writer.write((long long)numCols);
+    writer.put(' ');
+    writer.write(nnz);
+    writer.put('\n');
+  }
+
+  for (int i = 0; i < numRows; i++) {
+    for (Node* node = rowHeaders[i]->right; node != nullptr; node = node->right) {
+      writer.write((long long)i + 1);
+      writer.put(' ');
+      writer.write((long long)node->col + 1);
+      writer.put(' ');
+      writer.write((long long)node->value);
+      writer.put('\n');
+    }
+  }
+  return writer.flush();
+}
+
+// Adds (sign = 1) or subtracts (sign = -1) two compressed matrices of the same orientation by merging
+// each pair of major slices with two pointers. Sums that are exactly zero are not stored
+static void addCompressed(const CompressedView& a, const CompressedView& b, int sign,
+                          vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  STATS_ONLY(StatsTimer timer(SparseStats::COMPRESSED_ADD));
+  ptr.assign(a.numMajor + 1, 0);
+  idx.clear();
+  val.clear();
+  idx.reserve(a.ptr[a.numMajor] + b.ptr[b.numMajor]);
+  val.reserve(a.ptr[a.numMajor] + b.ptr[b.numMajor]);
+
+  for (int i = 0; i < a.numMajor; i++) {
+    int p = a.ptr[i], pEnd = a.ptr[i + 1];
+    int q = b.ptr[i], qEnd = b.ptr[i + 1];
+
+    while (p < pEnd || q < qEnd) {
+      if (p == pEnd || (q < qEnd && b.idx[q] < a.idx[p])) {
+        idx.push_back(b.idx[q]);
+        val.push_back(sign * b.val[q]);
+        q++;
+      }
+      else if (q == qEnd || a.idx[p] < b.idx[q]) {
+        idx.push_back(a.idx[p]);
+        val.push_back(a.val[p]);
+        p++;
+      }
+      else {
+        idx.push_back(a.idx[p]);
+        val.push_back(a.val[p] + sign * b.val[q]);
+        p++;
+        q++;
+      }
+      if (val.back() == 0) {
+        idx.pop_back();
+        val.pop_back();
+      }
+    }
+    ptr[i + 1] = idx.size();
+  }
+  STATS_ONLY(timer.setEntries(idx.size()));
+}
+
+// Estimates the entries of a product row as the average row length of a times that of b, to pick and
+// size the accumulators. The estimate ignores collisions, so it is an upper bound for uniform rows
+static int expectedProductFill(const CompressedView& a, const CompressedView& b) {
+  if (a.numMajor == 0 || b.numMajor == 0) {
+    return 0;
+  }
+  double fill = double(a.ptr[a.numMajor]) / a.numMajor * b.ptr[b.numMajor] / b.numMajor;
+  return (int)min<double>(ceil(fill), b.numMinor);
+}
+
+// Multiplies two compressed matrices on the thread pool. Major slices are grouped into tasks, and every
+// thread has its own accumulator. A symbolic pass counts the entries of each result slice, a prefix sum
+// turns the counts into offsets, and a numeric pass writes each slice straight into its final place,
+// so no locking is needed to assemble the result
+static void multiplyCompressedParallel(const CompressedView& a, const CompressedView& b,
+                                       vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  ThreadPool& pool = ThreadPool::instance();
+  vector<SparseAccumulator> accumulators(pool.numThreads(), SparseAccumulator(b.numMinor, expectedProductFill(a, b)));
+  int grain = max(1, a.numMajor / (pool.numThreads() * 64)); // Slices per task
+  int numTasks = (a.numMajor + grain - 1) / grain;
+
+  ptr.assign(a.numMajor + 1, 0);
+
+  // Symbolic pass: count the distinct minor indices of every result slice
+  pool.parallelFor(numTasks, [&](int task, int thread) {
+    SparseAccumulator& accumulator = accumulators[thread];
+    int last = min(a.numMajor, (task + 1) * grain);
+    for (int i = task * grain; i < last; i++) {
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+          accumulator.add(b.idx[q], 0);
+        }
+      }
+      ptr[i + 1] = accumulator.size();
+      accumulator.clear();
+    }
+  });
+
+  for (int i = 0; i < a.numMajor; i++) {
+    ptr[i + 1] += ptr[i];
+  }
+  idx.resize(ptr[a.numMajor]);
+  val.resize(ptr[a.numMajor]);
+
+  // Numeric pass: accumulate every slice again and write it into its preallocated range
+  pool.parallelFor(numTasks, [&](int task, int thread) {
+    SparseAccumulator& accumulator = accumulators[thread];
+    int last = min(a.numMajor, (task + 1) * grain);
+    STATS_ONLY(long long products = 0, longestRow = 0);
+    for (int i = task * grain; i < last; i++) {
+      STATS_ONLY(long long rowProducts = 0);
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        STATS_ONLY(rowProducts += b.ptr[k + 1] - b.ptr[k]);
+        for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+          accumulator.add(b.idx[q], a.val[p] * b.val[q]);
+        }
+      }
+      STATS_ONLY(products += rowProducts);
+      STATS_ONLY(longestRow = max(longestRow, rowProducts));
+      accumulator.drainTo(idx.data() + ptr[i], val.data() + ptr[i]);
+    }
+    STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+    STATS_ONLY(SparseStats::raise(SparseStats::LONGEST_PRODUCT_ROW, longestRow));
+  });
+
+  // Both passes probe the same keys, so the collisions of each accumulator are counted twice
+  for (size_t t = 0; t < accumulators.size(); t++) {
+    STATS_ONLY(SparseStats::add(SparseStats::ACCUMULATOR_COLLISIONS, accumulators[t].takeCollisions() / 2));
+  }
+}
+
+// Multiplies two compressed matrices slice by slice: major slice i of the result is the sum of the major
+// slices of b selected by the entries of slice i of a, gathered in a sparse accumulator
+static void multiplyCompressed(const CompressedView& a, const CompressedView& b,
+                               vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  STATS_ONLY(StatsTimer timer(SparseStats::COMPRESSED_MULTIPLY));
+  if (multiplyInParallel(a.ptr[a.numMajor])) {
+    multiplyCompressedParallel(a, b, ptr, idx, val);
+    STATS_ONLY(timer.setEntries(idx.size()));
+    return;
+  }
+
+  SparseAccumulator accumulator(b.numMinor, expectedProductFill(a, b));
+
+  ptr.assign(a.numMajor + 1, 0);
+  idx.clear();
+  val.clear();
+  STATS_ONLY(long long products = 0, longestRow = 0);
+
+  for (int i = 0; i < a.numMajor; i++) {
+    STATS_ONLY(long long rowProducts = 0);
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      int k = a.idx[p];
+      STATS_ONLY(rowProducts += b.ptr[k + 1] - b.ptr[k]);
+      for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+        accumulator.add(b.idx[q], a.val[p] * b.val[q]);
+      }
+    }
+    STATS_ONLY(products += rowProducts);
+    STATS_ONLY(longestRow = max(longestRow, rowProducts));
+    accumulator.drain(idx, val);
+    ptr[i + 1] = idx.size();
+  }
+  STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+  STATS_ONLY(SparseStats::raise(SparseStats::LONGEST_PRODUCT_ROW, longestRow));
+  STATS_ONLY(SparseStats::add(SparseStats::ACCUMULATOR_COLLISIONS, accumulator.takeCollisions()));
+  STATS_ONLY(timer.setEntries(idx.size()));
+}
+
+// Transposes a compressed matrix with a counting sort over the minor indices. The result holds the
+// same matrix in the opposite orientation, so this also converts between CSR and CSC
+static void transposeCompressed(const CompressedView& a, vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  STATS_ONLY(StatsTimer timer(SparseStats::COMPRESSED_TRANSPOSE));
+  int nnz = a.ptr[a.numMajor];
+  STATS_ONLY(timer.setEntries(nnz));
+  ptr.assign(a.numMinor + 1, 0);
+  idx.resize(nnz);
+  val.resize(nnz);
+
+  // Count the entries of every minor index and turn the counts into starting offsets
+  for (int p = 0; p < nnz; p++) {
+    ptr[a.idx[p] + 1]++;
+  }
+  for (int j = 0; j < a.numMinor; j++) {
+    ptr[j + 1] += ptr[j];
+  }
+
+  // Scatter the entries; walking the major slices in order keeps every output slice sorted
+  vector<int> next(ptr.begin(), ptr.end() - 1);
+  for (int i = 0; i < a.numMajor; i++) {
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      int dest = next[a.idx[p]]++;
+      idx[dest] = i;
+      val[dest] = a.val[p];
+    }
+  }
+}
+
+// Default constructor initializes an empty CSR matrix with 0 rows and 0 columns
+CSRMatrix::CSRMatrix() : CSRMatrix(0, 0) {}
+
+// Constructor with parameters initializes an all-zero CSR matrix with the specified rows and columns
+CSRMatrix::CSRMatrix(int rows, int cols) : numRows(rows), numCols(cols), rowPtr(rows + 1, 0) {}
+
+// Returns the number of stored entries
+int CSRMatrix::nnz() const {
+  return rowPtr[numRows];
+}
+
+// Returns a view of the arrays with rows as the major dimension
+CompressedView CSRMatrix::view() const {
+  return CompressedView{numRows, numCols, rowPtr.data(), colIdx.data(), values.data()};
+}
+
+// Returns the transpose of the matrix, computed in O(nnz + rows + cols)
+CSRMatrix CSRMatrix::transpose() const {
+  CSRMatrix result(numCols, numRows);
+  transposeCompressed(view(), result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSR matrix addition
+CSRMatrix CSRMatrix::operator+(const CSRMatrix& other) const {
+  CSRMatrix result(numRows, numCols);
+  addCompressed(view(), other.view(), 1, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSR matrix subtraction
+CSRMatrix CSRMatrix::operator-(const CSRMatrix& other) const {
+  CSRMatrix result(numRows, numCols);
+  addCompressed(view(), other.view(), -1, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSR matrix multiplication
+CSRMatrix CSRMatrix::operator*(const CSRMatrix& other) const {
+  CSRMatrix result(numRows, other.numCols);
+  multiplyCompressed(view(), other.view(), result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Removes the entries whose value is zero, keeping every row in column order
+void CSRMatrix::dropZeros() {
+  int out = 0;
+  for (int i = 0; i < numRows; i++) {
+    int start = rowPtr[i];
+    rowPtr[i] = out;
+    for (int p = start; p < rowPtr[i + 1]; p++) {
+      if (values[p] != 0) {
+        colIdx[out] = colIdx[p];
+        values[out] = values[p];
+        out++;
+      }
+    }
+  }
+  rowPtr[numRows] = out;
+  colIdx.resize(out);
+  values.resize(out);
+}
+
+// Prints the CSR matrix in the same dense layout as SparseMatrix::print
+void CSRMatrix::print() const {
+  BufferedWriter writer(stdout);
+  for (int i = 0; i < numRows; i++) {
+    int p = rowPtr[i];
+    for (int j = 0; j < numCols; j++) {
+      if (p < rowPtr[i + 1] && colIdx[p] == j) {
+        writer.write((long long)values[p++]);
+        writer.put('\t');
+      }
+      else {
+        writer.write("0\t", 2);
+      }
+    }
+    writer.put('\n');
+  }
+}
+
+// Default constructor initializes an empty CSC matrix with 0 rows and 0 columns
+CSCMatrix::CSCMatrix() : CSCMatrix(0, 0) {}
+
+// Constructor with parameters initializes an all-zero CSC matrix with the specified rows and columns
+CSCMatrix::CSCMatrix(int rows, int cols) : numRows(rows), numCols(cols), colPtr(cols + 1, 0) {}
+
+// Constructor that converts a CSR matrix into CSC form
+CSCMatrix::CSCMatrix(const CSRMatrix& csr) : CSCMatrix(csr.numRows, csr.numCols) {
+  transposeCompressed(csr.view(), colPtr, rowIdx, values);
+}
+
+// Returns the number of stored entries
+int CSCMatrix::nnz() const {
+  return colPtr[numCols];
+}
+
+// Returns a view of the arrays with columns as the major dimension
+CompressedView CSCMatrix::view() const {
+  return CompressedView{numCols, numRows, colPtr.data(), rowIdx.data(), values.data()};
+}
+
+// Converts the matrix back into CSR form
+CSRMatrix CSCMatrix::toCSR() const {
+  CSRMatrix result(numRows, numCols);
+  transposeCompressed(view(), result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Returns the transpose of the matrix. The CSC arrays of A are the CSR arrays of A^T, so this is the
+// same counting sort as CSRMatrix::transpose
+CSCMatrix CSCMatrix::transpose() const {
+  CSCMatrix result(numCols, numRows);
+  transposeCompressed(view(), result.colPtr, result.rowIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSC matrix addition
+CSCMatrix CSCMatrix::operator+(const CSCMatrix& other) const {
+  CSCMatrix result(numRows, numCols);
+  addCompressed(view(), other.view(), 1, result.colPtr, result.rowIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSC matrix subtraction
+CSCMatrix CSCMatrix::operator-(const CSCMatrix& other) const {
+  CSCMatrix result(numRows, numCols);
+  addCompressed(view(), other.view(), -1, result.colPtr, result.rowIdx, result.values);
+  return result;
+}
+
+// Operator overloading for CSC matrix multiplication. Column j of A*B combines the columns of A
+// selected by column j of B, which is the row-wise kernel with the operands swapped
+CSCMatrix CSCMatrix::operator*(const CSCMatrix& other) const {
+  CSCMatrix result(numRows, other.numCols);
+  multiplyCompressed(other.view(), view(), result.colPtr, result.rowIdx, result.values);
+  return result;
+}
+
+// Prints the CSC matrix in the same dense layout as SparseMatrix::print
+void CSCMatrix::print() const {
+  toCSR().print();
+}
+
+// Default constructor creates the plan of an empty 0x0 product
+MultiplyPlan::MultiplyPlan() : numRows(0), numInner(0), numCols(0), rowPtr(1, 0), productPtr(1, 0) {}
+
+// Symbolic phase: records the operand patterns, the pattern of the product and the result position of
+// every partial product. Each row gathers its distinct columns with a marker array, sorts them, and then
+// maps the partial products of the row onto them
+MultiplyPlan::MultiplyPlan(const CompressedView& a, const CompressedView& b) {
+  STATS_ONLY(StatsTimer timer(SparseStats::PLAN_BUILD));
+  numRows = a.numMajor;
+  numInner = a.numMinor;
+  numCols = b.numMinor;
+  aPtr.assign(a.ptr, a.ptr + a.numMajor + 1);
+  aIdx.assign(a.idx, a.idx + a.ptr[a.numMajor]);
+  bPtr.assign(b.ptr, b.ptr + b.numMajor + 1);
+  bIdx.assign(b.idx, b.idx + b.ptr[b.numMajor]);
+  rowPtr.assign(numRows + 1, 0);
+  productPtr.assign(numRows + 1, 0);
+
+  vector<int> position(numCols, -1); // Result position of every column of the current row, -1 if unseen
+  vector<int> cols;
+  for (int i = 0; i < numRows; i++) {
+    cols.clear();
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      int k = a.idx[p];
+      for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+        if (position[b.idx[q]] < 0) {
+          position[b.idx[q]] = 0;
+          cols.push_back(b.idx[q]);
+        }
+      }
+    }
+    sort(cols.begin(), cols.end());
+    for (size_t c = 0; c < cols.size(); c++) {
+      position[cols[c]] = colIdx.size() + c;
+    }
+
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      int k = a.idx[p];
+      for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+        slots.push_back(position[b.idx[q]]);
+      }
+    }
+    for (size_t c = 0; c < cols.size(); c++) {
+      colIdx.push_back(cols[c]);
+      position[cols[c]] = -1;
+    }
+    rowPtr[i + 1] = colIdx.size();
+    productPtr[i + 1] = slots.size();
+  }
+  STATS_ONLY(timer.setEntries(colIdx.size()));
+}
+
+// Builds the plan of the product of two CSR matrices
+MultiplyPlan::MultiplyPlan(const CSRMatrix& a, const CSRMatrix& b) : MultiplyPlan(a.view(), b.view()) {}
+
+// Returns true if the operands have the shapes and patterns the plan was made for. This compares the
+// index arrays, which costs O(nnz(A) + nnz(B)) and is small next to the partial products
+bool MultiplyPlan::matches(const CompressedView& a, const CompressedView& b) const {
+  return a.numMajor == numRows && a.numMinor == numInner && b.numMajor == numInner && b.numMinor == numCols &&
+         equal(aPtr.begin(), aPtr.end(), a.ptr) && equal(aIdx.begin(), aIdx.end(), a.idx) &&
+         equal(bPtr.begin(), bPtr.end(), b.ptr) && equal(bIdx.begin(), bIdx.end(), b.idx);
+}
+
+// Numeric phase: computes A*B into result from the values of the operands, reusing the arrays of
+// result. Rows are split across the thread pool when the product is large. Returns false, leaving
+// result unchanged, if the operands do not match the plan
+bool MultiplyPlan::execute(const CompressedView& a, const CompressedView& b, CSRMatrix& result) const {
+  if (!matches(a, b)) {
+    return false;
+  }
+  STATS_ONLY(StatsTimer timer(SparseStats::PLAN_EXECUTE));
+  result.numRows = numRows;
+  result.numCols = numCols;
+  result.rowPtr = rowPtr;
+  result.colIdx = colIdx;
+  result.values.resize(colIdx.size());
+
+  int* values = result.values.data();
+  auto computeRows = [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      fill(values + rowPtr[i], values + rowPtr[i + 1], 0);
+      const int* slot = slots.data() + productPtr[i];
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        int value = a.val[p];
+        for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+          values[*slot++] += value * b.val[q];
+        }
+      }
+    }
+  };
+
+  if (multiplyInParallel(aIdx.size())) {
+    ThreadPool& pool = ThreadPool::instance();
+    int grain = max(1, numRows / (pool.numThreads() * 64)); // Rows per task
+    int numTasks = (numRows + grain - 1) / grain;
+    pool.parallelFor(numTasks, [&](int task, int) {
+      computeRows(task * grain, min(numRows, (task + 1) * grain));
+    });
+  }
+  else {
+    computeRows(0, numRows);
+  }
+  STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, slots.size()));
+  STATS_ONLY(timer.setEntries(colIdx.size()));
+  return true;
+}
+
+// Computes the product of two CSR matrices with the plan
+bool MultiplyPlan::execute(const CSRMatrix& a, const CSRMatrix& b, CSRMatrix& result) const {
+  return execute(a.view(), b.view(), result);
+}
+
+// Returns the number of entries of the product
+int MultiplyPlan::nnz() const {
+  return colIdx.size();
+}
+
+// Returns the number of partial products each execution performs
+long long MultiplyPlan::products() const {
+  return slots.size();
+}
+
+// Constructor initializes an empty builder for a matrix with the specified rows and columns
+COOBuilder::COOBuilder(int rows, int cols, DuplicatePolicy policy) {
+  numRows = rows;
+  numCols = cols;
+  this->policy = policy;
+}
+
+// Changes the dimensions of the matrix being built, for sources that only know them at the end
+void COOBuilder::setSize(int rows, int cols) {
+  numRows = rows;
+  numCols = cols;
+}
+
+// Reserves room for the given number of entries
+void COOBuilder::reserve(size_t count) {
+  entries.reserve(count);
+}
+
+// Adds one entry
+void COOBuilder::add(int row, int col, int value) {
+  entries.push_back(Triplet{row, col, value});
+}
+
+// Adds a batch of entries
+void COOBuilder::add(const vector<Triplet>& batch) {
+  entries.insert(entries.end(), batch.begin(), batch.end());
+}
+
+// Returns the number of entries added so far, counting duplicates
+size_t COOBuilder::size() const {
+  return entries.size();
+}
+
+// Sorts the entries by (row, column) and merges duplicates into CSR arrays. A stable counting sort by
+// column followed by a stable counting sort by row leaves every row in column order, with duplicates
+// next to each other in the order they were added
+CSRMatrix COOBuilder::toCSR() const {
+  CSRMatrix result(numRows, numCols);
+  size_t count = entries.size();
+
+  // First pass: order the entries by column
+  vector<size_t> colStart(numCols + 1, 0);
+  for (size_t e = 0; e < count; e++) {
+    colStart[entries[e].col + 1]++;
+  }
+  for (int j = 0; j < numCols; j++) {
+    colStart[j + 1] += colStart[j];
+  }
+  vector<Triplet> byCol(count);
+  for (size_t e = 0; e < count; e++) {
+    byCol[colStart[entries[e].col]++] = entries[e];
+  }
+
+  // Second pass: order them by row, writing straight into the CSR arrays
+  vector<size_t> rowStart(numRows + 1, 0);
+  for (size_t e = 0; e < count; e++) {
+    rowStart[byCol[e].row + 1]++;
+  }
+  for (int i = 0; i < numRows; i++) {
+    rowStart[i + 1] += rowStart[i];
+  }
+  result.colIdx.resize(count);
+  result.values.resize(count);
+  vector<size_t> next(rowStart.begin(), rowStart.end() - 1);
+  for (size_t e = 0; e < count; e++) {
+    size_t dest = next[byCol[e].row]++;
+    result.colIdx[dest] = byCol[e].col;
+    result.values[dest] = byCol[e].value;
+  }
+
+  // Merge duplicates in place and record where every row ends
+  size_t out = 0;
+  for (int i = 0; i < numRows; i++) {
+    size_t rowBegin = out;
+    for (size_t e = rowStart[i]; e < rowStart[i + 1]; e++) {
+      if (out > rowBegin && result.colIdx[out - 1] == result.colIdx[e]) {
+        if (policy == SUM_DUPLICATES) {
+          result.values[out - 1] += result.values[e];
+        }
+        else {
+          result.values[out - 1] = result.values[e];
+        }
+      }
+      else {
+        result.colIdx[out] = result.colIdx[e];
+        result.values[out] = result.values[e];
+        out++;
+      }
+    }
+    result.rowPtr[i + 1] = out;
+  }
+  result.colIdx.resize(out);
+  result.values.resize(out);
+  return result;
+}
+
+// Builds a new SparseMatrix holding the collected entries
+SparseMatrix COOBuilder::build() const {
+  return SparseMatrix(toCSR());
+}
+
+// Computes the rows of a result one at a time: row(i, accumulator) adds everything that belongs to row i
+// to the accumulator, which is then drained into the CSR arrays. With several threads the rows are
+// computed twice, once to count the entries of every row and once to write them into their final
+// place, as in multiplyCompressedParallel
+void accumulateRows(int numRows, int numCols, const function<void(int, SparseAccumulator&)>& row,
+                    vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  ThreadPool& pool = ThreadPool::instance();
+  ptr.assign(numRows + 1, 0);
+  idx.clear();
+  val.clear();
+
+  if (pool.numThreads() == 1 || numRows < 1024) {
+    SparseAccumulator accumulator(numCols);
+    for (int i = 0; i < numRows; i++) {
+      row(i, accumulator);
+      accumulator.drain(idx, val);
+      ptr[i + 1] = idx.size();
+    }
+    return;
+  }
+
+  vector<SparseAccumulator> accumulators(pool.numThreads(), SparseAccumulator(numCols));
+  int grain = max(1, numRows / (pool.numThreads() * 64)); // Rows per task
+  int numTasks = (numRows + grain - 1) / grain;
+
+  // Symbolic pass: count the entries of every row
+  pool.parallelFor(numTasks, [&](int task, int thread) {
+    int last = min(numRows, (task + 1) * grain);
+    for (int i = task * grain; i < last; i++) {
+      row(i, accumulators[thread]);
+      ptr[i + 1] = accumulators[thread].size();
+      accumulators[thread].clear();
+    }
+  });
+
+  for (int i = 0; i < numRows; i++) {
+    ptr[i + 1] += ptr[i];
+  }
+  idx.resize(ptr[numRows]);
+  val.resize(ptr[numRows]);
+
+  // Numeric pass: compute every row again and write it into its preallocated range
+  pool.parallelFor(numTasks, [&](int task, int thread) {
+    int last = min(numRows, (task + 1) * grain);
+    for (int i = task * grain; i < last; i++) {
+      row(i, accumulators[thread]);
+      accumulators[thread].drainTo(idx.data() + ptr[i], val.data() + ptr[i]);
+    }
+  });
+}
+
+// Prunes one accumulated row, given in column order, in place and keeps it in column order. order is
+// scratch space for the top-k selection. Returns the number of entries kept
+static int pruneRow(int* cols, int* vals, int count, const PruneOptions& options, vector<int>& order) {
+  long long largest = 0;
+  for (int e = 0; e < count; e++) {
+    largest = max(largest, llabs(vals[e]));
+  }
+  double limit = max((double)options.threshold, options.relative * largest);
+  int kept = 0;
+  for (int e = 0; e < count; e++) {
+    if (llabs(vals[e]) >= limit) {
+      cols[kept] = cols[e];
+      vals[kept] = vals[e];
+      kept++;
+    }
+  }
+  if (options.topK <= 0 || kept <= options.topK) {
+    return kept;
+  }
+
+  // Select the topK largest magnitudes, then put the survivors back in column order
+  order.resize(kept);
+  iota(order.begin(), order.end(), 0);
+  nth_element(order.begin(), order.begin() + options.topK - 1, order.end(), [&](int x, int y) {
+    return llabs(vals[x]) != llabs(vals[y]) ? llabs(vals[x]) > llabs(vals[y]) : x < y;
+  });
+  sort(order.begin(), order.begin() + options.topK);
+  for (int e = 0; e < options.topK; e++) {
+    cols[e] = cols[order[e]];
+    vals[e] = vals[order[e]];
+  }
+  return options.topK;
+}
+
+// Multiplies two CSR matrices and prunes every result row as soon as it is accumulated, so the
+// dropped entries are never stored: the output, and the memory beyond one row per thread, stay bounded
+// by what the pruning keeps. A row's entries are only known once it is complete, so the rows cannot be
+// counted ahead as in multiplyCompressedParallel; on the thread pool every task appends its pruned rows
+// to arrays of its own, which are concatenated at the end
+static void multiplyPrunedCompressed(const CompressedView& a, const CompressedView& b, const PruneOptions& options,
+                                     vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  STATS_ONLY(StatsTimer timer(SparseStats::PRUNED_MULTIPLY));
+  ThreadPool& pool = ThreadPool::instance();
+  int numRows = a.numMajor;
+  bool parallel = multiplyInParallel(a.ptr[numRows]);
+  int numThreads = parallel ? pool.numThreads() : 1;
+  int grain = parallel ? max(1, numRows / (numThreads * 64)) : max(1, numRows); // Rows per task
+  int numTasks = (numRows + grain - 1) / grain;
+
+  // Output of one task, and scratch of one thread
+  struct TaskRows {
+    vector<int> idx, val;
+  };
+  struct Scratch {
+    SparseAccumulator accumulator;
+    vector<int> cols, vals, order;
+  };
+  vector<TaskRows> tasks(numTasks);
+  vector<Scratch> scratch(numThreads, Scratch{SparseAccumulator(b.numMinor, expectedProductFill(a, b)), {}, {}, {}});
+  ptr.assign(numRows + 1, 0);
+
+  auto computeRows = [&](int task, int thread) {
+    Scratch& s = scratch[thread];
+    TaskRows& out = tasks[task];
+    int last = min(numRows, (task + 1) * grain);
+    STATS_ONLY(long long products = 0, longestRow = 0, dropped = 0);
+    for (int i = task * grain; i < last; i++) {
+      STATS_ONLY(long long rowProducts = 0);
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        STATS_ONLY(rowProducts += b.ptr[k + 1] - b.ptr[k]);
+        for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+          s.accumulator.add(b.idx[q], a.val[p] * b.val[q]);
+        }
+      }
+      STATS_ONLY(products += rowProducts);
+      STATS_ONLY(longestRow = max(longestRow, rowProducts));
+      s.cols.clear();
+      s.vals.clear();
+      s.accumulator.drain(s.cols, s.vals);
+      int kept = pruneRow(s.cols.data(), s.vals.data(), s.cols.size(), options, s.order);
+      STATS_ONLY(dropped += s.cols.size() - kept);
+      out.idx.insert(out.idx.end(), s.cols.begin(), s.cols.begin() + kept);
+      out.val.insert(out.val.end(), s.vals.begin(), s.vals.begin() + kept);
+      ptr[i + 1] = kept;
+    }
+    STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+    STATS_ONLY(SparseStats::raise(SparseStats::LONGEST_PRODUCT_ROW, longestRow));
+    STATS_ONLY(SparseStats::add(SparseStats::PRUNED_ENTRIES, dropped));
+  };
+  if (parallel) {
+    pool.parallelFor(numTasks, computeRows);
+  }
+  else if (numTasks == 1) {
+    computeRows(0, 0);
+  }
+
+  for (int i = 0; i < numRows; i++) {
+    ptr[i + 1] += ptr[i];
+  }
+  if (numTasks == 1) {
+    idx.swap(tasks[0].idx);
+    val.swap(tasks[0].val);
+  }
+  else {
+    idx.resize(ptr[numRows]);
+    val.resize(ptr[numRows]);
+    for (int t = 0; t < numTasks; t++) {
+      size_t offset = ptr[t * grain];
+      copy(tasks[t].idx.begin(), tasks[t].idx.end(), idx.begin() + offset);
+      copy(tasks[t].val.begin(), tasks[t].val.end(), val.begin() + offset);
+      vector<int>().swap(tasks[t].idx); // Hand the memory back as soon as the task is copied
+      vector<int>().swap(tasks[t].val);
+    }
+  }
+  for (size_t t = 0; t < scratch.size(); t++) {
+    STATS_ONLY(SparseStats::add(SparseStats::ACCUMULATOR_COLLISIONS, scratch[t].accumulator.takeCollisions()));
+  }
+  STATS_ONLY(timer.setEntries(idx.size()));
+}
+
+// Multiplies two CSR matrices at the positions selected by a mask with the shape of the product. The
+// mask holds at most as many entries per row as the product can, so each result row gets a scratch row
+// sized by its mask row: mask columns are mapped to scratch slots (through a dense marker array, or a
+// binary search of the mask row for very wide matrices) and every partial product whose column is not in
+// the mask is dropped before it is multiplied. The rows of B are sorted, so the part of each row outside
+// the span of the mask row is skipped with a binary search, and rows with an empty mask are never
+// visited. The result can only have entries where the mask does, so it is written into arrays of
+// nnz(mask) entries and compacted, and memory stays bounded by the mask however much A*B would fill in.
+// With complement the positions outside the mask are computed instead, through accumulateRows, with
+// each partial product checked against the mask row by binary search
+static void multiplyMaskedCompressed(const CompressedView& a, const CompressedView& b, const CompressedView& mask,
+                                     bool complement, vector<int>& ptr, vector<int>& idx, vector<int>& val) {
+  STATS_ONLY(StatsTimer timer(SparseStats::MASKED_MULTIPLY));
+  if (complement) {
+    accumulateRows(a.numMajor, b.numMinor, [&](int i, SparseAccumulator& accumulator) {
+      const int* maskBegin = mask.idx + mask.ptr[i];
+      const int* maskEnd = mask.idx + mask.ptr[i + 1];
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        for (int q = b.ptr[k]; q < b.ptr[k + 1]; q++) {
+          if (!binary_search(maskBegin, maskEnd, b.idx[q])) {
+            accumulator.add(b.idx[q], a.val[p] * b.val[q]);
+          }
+        }
+      }
+    }, ptr, idx, val);
+    STATS_ONLY(timer.setEntries(idx.size()));
+    return;
+  }
+
+  int numRows = a.numMajor;
+  int maskNnz = mask.ptr[numRows];
+  bool dense = b.numMinor <= SparseAccumulator::DENSE_LIMIT;
+  int longestMaskRow = 0;
+  for (int i = 0; i < numRows; i++) {
+    longestMaskRow = max(longestMaskRow, mask.ptr[i + 1] - mask.ptr[i]);
+  }
+  vector<int> counts(numRows, 0);
+  idx.resize(maskNnz);
+  val.resize(maskNnz);
+
+  // Scratch of one thread: the slot of every column of the current mask row, and the slots themselves
+  struct Scratch {
+    vector<int> slot;
+    vector<int> sums;
+    vector<char> hit;
+  };
+  ThreadPool& pool = ThreadPool::instance();
+  bool parallel = multiplyInParallel(a.ptr[numRows]);
+  vector<Scratch> scratch(parallel ? pool.numThreads() : 1);
+
+  // Computes rows begin .. end-1 into the ranges of their mask rows
+  auto computeRows = [&](int begin, int end, Scratch& s) {
+    if (s.sums.empty()) {
+      s.slot.assign(dense ? b.numMinor : 0, -1);
+      s.sums.resize(longestMaskRow);
+      s.hit.resize(longestMaskRow);
+    }
+    STATS_ONLY(long long products = 0, longestRow = 0);
+    for (int i = begin; i < end; i++) {
+      int m0 = mask.ptr[i], m1 = mask.ptr[i + 1];
+      if (m0 == m1) {
+        continue;
+      }
+      for (int m = m0; m < m1; m++) {
+        if (dense) {
+          s.slot[mask.idx[m]] = m - m0;
+        }
+        s.sums[m - m0] = 0;
+        s.hit[m - m0] = 0;
+      }
+      int low = mask.idx[m0], high = mask.idx[m1 - 1];
+
+      STATS_ONLY(long long rowProducts = 0);
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        int k = a.idx[p];
+        int value = a.val[p];
+        for (int q = lower_bound(b.idx + b.ptr[k], b.idx + b.ptr[k + 1], low) - b.idx; q < b.ptr[k + 1] && b.idx[q] <= high; q++) {
+          int j = b.idx[q];
+          int t = dense ? s.slot[j] : lower_bound(mask.idx + m0, mask.idx + m1, j) - (mask.idx + m0);
+          if (t >= 0 && (dense || mask.idx[m0 + t] == j)) {
+            s.sums[t] += value * b.val[q];
+            s.hit[t] = 1;
+            STATS_ONLY(rowProducts++);
+          }
+        }
+      }
+      STATS_ONLY(products += rowProducts);
+      STATS_ONLY(longestRow = max(longestRow, rowProducts));
+
+      // Keep the mask positions that received a product, in column order
+      int out = m0;
+      for (int m = m0; m < m1; m++) {
+        if (s.hit[m - m0]) {
+          idx[out] = mask.idx[m];
+          val[out] = s.sums[m - m0];
+          out++;
+        }
+        if (dense) {
+          s.slot[mask.idx[m]] = -1;
+        }
+      }
+      counts[i] = out - m0;
+    }
+    STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+    STATS_ONLY(SparseStats::raise(SparseStats::LONGEST_PRODUCT_ROW, longestRow));
+  };
+
+  if (parallel) {
+    int grain = max(1, numRows / (pool.numThreads() * 64)); // Rows per task
+    int numTasks = (numRows + grain - 1) / grain;
+    pool.parallelFor(numTasks, [&](int task, int thread) {
+      computeRows(task * grain, min(numRows, (task + 1) * grain), scratch[thread]);
+    });
+  }
+  else {
+    computeRows(0, numRows, scratch[0]);
+  }
+
+  // Close the gaps left by mask positions without products. Rows only move towards the front
+  ptr.assign(numRows + 1, 0);
+  for (int i = 0; i < numRows; i++) {
+    ptr[i + 1] = ptr[i] + counts[i];
+    copy(idx.begin() + mask.ptr[i], idx.begin() + mask.ptr[i] + counts[i], idx.begin() + ptr[i]);
+    copy(val.begin() + mask.ptr[i], val.begin() + mask.ptr[i] + counts[i], val.begin() + ptr[i]);
+  }
+  idx.resize(ptr[numRows]);
+  val.resize(ptr[numRows]);
+  STATS_ONLY(timer.setEntries(idx.size()));
+}
+
+// Lazy expressions. lazy(A) wraps a matrix without copying it, and +, - and * on wrapped matrices build
+// an expression tree instead of computing intermediate matrices. evaluate() computes the whole tree row
+// by row: every result row is gathered in one sparse accumulator straight from the rows of the
+// operands, so A + B - C is a single multi-way merge and in A*B + C the rows of C are added to the
+// product rows as they are accumulated. Operands of a product that are themselves sums or products are
+// computed once into CSR arrays before the pass, since their rows are read many times.
+//
+// Every node provides rows(), cols(), prepare(), which runs before the pass,
+// addRow(i, scale, accumulator), which adds scale times row i of the node to the accumulator, and
+// reads(m), which tells whether the node reads the matrix m. Leaves
+// (IS_LEAF) also provide forRow(i, f), which calls f(col, value) for every entry of row i in order.
+// Nodes hold their operands by value and the leaves refer to the wrapped matrices, which must outlive
+// the expression
+
+// LazyExpression is the base of every node; Derived is the type of the node itself
+template <class Derived>
+struct LazyExpression {
+  const Derived& self() const { return static_cast<const Derived&>(*this); }
+  CSRMatrix evaluateCSR() const;
+  SparseMatrix evaluate() const;
+};
+
+// LazyMatrix is a leaf that reads a SparseMatrix, or its transpose, through its linked lists
+class LazyMatrix : public LazyExpression<LazyMatrix> {
+public:
+  static constexpr bool IS_LEAF = true;
+  LazyMatrix(const SparseMatrix& matrix);
+  LazyMatrix(const TransposedView& view);
+  int rows() const;
+  int cols() const;
+  bool reads(const SparseMatrix& m) const { return matrix == &m; }
+  void prepare() const {}
+  template <class F>
+  void forRow(int i, F f) const;
+  void addRow(int i, int scale, SparseAccumulator& accumulator) const;
+private:
+  const SparseMatrix* matrix;
+  bool transposed; // Rows are read from the column lists
+};
+
+// LazyCSR is a leaf that reads compressed row arrays, such as a CSRMatrix or a MappedMatrix view
+class LazyCSR : public LazyExpression<LazyCSR> {
+public:
+  static constexpr bool IS_LEAF = true;
+  LazyCSR(const CompressedView& csr);
+  int rows() const { return csr.numMajor; }
+  int cols() const { return csr.numMinor; }
+  bool reads(const SparseMatrix&) const { return false; }
+  void prepare() const {}
+  template <class F>
+  void forRow(int i, F f) const;
+  void addRow(int i, int scale, SparseAccumulator& accumulator) const;
+private:
+  CompressedView csr;
+};
+
+// LazyScaled multiplies an expression by an integer. Scaling a leaf is still a leaf
+template <class E>
+class LazyScaled : public LazyExpression<LazyScaled<E>> {
+public:
+  static constexpr bool IS_LEAF = E::IS_LEAF;
+  LazyScaled(const E& expr, int factor) : expr(expr), factor(factor) {}
+  int rows() const { return expr.rows(); }
+  int cols() const { return expr.cols(); }
+  bool reads(const SparseMatrix& m) const { return expr.reads(m); }
+  void prepare() const { expr.prepare(); }
+  template <class F>
+  void forRow(int i, F f) const {
+    expr.forRow(i, [&](int col, int value) { f(col, factor * value); });
+  }
+  void addRow(int i, int scale, SparseAccumulator& accumulator) const {
+    expr.addRow(i, scale * factor, accumulator);
+  }
+private:
+  E expr;
+  int factor;
+};
+
+// LazySum adds (sign = 1) or subtracts (sign = -1) two expressions
+template <class L, class R>
+class LazySum : public LazyExpression<LazySum<L, R>> {
+public:
+  static constexpr bool IS_LEAF = false;
+  LazySum(const L& left, const R& right, int sign) : left(left), right(right), sign(sign) {}
+  int rows() const { return left.rows(); }
+  int cols() const { return left.cols(); }
+  bool reads(const SparseMatrix& m) const { return left.reads(m) || right.reads(m); }
+  void prepare() const;
+  void addRow(int i, int scale, SparseAccumulator& accumulator) const;
+private:
+  L left;
+  R right;
+  int sign;
+};
+
+// LazyProduct multiplies two expressions. Row i of the product is the sum of the rows of the right
+// operand selected by the entries of row i of the left operand
+template <class L, class R>
+class LazyProduct : public LazyExpression<LazyProduct<L, R>> {
+public:
+  static constexpr bool IS_LEAF = false;
+  LazyProduct(const L& left, const R& right) : left(left), right(right) {}
+  int rows() const { return left.rows(); }
+  int cols() const { return right.cols(); }
+  bool reads(const SparseMatrix& m) const { return left.reads(m) || right.reads(m); }
+  void prepare() const;
+  void addRow(int i, int scale, SparseAccumulator& accumulator) const;
+private:
+  L left;
+  R right;
+  mutable shared_ptr<CSRMatrix> leftValues;  // Computed left operand if it is not a leaf
+  mutable shared_ptr<CSRMatrix> rightValues; // Computed right operand if it is not a leaf
+};
+
+// Computes the expression into CSR arrays in a single row-by-row pass
+template <class Derived>
+CSRMatrix LazyExpression<Derived>::evaluateCSR() const {
+  STATS_ONLY(StatsTimer timer(SparseStats::LAZY_EVALUATE));
+  const Derived& expr = self();
+  expr.prepare();
+  CSRMatrix result(expr.rows(), expr.cols());
+  accumulateRows(expr.rows(), expr.cols(), [&](int i, SparseAccumulator& accumulator) {
+    expr.addRow(i, 1, accumulator);
+  }, result.rowPtr, result.colIdx, result.values);
+  STATS_ONLY(timer.setEntries(result.nnz()));
+  return result;
+}
+
+// Computes the expression into a new matrix
+template <class Derived>
+SparseMatrix LazyExpression<Derived>::evaluate() const {
+  return SparseMatrix(evaluateCSR());
+}
+
+// Constructor wraps a matrix without copying it
+LazyMatrix::LazyMatrix(const SparseMatrix& matrix) : matrix(&matrix), transposed(false) {}
+
+// Constructor wraps the matrix behind a transposed view, reading its rows from the column lists
+LazyMatrix::LazyMatrix(const TransposedView& view) : matrix(&view.matrix), transposed(true) {}
+
+// Returns the number of rows of the leaf
+int LazyMatrix::rows() const {
+  return transposed ? matrix->numCols : matrix->numRows;
+}
+
+// Returns the number of columns of the leaf
+int LazyMatrix::cols() const {
+  return transposed ? matrix->numRows : matrix->numCols;
+}
+
+// Calls f(col, value) for every entry of row i in column order
+template <class F>
+void LazyMatrix::forRow(int i, F f) const {
+  if (transposed) {
+    for (Node* node = matrix->colHeaders[i]->down; node != nullptr; node = node->down) {
+      f(node->row, node->value);
+    }
+  }
+  else {
+    for (Node* node = matrix->rowHeaders[i]->right; node != nullptr; node = node->right) {
+      f(node->col, node->value);
+    }
+  }
+}
+
+// Adds scale times row i to the accumulator
+void LazyMatrix::addRow(int i, int scale, SparseAccumulator& accumulator) const {
+  forRow(i, [&](int col, int value) { accumulator.add(col, scale * value); });
+}
+
+// Constructor wraps compressed row arrays without copying them
+LazyCSR::LazyCSR(const CompressedView& csr) : csr(csr) {}
+
+// Calls f(col, value) for every entry of row i in column order
+template <class F>
+void LazyCSR::forRow(int i, F f) const {
+  for (int p = csr.ptr[i]; p < csr.ptr[i + 1]; p++) {
+    f(csr.idx[p], csr.val[p]);
+  }
+}
+
+// Adds scale times row i to the accumulator
+void LazyCSR::addRow(int i, int scale, SparseAccumulator& accumulator) const {
+  for (int p = csr.ptr[i]; p < csr.ptr[i + 1]; p++) {
+    accumulator.add(csr.idx[p], scale * csr.val[p]);
+  }
+}
+
+// Prepares both operands
+template <class L, class R>
+void LazySum<L, R>::prepare() const {
+  left.prepare();
+  right.prepare();
+}
+
+// Adds scale times row i of both operands to the accumulator
+template <class L, class R>
+void LazySum<L, R>::addRow(int i, int scale, SparseAccumulator& accumulator) const {
+  left.addRow(i, scale, accumulator);
+  right.addRow(i, sign * scale, accumulator);
+}
+
+// Computes the operands that are not leaves into CSR arrays
+template <class L, class R>
+void LazyProduct<L, R>::prepare() const {
+  if constexpr (L::IS_LEAF) {
+    left.prepare();
+  }
+  else {
+    leftValues = make_shared<CSRMatrix>(left.evaluateCSR());
+  }
+  if constexpr (R::IS_LEAF) {
+    right.prepare();
+  }
+  else {
+    rightValues = make_shared<CSRMatrix>(right.evaluateCSR());
+  }
+}
+
+// Adds scale times row i of the product to the accumulator
+template <class L, class R>
+void LazyProduct<L, R>::addRow(int i, int scale, SparseAccumulator& accumulator) const {
+  // Adds the row of the right operand selected by one entry (k, value) of the left row
+  auto addSelectedRow = [&](int k, int value) {
+    if constexpr (R::IS_LEAF) {
+      right.addRow(k, scale * value, accumulator);
+    }
+    else {
+      const CSRMatrix& b = *rightValues;
+      for (int q = b.rowPtr[k]; q < b.rowPtr[k + 1]; q++) {
+        accumulator.add(b.colIdx[q], scale * value * b.values[q]);
+      }
+    }
+  };
+
+  if constexpr (L::IS_LEAF) {
+    left.forRow(i, addSelectedRow);
+  }
+  else {
+    const CSRMatrix& a = *leftValues;
+    for (int p = a.rowPtr[i]; p < a.rowPtr[i + 1]; p++) {
+      addSelectedRow(a.colIdx[p], a.values[p]);
+    }
+  }
+}
+
+// Wraps a matrix in a lazy expression
+LazyMatrix lazy(const SparseMatrix& matrix) {
+  return LazyMatrix(matrix);
+}
+
+// Wraps a transposed view in a lazy expression
+LazyMatrix lazy(const TransposedView& view) {
+  return LazyMatrix(view);
+}
+
+// Wraps compressed row arrays in a lazy expression
+LazyCSR lazy(const CompressedView& csr) {
+  return LazyCSR(csr);
+}
+
+// Wraps a CSR matrix in a lazy expression
+LazyCSR lazy(const CSRMatrix& csr) {
+  return LazyCSR(csr.view());
+}
+
+// Builds the lazy sum of two expressions
+template <class L, class R>
+LazySum<L, R> operator+(const LazyExpression<L>& a, const LazyExpression<R>& b) {
+  return LazySum<L, R>(a.self(), b.self(), 1);
+}
+
+// Builds the lazy difference of two expressions
+template <class L, class R>
+LazySum<L, R> operator-(const LazyExpression<L>& a, const LazyExpression<R>& b) {
+  return LazySum<L, R>(a.self(), b.self(), -1);
+}
+
+// Builds the lazy product of two expressions
+template <class L, class R>
+LazyProduct<L, R> operator*(const LazyExpression<L>& a, const LazyExpression<R>& b) {
+  return LazyProduct<L, R>(a.self(), b.self());
+}
+
+// Builds the lazy multiple of an expression
+template <class E>
+LazyScaled<E> operator*(int factor, const LazyExpression<E>& e) {
+  return LazyScaled<E>(e.self(), factor);
+}
+
+// Builds the lazy negation of an expression
+template <class E>
+LazyScaled<E> operator-(const LazyExpression<E>& e) {
+  return LazyScaled<E>(e.self(), -1);
+}
+
+// Adds another matrix to this one in place, reusing the nodes of positions present in both
+SparseMatrix& SparseMatrix::operator+=(const SparseMatrix& other) {
+  mergeExpression(LazyMatrix(other), 1);
+  return *this;
+}
+
+// Subtracts another matrix from this one in place, reusing the nodes of positions present in both
+SparseMatrix& SparseMatrix::operator-=(const SparseMatrix& other) {
+  mergeExpression(LazyMatrix(other), -1);
+  return *this;
+}
+
+// Multiplies every entry by a factor in place. Multiplying by zero removes every entry
+SparseMatrix& SparseMatrix::operator*=(int factor) {
+  if (factor == 0) {
+    clear();
+    return *this;
+  }
+  for (int i = 0; i < numRows; i++) {
+    for (Node* node = rowHeaders[i]->right; node != nullptr; node = node->right) {
+      node->value *= factor;
+    }
+  }
+  return *this;
+}
+
+// Computes this += alpha * other in place without building alpha * other
+SparseMatrix& SparseMatrix::axpy(int alpha, const SparseMatrix& other) {
+  mergeExpression(LazyScaled<LazyMatrix>(LazyMatrix(other), alpha), 1);
+  return *this;
+}
+
+// Adds a lazy expression, such as 2 * lazy(B) or lazy(B) * lazy(C), to this matrix in place
+template <class E>
+SparseMatrix& SparseMatrix::operator+=(const LazyExpression<E>& expr) {
+  mergeExpression(expr.self(), 1);
+  return *this;
+}
+
+// Subtracts a lazy expression from this matrix in place
+template <class E>
+SparseMatrix& SparseMatrix::operator-=(const LazyExpression<E>& expr) {
+  mergeExpression(expr.self(), -1);
+  return *this;
+}
+
+// Adds sign times an expression of the same shape to this matrix row by row. Rows of leaves are merged
+// straight from their lists or arrays; other expressions are accumulated one row at a time first. An
+// expression that reads this matrix is computed in full before anything changes
+template <class E>
+void SparseMatrix::mergeExpression(const E& expr, int sign) {
+  if (expr.reads(*this)) {
+    CSRMatrix values = expr.evaluateCSR();
+    mergeExpression(LazyCSR(values.view()), sign);
+    return;
+  }
+
+  expr.prepare();
+  vector<Node*> colAbove(colHeaders, colHeaders + numCols);
+  if constexpr (E::IS_LEAF) {
+    for (int i = 0; i < numRows; i++) {
+      mergeRow(i, [&](auto add) {
+        expr.forRow(i, [&](int col, int value) { add(col, sign * value); });
+      }, colAbove);
+    }
+  }
+  else {
+    SparseAccumulator accumulator(numCols);
+    vector<int> cols, vals;
+    for (int i = 0; i < numRows; i++) {
+      expr.addRow(i, sign, accumulator);
+      cols.clear();
+      vals.clear();
+      accumulator.drain(cols, vals);
+      mergeRow(i, [&](auto add) {
+        for (size_t e = 0; e < cols.size(); e++) {
+          add(cols[e], vals[e]);
+        }
+      }, colAbove);
+    }
+  }
+}
+
+// Adds entries to the given row in place. forRow(add) must call add(col, value) in increasing column
+// order. Existing nodes are updated, nodes whose value cancels to zero are removed and missing ones are
+// linked in; colAbove[j] is a node of column j above the row (initially the header), so rows must be
+// merged in increasing order and every column list is walked once in total
+template <class ForRow>
+void SparseMatrix::mergeRow(int row, ForRow forRow, vector<Node*>& colAbove) {
+  Node* prev = rowHeaders[row]; // Last node of the row left of the next column
+  forRow([&](int col, int value) {
+    while (prev->right != nullptr && prev->right->col < col) {
+      prev = prev->right;
+    }
+    Node* next = prev->right;
+    if (next != nullptr && next->col == col) {
+      next->value += value; // Reuse the node already at this position
+      if (next->value != 0) {
+        prev = next;
+        return;
+      }
+
+      // The sum cancelled: unlink the node from its row and its column. colAbove never points at a
+      // node of this row that was there before the merge, so it stays valid
+      prev->right = next->right;
+      if (next->right != nullptr) {
+        next->right->left = prev;
+      }
+      next->up->down = next->down;
+      if (next->down != nullptr) {
+        next->down->up = next->up;
+      }
+      rowIndex.erase(row, col);
+      colIndex.erase(col, row);
+      pool.release(static_cast<Internal*>(next));
+      return;
+    }
+    if (value == 0) {
+      return; // Nothing to add at an empty position
+    }
+
+    // Link a new node into the row between prev and next. The row and column change outside the
+    // point-access functions, so their indexes are dropped
+    Internal* node = pool.newInternal(row, col, value);
+    rowIndex.invalidate(row);
+    colIndex.invalidate(col);
+    node->left = prev;
+    node->right = next;
+    prev->right = node;
+    if (next != nullptr) {
+      next->left = node;
+    }
+
+    // Link it into the column below the last node above this row
+    Node* above = colAbove[col];
+    while (above->down != nullptr && above->down->row < row) {
+      above = above->down;
+    }
+    node->up = above;
+    node->down = above->down;
+    if (above->down != nullptr) {
+      above->down->up = node;
+    }
+    above->down = node;
+    colAbove[col] = node;
+    prev = node;
+  });
+}
+
+// Replaces the entries of a row with count entries given in increasing column order. Nodes at columns
+// that stay are updated in place, the others are unlinked and returned to the pool, and new ones are
+// linked into their columns after the nodes found through the column index. Values are stored as given,
+// zeros included, so a recomputed product row can be swapped in without rebuilding the matrix
+void SparseMatrix::replaceRow(int row, const int* cols, const int* vals, int count) {
+  rowIndex.invalidate(row);
+  Node* prev = rowHeaders[row]; // Last node of the row that is already in its final state
+  int e = 0;
+  while (prev->right != nullptr || e < count) {
+    Node* next = prev->right;
+    if (next != nullptr && (e == count || next->col < cols[e])) {
+      // The column is no longer in the row: unlink the node from its row and its column
+      prev->right = next->right;
+      if (next->right != nullptr) {
+        next->right->left = prev;
+      }
+      next->up->down = next->down;
+      if (next->down != nullptr) {
+        next->down->up = next->up;
+      }
+      colIndex.erase(next->col, row);
+      pool.release(static_cast<Internal*>(next));
+    }
+    else if (next != nullptr && next->col == cols[e]) {
+      next->value = vals[e++]; // Reuse the node already at this position
+      prev = next;
+    }
+    else {
+      // Link a new node between prev and next, and into its column below the last node above the row
+      Node* above = predecessor(colIndex, cols[e], colHeaders[cols[e]], numCols, row, false);
+      Internal* node = pool.newInternal(row, cols[e], vals[e]);
+      node->left = prev;
+      node->right = next;
+      prev->right = node;
+      if (next != nullptr) {
+        next->left = node;
+      }
+      node->up = above;
+      node->down = above->down;
+      if (above->down != nullptr) {
+        above->down->up = node;
+      }
+      above->down = node;
+      colIndex.insert(cols[e], row, node);
+      prev = node;
+      e++;
+    }
+  }
+}
+
+// Constructor copies the operands and computes their product once
+IncrementalProduct::IncrementalProduct(const SparseMatrix& left, const SparseMatrix& right)
+    : a(left), b(right), c(left * right), affected(left.getRows(), 0), accumulator(right.getCols()) {}
+
+// Logs a change of the entry (row, col) of A. A value of 0 removes the entry
+void IncrementalProduct::setLeft(int row, int col, int value) {
+  changes.push_back(Change{false, row, col, value});
+}
+
+// Logs a change of the entry (row, col) of B. A value of 0 removes the entry
+void IncrementalProduct::setRight(int row, int col, int value) {
+  changes.push_back(Change{true, row, col, value});
+}
+
+// Returns the number of changes logged since the last update
+size_t IncrementalProduct::pending() const {
+  return changes.size();
+}
+
+// Applies the logged changes to A and B in the order they were logged and recomputes the rows of the
+// product they affect. The rows of A that read a changed row k of B are found by walking column k of A.
+// If more than half of the rows are affected the product is recomputed in full, which is cheaper than
+// replacing the rows one by one. Returns the number of rows recomputed
+int IncrementalProduct::update() {
+  STATS_ONLY(StatsTimer timer(SparseStats::INCREMENTAL_UPDATE));
+  vector<int> rows, changedRight;
+  for (const Change& change : changes) {
+    if (change.right) {
+      b.set(change.row, change.col, change.value);
+      changedRight.push_back(change.row);
+    }
+    else {
+      a.set(change.row, change.col, change.value);
+      if (!affected[change.row]) {
+        affected[change.row] = 1;
+        rows.push_back(change.row);
+      }
+    }
+  }
+  changes.clear();
+
+  sort(changedRight.begin(), changedRight.end());
+  changedRight.erase(unique(changedRight.begin(), changedRight.end()), changedRight.end());
+  for (int k : changedRight) {
+    for (Node* node = a.colHeaders[k]->down; node != nullptr; node = node->down) {
+      if (!affected[node->row]) {
+        affected[node->row] = 1;
+        rows.push_back(node->row);
+      }
+    }
+  }
+  for (int i : rows) {
+    affected[i] = 0;
+  }
+
+  if (2 * rows.size() > (size_t)a.getRows()) {
+    c = a * b;
+    STATS_ONLY(timer.setEntries(rows.size()));
+    return rows.size();
+  }
+
+  // Recompute every affected row as multiplyAccess does and swap it in
+  sort(rows.begin(), rows.end());
+  vector<int> cols, vals;
+  STATS_ONLY(long long products = 0);
+  for (int i : rows) {
+    for (Node* node1 = a.rowHeaders[i]->right; node1 != nullptr; node1 = node1->right) {
+      for (Node* node2 = b.rowHeaders[node1->col]->right; node2 != nullptr; node2 = node2->right) {
+        accumulator.add(node2->col, node1->value * node2->value);
+        STATS_ONLY(products++);
+      }
+    }
+    cols.clear();
+    vals.clear();
+    accumulator.drain(cols, vals);
+    c.replaceRow(i, cols.data(), vals.data(), cols.size());
+  }
+  STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+  STATS_ONLY(timer.setEntries(rows.size()));
+  return rows.size();
+}
+
+// Returns the left operand with every applied change
+const SparseMatrix& IncrementalProduct::left() const {
+  return a;
+}
+
+// Returns the right operand with every applied change
+const SparseMatrix& IncrementalProduct::right() const {
+  return b;
+}
+
+// Returns the product as of the last update
+const SparseMatrix& IncrementalProduct::product() const {
+  return c;
+}
+
+// Fills in the header of a snapshot with the given shape. The row pointers and column indices start at
+// offsets that depend only on the number of rows, so a writer that learns nnz last can still place them
+static void fillSnapshotHeader(SnapshotHeader& header, int64_t rows, int64_t cols, int64_t nnz) {
+  const uint64_t ALIGN = 64;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "SPMXSNAP", 8);
+  header.version = SNAPSHOT_VERSION;
+  header.byteOrder = 0x01020304;
+  header.valueType = SNAPSHOT_INT32;
+  header.indexType = SNAPSHOT_INT32;
+  header.rows = rows;
+  header.cols = cols;
+  header.nnz = nnz;
+  header.rowPtrOffset = (sizeof(header) + ALIGN - 1) / ALIGN * ALIGN;
+  header.colIdxOffset = (header.rowPtrOffset + (header.rows + 1) * sizeof(int) + ALIGN - 1) / ALIGN * ALIGN;
+  header.valuesOffset = (header.colIdxOffset + nnz * sizeof(int) + ALIGN - 1) / ALIGN * ALIGN;
+  header.fileSize = header.valuesOffset + nnz * sizeof(int);
+}
+
+// Checks a snapshot header against the size of its file. Returns nullptr if the header is valid, or
+// a description of the problem
+static const char* snapshotHeaderProblem(const SnapshotHeader& h, uint64_t fileSize) {
+  if (memcmp(h.magic, "SPMXSNAP", 8) != 0) {
+    return "not a snapshot file";
+  }
+  if (h.version != SNAPSHOT_VERSION) {
+    return "unsupported snapshot version";
+  }
+  if (h.byteOrder != 0x01020304) {
+    return "snapshot was written with a different byte order";
+  }
+  if (h.valueType != SNAPSHOT_INT32 || h.indexType != SNAPSHOT_INT32) {
+    return "unsupported value or index type";
+  }
+  if (h.rows < 0 || h.cols < 0 || h.nnz < 0 || h.rows > INT32_MAX || h.cols > INT32_MAX || h.nnz > INT32_MAX ||
+      h.fileSize > fileSize || h.rowPtrOffset % 64 != 0 || h.colIdxOffset % 64 != 0 || h.valuesOffset % 64 != 0 ||
+      h.rowPtrOffset + (h.rows + 1) * sizeof(int) > fileSize || h.colIdxOffset + h.nnz * sizeof(int) > fileSize ||
+      h.valuesOffset + h.nnz * sizeof(int) > fileSize) {
+    return "corrupt snapshot header";
+  }
+  return nullptr;
+}
+
+// Checks that the row pointers of CSR arrays start at 0 and never decrease, and that the column indices
+// of every row are in range and strictly increasing, so the kernels can index with them unchecked.
+// Returns nullptr if the arrays are valid, or a description of the problem
+static const char* compressedViewProblem(const CompressedView& a, int64_t nnz) {
+  if (a.ptr[0] != 0 || a.ptr[a.numMajor] != nnz) {
+    return "corrupt row pointers";
+  }
+  for (int i = 0; i < a.numMajor; i++) {
+    if (a.ptr[i + 1] < a.ptr[i] || a.ptr[i + 1] > nnz) {
+      return "corrupt row pointers";
+    }
+  }
+  for (int i = 0; i < a.numMajor; i++) {
+    int previous = -1;
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      if (a.idx[p] <= previous || a.idx[p] >= a.numMinor) {
+        return "corrupt column indices";
+      }
+      previous = a.idx[p];
+    }
+  }
+  return nullptr;
+}
+
+// Writes CSR arrays as a binary snapshot. Returns false and sets error on failure
+bool saveSnapshot(const CompressedView& csr, const string& path, string& error) {
+  int64_t nnz = csr.ptr[csr.numMajor];
+  SnapshotHeader header;
+  fillSnapshotHeader(header, csr.numMajor, csr.numMinor, nnz);
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    error = path + ": cannot open file for writing";
+    return false;
+  }
+
+  // Writes an array at the given offset, padding with zeros up to it. The arrays of a matrix without
+  // entries may be null, which fwrite does not accept even for zero bytes
+  uint64_t position = 0;
+  auto writeAt = [&](uint64_t offset, const void* data, size_t bytes) {
+    static const char zeros[64] = {0};
+    bool ok = fwrite(zeros, 1, offset - position, file) == offset - position &&
+              (bytes == 0 || fwrite(data, 1, bytes, file) == bytes);
+    position = offset + bytes;
+    return ok;
+  };
+
+  bool ok = writeAt(0, &header, sizeof(header)) &&
+            writeAt(header.rowPtrOffset, csr.ptr, (header.rows + 1) * sizeof(int)) &&
+            writeAt(header.colIdxOffset, csr.idx, nnz * sizeof(int)) &&
+            writeAt(header.valuesOffset, csr.val, nnz * sizeof(int));
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    error = path + ": write failed";
+  }
+  return ok;
+}
+
+// Returns true if the file starts with the snapshot magic
+bool isSnapshotFile(const string& path) {
+  char magic[8];
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool snapshot = fread(magic, 1, 8, file) == 8 && memcmp(magic, "SPMXSNAP", 8) == 0;
+  fclose(file);
+  return snapshot;
+}
+
+// Writes the matrix as a binary snapshot that MappedMatrix can open without parsing
+bool SparseMatrix::saveSnapshot(const string& path, string& error) const {
+  CSRMatrix csr = toCSR();
+  return ::saveSnapshot(csr.view(), path, error);
+}
+
+// Constructor creates a matrix that is not mapped yet
+MappedMatrix::MappedMatrix() {
+  mapping = nullptr;
+  mappedSize = 0;
+  header = nullptr;
+}
+
+// Destructor unmaps the file
+MappedMatrix::~MappedMatrix() {
+  close();
+}
+
+// Maps a snapshot file read-only and checks its header, row pointers and column indices. Returns false
+// and sets error on failure
+bool MappedMatrix::open(const string& path, string& error) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = path + ": cannot open file";
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+    ::close(fd);
+    error = path + ": not a snapshot file";
+    return false;
+  }
+  void* memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // The mapping keeps the file open
+  if (memory == MAP_FAILED) {
+    error = path + ": mmap failed";
+    return false;
+  }
+  mapping = memory;
+  mappedSize = info.st_size;
+  header = (const SnapshotHeader*)memory;
+
+  // The structure is read here so the kernels never index out of the mapping; the values are paged in when used
+  const SnapshotHeader& h = *header;
+  const char* problem = snapshotHeaderProblem(h, mappedSize);
+  if (problem == nullptr) {
+    problem = compressedViewProblem(view(), h.nnz);
+  }
+  if (problem != nullptr) {
+    close();
+    error = path + ": " + problem;
+    return false;
+  }
+  return true;
+}
+
+// Unmaps the file
+void MappedMatrix::close() {
+  if (mapping != nullptr) {
+    munmap(mapping, mappedSize);
+  }
+  mapping = nullptr;
+  mappedSize = 0;
+  header = nullptr;
+}
+
+// Returns true if a snapshot is mapped
+bool MappedMatrix::isOpen() const {
+  return mapping != nullptr;
+}
+
+// Returns the number of rows
+int MappedMatrix::getRows() const {
+  return header->rows;
+}
+
+// Returns the number of columns
+int MappedMatrix::getCols() const {
+  return header->cols;
+}
+
+// Returns the number of stored entries
+int MappedMatrix::nnz() const {
+  return header->nnz;
+}
+
+// Returns a view of the mapped CSR arrays, usable with addCSR/subtractCSR/multiplyCSR
+CompressedView MappedMatrix::view() const {
+  const char* base = (const char*)mapping;
+  return CompressedView{(int)header->rows, (int)header->cols, (const int*)(base + header->rowPtrOffset),
+                        (const int*)(base + header->colIdxOffset), (const int*)(base + header->valuesOffset)};
+}
+
+// Copies the mapped matrix into a new linked list matrix
+SparseMatrix MappedMatrix::toSparseMatrix() const {
+  return SparseMatrix(view());
+}
+
+// Adds two matrices given as CSR views, such as a CSRMatrix and a MappedMatrix
+CSRMatrix addCSR(const CompressedView& a, const CompressedView& b) {
+  CSRMatrix result(a.numMajor, a.numMinor);
+  addCompressed(a, b, 1, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Subtracts two matrices given as CSR views
+CSRMatrix subtractCSR(const CompressedView& a, const CompressedView& b) {
+  CSRMatrix result(a.numMajor, a.numMinor);
+  addCompressed(a, b, -1, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Multiplies two matrices given as CSR views
+CSRMatrix multiplyCSR(const CompressedView& a, const CompressedView& b) {
+  CSRMatrix result(a.numMajor, b.numMinor);
+  multiplyCompressed(a, b, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Transposes a matrix given as a CSR view
+CSRMatrix transposeCSR(const CompressedView& a) {
+  CSRMatrix result(a.numMinor, a.numMajor);
+  transposeCompressed(a, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Multiplies two matrices given as CSR views, pruning every result row as it is computed. Throws
+// invalid_argument if the shapes do not match
+CSRMatrix multiplyPrunedCSR(const CompressedView& a, const CompressedView& b, const PruneOptions& options) {
+  if (a.numMinor != b.numMajor) {
+    throw invalid_argument("multiplyPrunedCSR: a " + to_string(a.numMajor) + "x" + to_string(a.numMinor) + " matrix times a " +
+                           to_string(b.numMajor) + "x" + to_string(b.numMinor) + " matrix");
+  }
+  CSRMatrix result(a.numMajor, b.numMinor);
+  multiplyPrunedCompressed(a, b, options, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Multiplies two matrices given as CSR views at the positions selected by a mask, or outside them
+// with complement. The mask has the shape of the product and its values are ignored. Throws
+// invalid_argument if the shapes do not match
+CSRMatrix multiplyMaskedCSR(const CompressedView& a, const CompressedView& b, const CompressedView& mask, bool complement) {
+  if (a.numMinor != b.numMajor || mask.numMajor != a.numMajor || mask.numMinor != b.numMinor) {
+    throw invalid_argument("multiplyMaskedCSR: a " + to_string(a.numMajor) + "x" + to_string(a.numMinor) + " matrix times a " +
+                           to_string(b.numMajor) + "x" + to_string(b.numMinor) + " matrix with a " +
+                           to_string(mask.numMajor) + "x" + to_string(mask.numMinor) + " mask");
+  }
+  CSRMatrix result(a.numMajor, b.numMinor);
+  multiplyMaskedCompressed(a, b, mask, complement, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Sampling-based cost model for a matrix chain. nnz[i][j] estimates the entries of the product of
+// matrices i .. j, and products[i][s] the partial products of multiplying the product of i .. s by
+// matrix s+1. Both come from sampled rows of matrix i pushed exactly through the rest of the chain:
+// the pattern of row x of M_i * ... * M_s is the union of the rows of M_s selected by row x of
+// M_i * ... * M_(s-1), and its partial products against M_(s+1) are the lengths of the rows it selects.
+// Only nonempty rows are sampled, and every sample stands for rows / samples of them, so the estimates
+// are exact when a matrix has no more nonempty rows than there are samples
+struct ChainEstimate {
+  static constexpr int SAMPLE_ROWS = 256; // Rows of each matrix pushed through the chain
+
+  int n;
+  vector<vector<double>> nnz, products;
+
+  ChainEstimate(const vector<CompressedView>& chain) : n(chain.size()), nnz(n, vector<double>(n, 0)),
+                                                       products(n, vector<double>(n, 0)) {
+    int widest = 0;
+    for (const CompressedView& m : chain) {
+      widest = max(widest, max(m.numMajor, m.numMinor));
+    }
+    vector<int> marker(widest, -1); // Sample that last reached each index, so patterns need no clearing
+    vector<int> row, next;
+    mt19937 random(12345); // Fixed seed: the same chain is always planned the same way
+    int stamp = 0;
+
+    for (int i = 0; i < n; i++) {
+      nnz[i][i] = chain[i].ptr[chain[i].numMajor];
+      vector<int> nonempty;
+      for (int x = 0; x < chain[i].numMajor; x++) {
+        if (chain[i].ptr[x + 1] > chain[i].ptr[x]) {
+          nonempty.push_back(x);
+        }
+      }
+      int samples = min<int>(SAMPLE_ROWS, nonempty.size());
+      if (samples == 0) {
+        continue;
+      }
+      // Draw the samples without replacement, as the head of a partial shuffle
+      for (int t = 0; t < samples; t++) {
+        swap(nonempty[t], nonempty[t + random() % (nonempty.size() - t)]);
+      }
+      double scale = double(nonempty.size()) / samples;
+
+      for (int t = 0; t < samples; t++) {
+        const CompressedView& first = chain[i];
+        row.assign(first.idx + first.ptr[nonempty[t]], first.idx + first.ptr[nonempty[t] + 1]);
+        for (int s = i; s < n; s++) {
+          if (s > i) {
+            nnz[i][s] += scale * row.size();
+          }
+          if (s + 1 == n || row.empty()) {
+            break;
+          }
+          // Multiply the sampled row by the next matrix, counting its partial products
+          const CompressedView& m = chain[s + 1];
+          stamp++;
+          next.clear();
+          for (int k : row) {
+            products[i][s] += scale * (m.ptr[k + 1] - m.ptr[k]);
+            for (int q = m.ptr[k]; q < m.ptr[k + 1]; q++) {
+              if (marker[m.idx[q]] != stamp) {
+                marker[m.idx[q]] = stamp;
+                next.push_back(m.idx[q]);
+              }
+            }
+          }
+          row.swap(next);
+        }
+      }
+    }
+  }
+
+  // Estimates the partial products of multiplying the product of first .. split by that of split+1 ..
+  // last. The rows of a product are assumed to be as long, relative to each other, as those of its first
+  // factor, so the cost against matrix split+1 alone is scaled by how much the rest of the chain fills it
+  double cost(int first, int split, int last) const {
+    double right = nnz[split + 1][split + 1];
+    return right == 0 ? 0 : products[first][split] * (nnz[split + 1][last] / right);
+  }
+};
+
+// Builds the parenthesization chosen by the planner as text
+static string chainOrder(const vector<vector<int>>& split, int first, int last) {
+  if (first == last) {
+    return "M" + to_string(first);
+  }
+  int s = split[first][last];
+  return "(" + chainOrder(split, first, s) + " * " + chainOrder(split, s + 1, last) + ")";
+}
+
+// Estimates the cost of every subchain and finds the cheapest parenthesization by dynamic programming,
+// as for dense matrix chains but with sparse costs. best[i][j] is the cheapest cost of the product of
+// matrices i .. j, and split[i][j] the last matrix of its left factor
+static ChainEstimate planChain(const vector<CompressedView>& chain, vector<vector<int>>& split,
+                               vector<vector<double>>& best) {
+  STATS_ONLY(StatsTimer timer(SparseStats::CHAIN_PLAN));
+  ChainEstimate estimate(chain);
+  int n = chain.size();
+  split.assign(n, vector<int>(n, 0));
+  best.assign(n, vector<double>(n, 0));
+  for (int length = 2; length <= n; length++) {
+    for (int i = 0; i + length <= n; i++) {
+      int j = i + length - 1;
+      best[i][j] = -1;
+      for (int s = i; s < j; s++) {
+        double cost = best[i][s] + best[s + 1][j] + estimate.cost(i, s, j);
+        if (best[i][j] < 0 || cost < best[i][j]) {
+          best[i][j] = cost;
+          split[i][j] = s;
+        }
+      }
+    }
+  }
+  return estimate;
+}
+
+// Computes the product of matrices first .. last in the order chosen by the planner, recording every
+// product in the report. Single matrices are used in place rather than copied
+static void multiplyChainRange(const vector<CompressedView>& chain, const vector<vector<int>>& split,
+                               const ChainEstimate& estimate, int first, int last, CSRMatrix& result,
+                               ChainReport* report) {
+  int s = split[first][last];
+  CSRMatrix leftProduct, rightProduct;
+  if (s > first) {
+    multiplyChainRange(chain, split, estimate, first, s, leftProduct, report);
+  }
+  if (last > s + 1) {
+    multiplyChainRange(chain, split, estimate, s + 1, last, rightProduct, report);
+  }
+  CompressedView left = s > first ? leftProduct.view() : chain[first];
+  CompressedView right = last > s + 1 ? rightProduct.view() : chain[last];
+
+  // Every entry in column k of the left factor meets every entry in row k of the right one
+  long long products = 0;
+  for (int p = 0; p < left.ptr[left.numMajor]; p++) {
+    products += right.ptr[left.idx[p] + 1] - right.ptr[left.idx[p]];
+  }
+  result = multiplyCSR(left, right);
+  if (report != nullptr) {
+    report->cost += products;
+    report->steps.push_back({first, s, last, llround(estimate.cost(first, s, last)),
+                             llround(estimate.nnz[first][last]), products, result.nnz()});
+  }
+}
+
+// Multiplies a chain of CSR matrices, M0 * M1 * ... , in the order that the planner expects to take the
+// fewest partial products (see planChain). Returns false and sets error if the chain is empty or the
+// dimensions of neighbouring matrices do not match
+bool multiplyChainCSR(const vector<CompressedView>& chain, CSRMatrix& result, string& error, ChainReport* report) {
+  if (chain.empty()) {
+    error = "Unable to multiply an empty chain";
+    return false;
+  }
+  for (size_t m = 0; m + 1 < chain.size(); m++) {
+    if (chain[m].numMinor != chain[m + 1].numMajor) {
+      error = "Unable to multiply a " + to_string(chain[m].numMajor) + "x" + to_string(chain[m].numMinor) +
+              " matrix and a " + to_string(chain[m + 1].numMajor) + "x" + to_string(chain[m + 1].numMinor) + " matrix";
+      return false;
+    }
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  int n = chain.size();
+  vector<vector<int>> split;
+  vector<vector<double>> best;
+  ChainEstimate estimate = planChain(chain, split, best);
+  chrono::steady_clock::time_point planned = chrono::steady_clock::now();
+
+  if (report != nullptr) {
+    double leftToRight = 0;
+    for (int s = 0; s + 1 < n; s++) {
+      leftToRight += estimate.cost(0, s, s + 1);
+    }
+    report->order = chainOrder(split, 0, n - 1);
+    report->estimatedCost = llround(best[0][n - 1]);
+    report->leftToRightCost = llround(leftToRight);
+    report->cost = 0;
+    report->steps.clear();
+  }
+
+  if (n == 1) {
+    result = CSRMatrix(chain[0].numMajor, chain[0].numMinor);
+    int entries = chain[0].ptr[chain[0].numMajor];
+    result.rowPtr.assign(chain[0].ptr, chain[0].ptr + chain[0].numMajor + 1);
+    result.colIdx.assign(chain[0].idx, chain[0].idx + entries);
+    result.values.assign(chain[0].val, chain[0].val + entries);
+  }
+  else {
+    multiplyChainRange(chain, split, estimate, 0, n - 1, result, report);
+  }
+
+  if (report != nullptr) {
+    report->planSeconds = chrono::duration<double>(planned - start).count();
+    report->multiplySeconds = chrono::duration<double>(chrono::steady_clock::now() - planned).count();
+  }
+  return true;
+}
+
+// Multiplies a chain of matrices in the order chosen by the planner. See multiplyChainCSR
+bool multiplyChain(const vector<const SparseMatrix*>& chain, SparseMatrix& result, string& error, ChainReport* report) {
+  vector<CSRMatrix> compressed;
+  compressed.reserve(chain.size());
+  vector<CompressedView> views;
+  for (const SparseMatrix* matrix : chain) {
+    compressed.push_back(matrix->toCSR());
+    views.push_back(compressed.back().view());
+  }
+  CSRMatrix product;
+  if (!multiplyChainCSR(views, product, error, report)) {
+    return false;
+  }
+  result = SparseMatrix(product);
+  return true;
+}
+
+// Builds the adjacency lists of the graph of a square matrix: i and j are neighbours if (i, j) or (j, i)
+// is an entry, and the diagonal is left out. Row i of the matrix and row i of its transpose are both
+// sorted, so each list is one merge of the two and comes out sorted and free of duplicates
+static void symmetricPattern(const CompressedView& a, vector<int>& ptr, vector<int>& adj) {
+  int n = a.numMajor;
+  vector<int> tptr, tidx, tval;
+  transposeCompressed(a, tptr, tidx, tval);
+  ptr.assign(n + 1, 0);
+  adj.clear();
+  adj.reserve(2 * (size_t)a.ptr[n]);
+  for (int i = 0; i < n; i++) {
+    int p = a.ptr[i], q = tptr[i];
+    while (p < a.ptr[i + 1] || q < tptr[i + 1]) {
+      int j = q == tptr[i + 1] || (p < a.ptr[i + 1] && a.idx[p] < tidx[q]) ? a.idx[p++]
+            : p == a.ptr[i + 1] || tidx[q] < a.idx[p] ? tidx[q++]
+            : (q++, a.idx[p++]);
+      if (j != i) {
+        adj.push_back(j);
+      }
+    }
+    ptr[i + 1] = adj.size();
+  }
+}
+
+// Breadth-first search over the vertices labelled label, from start, that visits the neighbours of
+// every vertex in order of increasing degree (Cuthill-McKee). Visited vertices are relabelled visited
+// and appended to order, and lastLevel is set to the position in order where the deepest level starts.
+// Returns the number of levels
+static int levelSearch(const vector<int>& ptr, const vector<int>& adj, vector<int>& labels, int label, int visited,
+                       int start, vector<int>& order, size_t& lastLevel) {
+  size_t head = order.size();
+  order.push_back(start);
+  labels[start] = visited;
+  int levels = 0;
+  vector<int> neighbours;
+  while (head < order.size()) {
+    lastLevel = head;
+    size_t levelEnd = order.size();
+    levels++;
+    for (; head < levelEnd; head++) {
+      int v = order[head];
+      neighbours.clear();
+      for (int p = ptr[v]; p < ptr[v + 1]; p++) {
+        if (labels[adj[p]] == label) {
+          labels[adj[p]] = visited;
+          neighbours.push_back(adj[p]);
+        }
+      }
+      stable_sort(neighbours.begin(), neighbours.end(), [&](int x, int y) {
+        return ptr[x + 1] - ptr[x] < ptr[y + 1] - ptr[y];
+      });
+      order.insert(order.end(), neighbours.begin(), neighbours.end());
+    }
+  }
+  return levels;
+}
+
+// Finds a pseudo-peripheral vertex in the component of start among the vertices labelled label, by
+// restarting the level search from a vertex of least degree in the deepest level for as long as that
+// makes the level structure deeper (George and Liu). The labels are left as they were
+static int peripheralVertex(const vector<int>& ptr, const vector<int>& adj, vector<int>& labels, int label, int start) {
+  const int SEARCHING = -2; // Label of the vertices reached by the current search
+  vector<int> order;
+  int depth = 0;
+  while (true) {
+    order.clear();
+    size_t lastLevel;
+    int levels = levelSearch(ptr, adj, labels, label, SEARCHING, start, order, lastLevel);
+    for (int v : order) {
+      labels[v] = label;
+    }
+    if (levels <= depth) {
+      return start;
+    }
+    depth = levels;
+    int candidate = order[lastLevel];
+    for (size_t k = lastLevel; k < order.size(); k++) {
+      if (ptr[order[k] + 1] - ptr[order[k]] < ptr[candidate + 1] - ptr[candidate]) {
+        candidate = order[k];
+      }
+    }
+    start = candidate;
+  }
+}
+
+// Computes the reverse Cuthill-McKee ordering of a square matrix. Every connected component of the
+// symmetrized pattern is searched breadth first from a pseudo-peripheral vertex, neighbours in order of
+// increasing degree, and the concatenated order is reversed. Neighbouring vertices get nearby numbers,
+// which narrows the band of the matrix around the diagonal
+vector<int> reverseCuthillMcKee(const CompressedView& a) {
+  STATS_ONLY(StatsTimer timer(SparseStats::REORDER));
+  int n = a.numMajor;
+  vector<int> ptr, adj;
+  symmetricPattern(a, ptr, adj);
+
+  // Components are started from their vertices of least degree
+  vector<int> byDegree(n);
+  iota(byDegree.begin(), byDegree.end(), 0);
+  stable_sort(byDegree.begin(), byDegree.end(), [&](int x, int y) {
+    return ptr[x + 1] - ptr[x] < ptr[y + 1] - ptr[y];
+  });
+
+  const int UNVISITED = 0, VISITED = 1;
+  vector<int> labels(n, UNVISITED);
+  vector<int> order;
+  order.reserve(n);
+  for (int v : byDegree) {
+    if (labels[v] == UNVISITED) {
+      size_t lastLevel;
+      levelSearch(ptr, adj, labels, UNVISITED, VISITED, peripheralVertex(ptr, adj, labels, UNVISITED, v), order, lastLevel);
+    }
+  }
+  reverse(order.begin(), order.end());
+  STATS_ONLY(timer.setEntries(n));
+  return order;
+}
+
+// Orders the vertices of a square matrix by decreasing degree in the symmetrized pattern, ties in their
+// original order. In graphs with a few highly connected vertices this keeps the rows that are read most
+// often next to each other
+vector<int> degreeOrdering(const CompressedView& a) {
+  STATS_ONLY(StatsTimer timer(SparseStats::REORDER));
+  int n = a.numMajor;
+  vector<int> ptr, adj;
+  symmetricPattern(a, ptr, adj);
+  vector<int> order(n);
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](int x, int y) {
+    return ptr[x + 1] - ptr[x] > ptr[y + 1] - ptr[y];
+  });
+  STATS_ONLY(timer.setEntries(n));
+  return order;
+}
+
+// Orders the vertices of a square matrix by recursive bisection of the symmetrized pattern until every
+// part holds at most n / parts vertices. A part is split by a level search from a pseudo-peripheral
+// vertex of each of its components: the first half of the search becomes one part and the rest the
+// other, so both halves tend to be connected and few edges cross between them. Parts that are small
+// enough are searched once more, and the vertices of every part are numbered contiguously in the order
+// of that search, so the entries of each part form a
+// dense diagonal block and the rows a part reads stay close together
+vector<int> partitionOrdering(const CompressedView& a, int parts) {
+  STATS_ONLY(StatsTimer timer(SparseStats::REORDER));
+  int n = a.numMajor;
+  vector<int> ptr, adj;
+  symmetricPattern(a, ptr, adj);
+  int largestPart = max(1, (n + max(1, parts) - 1) / max(1, parts));
+
+  // Every vertex is labelled with the first position of its part in order
+  const int VISITED = -1;
+  vector<int> order(n), labels(n, 0), searched;
+  iota(order.begin(), order.end(), 0);
+  vector<pair<int, int>> pending = {{0, n}}; // Parts still to be split, as ranges of order
+  while (!pending.empty()) {
+    int begin = pending.back().first, end = pending.back().second;
+    pending.pop_back();
+    searched.clear();
+    for (int k = begin; k < end; k++) {
+      if (labels[order[k]] == begin) {
+        size_t lastLevel;
+        int start = peripheralVertex(ptr, adj, labels, begin, order[k]);
+        levelSearch(ptr, adj, labels, begin, VISITED, start, searched, lastLevel);
+      }
+    }
+    copy(searched.begin(), searched.end(), order.begin() + begin);
+    if (end - begin <= largestPart) {
+      continue;
+    }
+    int middle = begin + (end - begin) / 2;
+    for (int k = begin; k < end; k++) {
+      labels[order[k]] = k < middle ? begin : middle;
+    }
+    pending.push_back({begin, middle});
+    pending.push_back({middle, end});
+  }
+  STATS_ONLY(timer.setEntries(n));
+  return order;
+}
+
+// Inverts an ordering: the result maps every old index to its new one
+vector<int> inversePermutation(const vector<int>& order) {
+  vector<int> inverse(order.size());
+  for (size_t k = 0; k < order.size(); k++) {
+    inverse[order[k]] = k;
+  }
+  return inverse;
+}
+
+// Permutes the rows and columns of a CSR matrix: row rowOrder[i] and column colOrder[j] become row i and
+// column j. A counting sort by new column over the rows in their new order yields the permuted matrix in
+// CSC form, already sorted, and a transposition turns it back into CSR, so the work is linear
+CSRMatrix permuteCSR(const CompressedView& a, const vector<int>& rowOrder, const vector<int>& colOrder) {
+  STATS_ONLY(StatsTimer timer(SparseStats::PERMUTE));
+  int nnz = a.ptr[a.numMajor];
+  STATS_ONLY(timer.setEntries(nnz));
+  vector<int> newCol = inversePermutation(colOrder);
+  vector<int> colPtr(a.numMinor + 1, 0), rowIdx(nnz), values(nnz);
+  for (int p = 0; p < nnz; p++) {
+    colPtr[newCol[a.idx[p]] + 1]++;
+  }
+  for (int j = 0; j < a.numMinor; j++) {
+    colPtr[j + 1] += colPtr[j];
+  }
+  vector<int> next(colPtr.begin(), colPtr.end() - 1);
+  for (int i = 0; i < a.numMajor; i++) {
+    int row = rowOrder[i];
+    for (int p = a.ptr[row]; p < a.ptr[row + 1]; p++) {
+      int dest = next[newCol[a.idx[p]]]++;
+      rowIdx[dest] = i;
+      values[dest] = a.val[p];
+    }
+  }
+
+  CSRMatrix result(a.numMajor, a.numMinor);
+  CompressedView permuted = {a.numMinor, a.numMajor, colPtr.data(), rowIdx.data(), values.data()};
+  transposeCompressed(permuted, result.rowPtr, result.colIdx, result.values);
+  return result;
+}
+
+// Measures the bandwidth and profile of a CSR matrix
+OrderingMetrics orderingMetrics(const CompressedView& a) {
+  OrderingMetrics metrics = {0, 0};
+  for (int i = 0; i < a.numMajor; i++) {
+    if (a.ptr[i] == a.ptr[i + 1]) {
+      continue;
+    }
+    int first = a.idx[a.ptr[i]], last = a.idx[a.ptr[i + 1] - 1];
+    metrics.bandwidth = max(metrics.bandwidth, (long long)max(abs(i - first), abs(last - i)));
+    if (first < i) {
+      metrics.profile += i - first;
+    }
+  }
+  return metrics;
+}
+
+// Panel is a block of consecutive rows in CSR form, with ptr rebased so that it starts at 0
+struct Panel {
+  int firstRow;
+  vector<int> ptr, idx, val;
+};
+
+// PanelQueue passes panels from one stage of the out-of-core pipeline to the next. It holds one panel,
+// so a stage works on the next panel while the previous one waits to be taken, and a full queue stalls
+// the producer, which bounds the panels in flight. close() wakes every waiter: push() then returns false,
+// and pop() returns false once the queue is empty
+class PanelQueue {
+public:
+  PanelQueue();
+  bool push(Panel&& panel);
+  bool pop(Panel& panel);
+  void close();
+private:
+  mutex lock;
+  condition_variable changed;
+  Panel slot;
+  bool full;
+  bool closed;
+};
+
+// Constructor creates an empty, open queue
+PanelQueue::PanelQueue() : full(false), closed(false) {}
+
+// Waits for room and hands a panel to the next stage. Returns false if the queue was closed
+bool PanelQueue::push(Panel&& panel) {
+  unique_lock<mutex> guard(lock);
+  changed.wait(guard, [this] { return !full || closed; });
+  if (closed) {
+    return false;
+  }
+  slot = std::move(panel);
+  full = true;
+  changed.notify_all();
+  return true;
+}
+
+// Waits for a panel and takes it. Returns false if the queue is closed and empty
+bool PanelQueue::pop(Panel& panel) {
+  unique_lock<mutex> guard(lock);
+  changed.wait(guard, [this] { return full || closed; });
+  if (!full) {
+    return false;
+  }
+  panel = std::move(slot);
+  full = false;
+  changed.notify_all();
+  return true;
+}
+
+// Closes the queue; a panel already in it can still be taken
+void PanelQueue::close() {
+  lock_guard<mutex> guard(lock);
+  closed = true;
+  changed.notify_all();
+}
+
+// Reads bytes at the given offset of a file. Returns false on an error or a short read
+static bool readFully(int fd, uint64_t offset, void* data, size_t bytes) {
+  char* out = (char*)data;
+  while (bytes > 0) {
+    ssize_t n = pread(fd, out, bytes, offset);
+    if (n <= 0) {
+      return false;
+    }
+    out += n;
+    offset += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+// Writes bytes at the given offset of a file. Returns false on an error
+static bool writeFully(int fd, uint64_t offset, const void* data, size_t bytes) {
+  const char* in = (const char*)data;
+  while (bytes > 0) {
+    ssize_t n = pwrite(fd, in, bytes, offset);
+    if (n <= 0) {
+      return false;
+    }
+    in += n;
+    offset += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+// Creates an empty file with a unique hidden name in the given directory, readable and writable only by
+// the owner. Returns its descriptor and sets path, or returns -1
+static int createScratchFile(const string& directory, string& path) {
+  string name = directory + "/.spmx-XXXXXX";
+  vector<char> buffer(name.begin(), name.end());
+  buffer.push_back('\0');
+  int fd = mkstemp(buffer.data());
+  path = buffer.data();
+  return fd;
+}
+
+// Returns the directory part of a path, or "." if it has none
+static string directoryOf(const string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == string::npos) {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Multiplies two snapshot files into a snapshot file without holding the left operand or the result in
+// memory. The right operand is mapped, so only the pages that products touch are resident and the page
+// cache can evict them. Three stages run at once:
+//  - a reader thread streams the left operand in row panels with pread,
+//  - the calling thread multiplies each panel by the right operand, on the thread pool when it is large,
+//  - a writer thread appends each result panel: row pointers and column indices go straight to their
+//    final place in the output, and values are spooled to a scratch file and appended at the end, once
+//    the size of the column index array is known.
+// Each queue between stages holds one panel, so at most three left and three result panels are alive.
+// The memory budget is split between those six; a panel stops growing at its share of left entries,
+// and at the row where its partial products, an upper bound on its result entries, reach the same
+// share. A single row is never split, and the mapped right operand and the accumulators of the
+// multiplication are outside the budget. The output is written to a scratch file in its directory and
+// renamed into place when complete, so it may name one of the operands. Returns false and sets error on
+// failure, leaving any existing output untouched
+bool multiplyOutOfCore(const string& leftPath, const string& rightPath, const string& outputPath,
+                       size_t memoryBudget, string& error, OutOfCoreStats* stats) {
+  STATS_ONLY(StatsTimer timer(SparseStats::OUT_OF_CORE_MULTIPLY));
+  OutOfCoreStats report = OutOfCoreStats();
+  MappedMatrix right;
+  if (!right.open(rightPath, error)) {
+    return false;
+  }
+  CompressedView b = right.view();
+
+  // Check the left operand without reading more than its header
+  int leftFd = ::open(leftPath.c_str(), O_RDONLY);
+  if (leftFd < 0) {
+    error = leftPath + ": cannot open file";
+    return false;
+  }
+  SnapshotHeader left;
+  struct stat info;
+  const char* problem = fstat(leftFd, &info) != 0 || (size_t)info.st_size < sizeof(left) || !readFully(leftFd, 0, &left, sizeof(left))
+                            ? "not a snapshot file" : snapshotHeaderProblem(left, info.st_size);
+  if (problem != nullptr) {
+    ::close(leftFd);
+    error = leftPath + ": " + problem;
+    return false;
+  }
+  if (left.cols != b.numMajor) {
+    ::close(leftFd);
+    error = "Unable to mul a " + to_string(left.rows) + "x" + to_string(left.cols) + " matrix and a " +
+            to_string(b.numMajor) + "x" + to_string(b.numMinor) + " matrix";
+    return false;
+  }
+
+  string directory = directoryOf(outputPath);
+  string tempPath, spoolPath;
+  int outFd = createScratchFile(directory, tempPath);
+  int spoolFd = outFd < 0 ? -1 : createScratchFile(directory, spoolPath);
+  if (spoolFd >= 0) {
+    unlink(spoolPath.c_str()); // The spool disappears when it is closed
+  }
+  if (outFd < 0 || spoolFd < 0) {
+    ::close(leftFd);
+    if (outFd >= 0) {
+      ::close(outFd);
+      unlink(tempPath.c_str());
+    }
+    error = outputPath + ": cannot create a scratch file in " + directory;
+    return false;
+  }
+
+  int numRows = left.rows;
+  long long panelEntries = max<long long>(1024, memoryBudget / 6 / (2 * sizeof(int)));
+  int panelRows = max<long long>(1, min<long long>(numRows, memoryBudget / 6 / sizeof(int)));
+  SnapshotHeader header;
+  fillSnapshotHeader(header, numRows, b.numMinor, 0);
+
+  PanelQueue toCompute, toWrite;
+  mutex errorLock;
+  string stageError;
+  auto fail = [&](const string& message) {
+    lock_guard<mutex> guard(errorLock);
+    if (stageError.empty()) {
+      stageError = message;
+    }
+    toCompute.close();
+    toWrite.close();
+  };
+
+  // Reader: cut the left operand into panels and read them
+  thread reader([&] {
+    vector<int> ptr;
+    for (int row = 0; row < numRows;) {
+      int last = min(numRows, row + panelRows);
+      ptr.resize(last - row + 1);
+      if (!readFully(leftFd, left.rowPtrOffset + (uint64_t)row * sizeof(int), ptr.data(), ptr.size() * sizeof(int))) {
+        fail(leftPath + ": read failed");
+        return;
+      }
+      for (size_t i = 0; i + 1 < ptr.size(); i++) {
+        if (ptr[i] < 0 || ptr[i + 1] < ptr[i] || ptr[i + 1] > left.nnz) {
+          fail(leftPath + ": corrupt row pointers");
+          return;
+        }
+      }
+      int end = row + 1;
+      while (end < last && ptr[end + 1 - row] - ptr[0] <= panelEntries) {
+        end++;
+      }
+
+      Panel panel;
+      panel.firstRow = row;
+      panel.idx.resize(ptr[end - row] - ptr[0]);
+      if (!readFully(leftFd, left.colIdxOffset + (uint64_t)ptr[0] * sizeof(int), panel.idx.data(), panel.idx.size() * sizeof(int))) {
+        fail(leftPath + ": read failed");
+        return;
+      }
+
+      // Keep the rows whose partial products fit in the share of the result panel
+      long long products = 0;
+      int cut = row;
+      for (int p = 0; cut < end; cut++) {
+        long long rowProducts = 0;
+        for (; p < ptr[cut + 1 - row] - ptr[0]; p++) {
+          if (panel.idx[p] < 0 || panel.idx[p] >= b.numMajor) {
+            fail(leftPath + ": corrupt column index");
+            return;
+          }
+          rowProducts += b.ptr[panel.idx[p] + 1] - b.ptr[panel.idx[p]];
+        }
+        if (cut > row && products + rowProducts > panelEntries) {
+          break;
+        }
+        products += rowProducts;
+      }
+      end = cut;
+
+      panel.ptr.assign(ptr.begin(), ptr.begin() + (end - row) + 1);
+      for (size_t i = 0; i < panel.ptr.size(); i++) {
+        panel.ptr[i] -= ptr[0];
+      }
+      panel.idx.resize(panel.ptr.back());
+      panel.val.resize(panel.ptr.back());
+      if (!readFully(leftFd, left.valuesOffset + (uint64_t)ptr[0] * sizeof(int), panel.val.data(), panel.val.size() * sizeof(int))) {
+        fail(leftPath + ": read failed");
+        return;
+      }
+      report.bytesRead += (panel.ptr.size() + panel.idx.size() + panel.val.size()) * sizeof(int);
+      if (!toCompute.push(std::move(panel))) {
+        return;
+      }
+      row = end;
+    }
+    toCompute.close();
+  });
+
+  // Writer: place every result panel in the output file as it arrives
+  thread writer([&] {
+    long long nnz = 0;
+    int zero = 0;
+    if (!writeFully(outFd, header.rowPtrOffset, &zero, sizeof(int))) {
+      fail(outputPath + ": write failed");
+      return;
+    }
+    Panel panel;
+    while (toWrite.pop(panel)) {
+      int panelNnz = panel.ptr.back();
+      if (nnz + panelNnz > INT32_MAX) {
+        fail("the result has too many entries for a snapshot");
+        return;
+      }
+      for (size_t i = 0; i < panel.ptr.size(); i++) {
+        panel.ptr[i] += nnz;
+      }
+      if (!writeFully(outFd, header.rowPtrOffset + (uint64_t)(panel.firstRow + 1) * sizeof(int), panel.ptr.data() + 1,
+                   (panel.ptr.size() - 1) * sizeof(int)) ||
+          !writeFully(outFd, header.colIdxOffset + (uint64_t)nnz * sizeof(int), panel.idx.data(), panelNnz * sizeof(int)) ||
+          !writeFully(spoolFd, (uint64_t)nnz * sizeof(int), panel.val.data(), panelNnz * sizeof(int))) {
+        fail(outputPath + ": write failed");
+        return;
+      }
+      nnz += panelNnz;
+      report.bytesWritten += (panel.ptr.size() - 1 + 2 * (size_t)panelNnz) * sizeof(int);
+    }
+    report.nnz = nnz;
+  });
+
+  // Compute: multiply every panel as soon as it has been read
+  Panel panel;
+  while (true) {
+    auto waitStart = chrono::steady_clock::now();
+    if (!toCompute.pop(panel)) {
+      break;
+    }
+    report.readWaitSeconds += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
+    Panel result;
+    result.firstRow = panel.firstRow;
+    CompressedView a = {(int)panel.ptr.size() - 1, (int)left.cols, panel.ptr.data(), panel.idx.data(), panel.val.data()};
+    multiplyCompressed(a, b, result.ptr, result.idx, result.val);
+    panel = Panel(); // Free the left panel before the result panel waits for the writer
+    report.panels++;
+
+    waitStart = chrono::steady_clock::now();
+    if (!toWrite.push(std::move(result))) {
+      break;
+    }
+    report.writeWaitSeconds += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
+  }
+  toWrite.close();
+  reader.join();
+  writer.join();
+  ::close(leftFd);
+
+  // Append the spooled values after the column indices and write the header last
+  bool ok = stageError.empty();
+  if (ok) {
+    fillSnapshotHeader(header, numRows, b.numMinor, report.nnz);
+    vector<char> buffer(1 << 20);
+    for (uint64_t done = 0; ok && done < (uint64_t)report.nnz * sizeof(int); done += buffer.size()) {
+      size_t bytes = min<uint64_t>(buffer.size(), report.nnz * sizeof(int) - done);
+      ok = readFully(spoolFd, done, buffer.data(), bytes) && writeFully(outFd, header.valuesOffset + done, buffer.data(), bytes);
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    ok = ok && writeFully(outFd, 0, &header, sizeof(header)) && ftruncate(outFd, header.fileSize) == 0 &&
+         fchmod(outFd, 0644 & ~mask) == 0;
+    report.bytesWritten += ok ? report.nnz * sizeof(int) + sizeof(header) : 0;
+    if (!ok) {
+      stageError = outputPath + ": write failed";
+    }
+  }
+  ::close(spoolFd);
+  if (::close(outFd) != 0 && ok) {
+    ok = false;
+    stageError = outputPath + ": write failed";
+  }
+  if (ok && rename(tempPath.c_str(), outputPath.c_str()) != 0) {
+    ok = false;
+    stageError = outputPath + ": cannot replace file";
+  }
+  if (!ok) {
+    unlink(tempPath.c_str());
+    error = stageError;
+    return false;
+  }
+  STATS_ONLY(timer.setEntries(report.nnz));
+  if (stats != nullptr) {
+    *stats = report;
+  }
+  return true;
+}
+
+// Row-range kernels for sparse matrix-vector (y = A*x) and sparse matrix-dense block (Y = A*X) products.
+// X and Y are row-major with k columns. One implementation of each is picked at startup from the
+// instruction sets the CPU supports
+typedef void (*SpmvKernel)(const CompressedView& a, const double* x, double* y, int begin, int end);
+typedef void (*SpmmKernel)(const CompressedView& a, const double* x, int k, double* y, int begin, int end);
+
+// Portable SpMV kernel
+static void spmvScalar(const CompressedView& a, const double* x, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    double sum = 0;
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      sum += a.val[p] * x[a.idx[p]];
+    }
+    y[i] = sum;
+  }
+}
+
+// Portable SpMM kernel. Each loaded index selects a whole row of X, so index loads are shared by k columns
+static void spmmScalar(const CompressedView& a, const double* x, int k, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    double* out = y + (size_t)i * k;
+    fill(out, out + k, 0.0);
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      const double* in = x + (size_t)a.idx[p] * k;
+      double value = a.val[p];
+      for (int j = 0; j < k; j++) {
+        out[j] += value * in[j];
+      }
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 SpMV kernel: gathers four entries of x per step and accumulates them with fused multiply-adds
+__attribute__((target("avx2,fma")))
+static void spmvAvx2(const CompressedView& a, const double* x, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    int p = a.ptr[i], last = a.ptr[i + 1];
+    __m256d acc = _mm256_setzero_pd();
+    __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    for (; p + 4 <= last; p += 4) {
+      __m128i cols = _mm_loadu_si128((const __m128i*)(a.idx + p));
+      __m256d values = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(a.val + p)));
+      acc = _mm256_fmadd_pd(values, _mm256_mask_i32gather_pd(_mm256_setzero_pd(), x, cols, all, 8), acc);
+    }
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; p < last; p++) {
+      sum += a.val[p] * x[a.idx[p]];
+    }
+    y[i] = sum;
+  }
+}
+
+// AVX2 SpMM kernel: updates four columns of the output row per step
+__attribute__((target("avx2,fma")))
+static void spmmAvx2(const CompressedView& a, const double* x, int k, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    double* out = y + (size_t)i * k;
+    fill(out, out + k, 0.0);
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      const double* in = x + (size_t)a.idx[p] * k;
+      __m256d value = _mm256_set1_pd(a.val[p]);
+      int j = 0;
+      for (; j + 4 <= k; j += 4) {
+        _mm256_storeu_pd(out + j, _mm256_fmadd_pd(value, _mm256_loadu_pd(in + j), _mm256_loadu_pd(out + j)));
+      }
+      for (; j < k; j++) {
+        out[j] += a.val[p] * in[j];
+      }
+    }
+  }
+}
+
+// AVX-512 SpMV kernel: gathers eight entries of x per step
+__attribute__((target("avx512f")))
+static void spmvAvx512(const CompressedView& a, const double* x, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    int p = a.ptr[i], last = a.ptr[i + 1];
+    __m512d acc = _mm512_setzero_pd();
+    for (; p + 8 <= last; p += 8) {
+      __m256i cols = _mm256_loadu_si256((const __m256i*)(a.idx + p));
+      __m512d values = _mm512_maskz_cvtepi32_pd(0xFF, _mm256_loadu_si256((const __m256i*)(a.val + p)));
+      acc = _mm512_fmadd_pd(values, _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, cols, x, 8), acc);
+    }
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, acc);
+    double sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; p < last; p++) {
+      sum += a.val[p] * x[a.idx[p]];
+    }
+    y[i] = sum;
+  }
+}
+
+// AVX-512 SpMM kernel: updates eight columns of the output row per step
+__attribute__((target("avx512f")))
+static void spmmAvx512(const CompressedView& a, const double* x, int k, double* y, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    double* out = y + (size_t)i * k;
+    fill(out, out + k, 0.0);
+    for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+      const double* in = x + (size_t)a.idx[p] * k;
+      __m512d value = _mm512_set1_pd(a.val[p]);
+      int j = 0;
+      for (; j + 8 <= k; j += 8) {
+        _mm512_storeu_pd(out + j, _mm512_fmadd_pd(value, _mm512_loadu_pd(in + j), _mm512_loadu_pd(out + j)));
+      }
+      for (; j < k; j++) {
+        out[j] += a.val[p] * in[j];
+      }
+    }
+  }
+}
+#endif
+
+// SpmvKernels is the set of kernels chosen for this CPU
+struct SpmvKernels {
+  SpmvKernel spmv;
+  SpmmKernel spmm;
+  const char* name;
+};
+
+// Picks the widest kernels the CPU supports, once
+static const SpmvKernels& spmvKernels() {
+  static const SpmvKernels kernels = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return SpmvKernels{spmvAvx512, spmmAvx512, "avx512"};
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return SpmvKernels{spmvAvx2, spmmAvx2, "avx2"};
+    }
+#endif
+    return SpmvKernels{spmvScalar, spmmScalar, "scalar"};
+  }();
+  return kernels;
+}
+
+// Returns the name of the kernels in use: "avx512", "avx2" or "scalar"
+const char* spmvKernelName() {
+  return spmvKernels().name;
+}
+
+// Splits the rows into parts holding roughly equal numbers of entries. Part t is rows
+// bounds[t] .. bounds[t+1]-1
+static vector<int> balanceRows(const CompressedView& a, int parts) {
+  vector<int> bounds(parts + 1, a.numMajor);
+  bounds[0] = 0;
+  long long nnz = a.ptr[a.numMajor];
+  for (int t = 1; t < parts; t++) {
+    int target = nnz * t / parts;
+    bounds[t] = lower_bound(a.ptr, a.ptr + a.numMajor, target) - a.ptr;
+  }
+  return bounds;
+}
+
+// Runs a row-range kernel over all rows, on the thread pool when the matrix is large enough
+static void runRowKernel(const CompressedView& a, long long work, const function<void(int, int)>& kernel) {
+  ThreadPool& pool = ThreadPool::instance();
+  if (pool.numThreads() == 1 || work < (1 << 16)) {
+    kernel(0, a.numMajor);
+    return;
+  }
+
+  // Several parts per thread give work stealing room to even out the cost of the gathers
+  int parts = pool.numThreads() * 4;
+  vector<int> bounds = balanceRows(a, parts);
+  pool.parallelFor(parts, [&](int part, int) {
+    kernel(bounds[part], bounds[part + 1]);
+  });
+}
+
+// Computes y = A*x for a CSR matrix. x has numCols entries and y has numRows entries
+void spmv(const CompressedView& a, const double* x, double* y) {
+  STATS_ONLY(StatsTimer timer(SparseStats::SPMV));
+  STATS_ONLY(timer.setEntries(a.numMajor));
+  SpmvKernel kernel = spmvKernels().spmv;
+  runRowKernel(a, a.ptr[a.numMajor], [&](int begin, int end) {
+    kernel(a, x, y, begin, end);
+  });
+}
+
+// Computes Y = A*X for a CSR matrix and a row-major dense block X with k columns, such as a set of k
+// vectors solved together. X has numCols rows and Y has numRows rows
+void spmm(const CompressedView& a, const double* x, int k, double* y) {
+  STATS_ONLY(StatsTimer timer(SparseStats::SPMV));
+  STATS_ONLY(timer.setEntries((long long)a.numMajor * k));
+  SpmmKernel kernel = spmvKernels().spmm;
+  runRowKernel(a, (long long)a.ptr[a.numMajor] * k, [&](int begin, int end) {
+    kernel(a, x, k, y, begin, end);
+  });
+}
+
+// Computes y = A^T*x for a CSR matrix by scattering every row. x has numRows entries and y has numCols
+// entries. With several threads each one scatters a share of the rows into its own copy of y, and the
+// copies are summed afterwards
+void spmvTranspose(const CompressedView& a, const double* x, double* y) {
+  STATS_ONLY(StatsTimer timer(SparseStats::SPMV));
+  STATS_ONLY(timer.setEntries(a.numMinor));
+  ThreadPool& pool = ThreadPool::instance();
+  int threads = pool.numThreads();
+  long long nnz = a.ptr[a.numMajor];
+  fill(y, y + a.numMinor, 0.0);
+
+  // Scatters rows begin .. end-1 into out
+  auto scatter = [&](double* out, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      double scale = x[i];
+      for (int p = a.ptr[i]; p < a.ptr[i + 1]; p++) {
+        out[a.idx[p]] += a.val[p] * scale;
+      }
+    }
+  };
+
+  // Private copies only pay off when y is small compared to the work
+  if (threads == 1 || nnz < (1 << 16) || (long long)a.numMinor * threads > 4 * nnz) {
+    scatter(y, 0, a.numMajor);
+    return;
+  }
+
+  vector<int> bounds = balanceRows(a, threads);
+  vector<vector<double>> partial(threads);
+  pool.parallelFor(threads, [&](int part, int) {
+    partial[part].assign(a.numMinor, 0.0);
+    scatter(partial[part].data(), bounds[part], bounds[part + 1]);
+  });
+
+  // Sum the copies, splitting the columns across the threads
+  pool.parallelFor(threads, [&](int part, int) {
+    int begin = (long long)a.numMinor * part / threads;
+    int end = (long long)a.numMinor * (part + 1) / threads;
+    for (int t = 0; t < threads; t++) {
+      for (int j = begin; j < end; j++) {
+        y[j] += partial[t][j];
+      }
+    }
+  });
+}
+
+// Computes y = A*x
+void CSRMatrix::multiplyVector(const vector<double>& x, vector<double>& y) const {
+  y.resize(numRows);
+  spmv(view(), x.data(), y.data());
+}
+
+// Computes y = A^T*x
+void CSRMatrix::multiplyTransposeVector(const vector<double>& x, vector<double>& y) const {
+  y.resize(numCols);
+  spmvTranspose(view(), x.data(), y.data());
+}
+
+// Computes Y = A*X where X is a row-major numCols x k block
+void CSRMatrix::multiplyDense(const vector<double>& x, int k, vector<double>& y) const {
+  y.resize((size_t)numRows * k);
+  spmm(view(), x.data(), k, y.data());
+}
+
+// Returns A*x. The matrix is converted to CSR on every call; repeated products should convert once
+// with toCSR() and use CSRMatrix::multiplyVector
+vector<double> SparseMatrix::multiplyVector(const vector<double>& x) const {
+  vector<double> y;
+  toCSR().multiplyVector(x, y);
+  return y;
+}
+
+// Returns A^T*x, converting the matrix to CSR on every call
+vector<double> SparseMatrix::multiplyTransposeVector(const vector<double>& x) const {
+  vector<double> y;
+  toCSR().multiplyTransposeVector(x, y);
+  return y;
+}
+
+// Calls kernel with an integral_constant holding the block size when it is one of the sizes with
+// specialized loops, and with 0 otherwise, in which case the loops read the size at run time
+template <class Kernel>
+static void withBlockSize(int blockSize, Kernel kernel) {
+  switch (blockSize) {
+    case 2: kernel(integral_constant<int, 2>()); break;
+    case 3: kernel(integral_constant<int, 3>()); break;
+    case 4: kernel(integral_constant<int, 4>()); break;
+    case 6: kernel(integral_constant<int, 6>()); break;
+    case 8: kernel(integral_constant<int, 8>()); break;
+    default: kernel(integral_constant<int, 0>()); break;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 block kernels for the 4x4 and 8x8 blocks. Every one performs the same operations in the same
+// order as the portable loops, so both give identical results
+
+// Computes c += a * b for three 4x4 blocks. A register holds two columns of c; the four columns of a
+// are loaded once into both halves of a register, and the scales of both columns come from one load of b
+__attribute__((target("avx2")))
+static void blockMultiplyAdd4Avx2(const int* a, const int* b, int* c) {
+  __m256i columns[4];
+  for (int k = 0; k < 4; k++) {
+    columns[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(a + 4 * k)));
+  }
+  for (int col = 0; col < 4; col += 2) {
+    __m256i scales = _mm256_loadu_si256((const __m256i*)(b + 4 * col));
+    __m256i acc = _mm256_loadu_si256((const __m256i*)(c + 4 * col));
+    for (int k = 0; k < 4; k++) {
+      __m256i scale = _mm256_permutevar8x32_epi32(scales, _mm256_setr_epi32(k, k, k, k, k + 4, k + 4, k + 4, k + 4));
+      acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(columns[k], scale));
+    }
+    _mm256_storeu_si256((__m256i*)(c + 4 * col), acc);
+  }
+}
+
+// Computes c += a * b for three 8x8 blocks. A register holds one column, and the eight columns of a
+// stay in registers while the columns of c are updated
+__attribute__((target("avx2")))
+static void blockMultiplyAdd8Avx2(const int* a, const int* b, int* c) {
+  __m256i columns[8];
+  for (int k = 0; k < 8; k++) {
+    columns[k] = _mm256_loadu_si256((const __m256i*)(a + 8 * k));
+  }
+  for (int col = 0; col < 8; col++) {
+    __m256i acc = _mm256_loadu_si256((const __m256i*)(c + 8 * col));
+    for (int k = 0; k < 8; k++) {
+      acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(columns[k], _mm256_set1_epi32(b[8 * col + k])));
+    }
+    _mm256_storeu_si256((__m256i*)(c + 8 * col), acc);
+  }
+}
+
+// Computes c += sign * a for two blocks of area entries, a multiple of eight
+__attribute__((target("avx2")))
+static void blockAddAvx2(const int* a, int sign, int* c, int area) {
+  for (int e = 0; e < area; e += 8) {
+    __m256i left = _mm256_loadu_si256((const __m256i*)(c + e)), right = _mm256_loadu_si256((const __m256i*)(a + e));
+    __m256i sum = sign > 0 ? _mm256_add_epi32(left, right) : _mm256_sub_epi32(left, right);
+    _mm256_storeu_si256((__m256i*)(c + e), sum);
+  }
+}
+
+// Computes y += a * x for a 4x4 block: the four sums share one register
+__attribute__((target("avx2")))
+static void blockMultiplyVector4Avx2(const int* a, const double* x, double* y) {
+  __m256d sum = _mm256_setzero_pd();
+  for (int col = 0; col < 4; col++) {
+    __m256d column = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(a + 4 * col)));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(column, _mm256_set1_pd(x[col])));
+  }
+  _mm256_storeu_pd(y, _mm256_add_pd(_mm256_loadu_pd(y), sum));
+}
+
+// Computes y += a * x for an 8x8 block with the sums in two registers
+__attribute__((target("avx2")))
+static void blockMultiplyVector8Avx2(const int* a, const double* x, double* y) {
+  __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+  for (int col = 0; col < 8; col++) {
+    __m256d scale = _mm256_set1_pd(x[col]);
+    low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(a + 8 * col))), scale));
+    high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(a + 8 * col + 4))), scale));
+  }
+  _mm256_storeu_pd(y, _mm256_add_pd(_mm256_loadu_pd(y), low));
+  _mm256_storeu_pd(y + 4, _mm256_add_pd(_mm256_loadu_pd(y + 4), high));
+}
+#endif
+
+// Returns true if the CPU runs the AVX2 block kernels. Checked once at startup, so the microkernels
+// below test a plain constant
+static bool detectBlockAvx2() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+static const bool blockAvx2 = detectBlockAvx2();
+
+// Returns the name of the block kernels used for 4x4 and 8x8 blocks: "avx2" or "scalar"
+const char* bsrKernelName() {
+  return blockAvx2 ? "avx2" : "scalar";
+}
+
+// Block microkernels. B is the block size when it is known at compile time, so the loops have constant
+// trip counts and the compiler unrolls and vectorizes them, or 0 to use the run-time size n. The 4x4
+// and 8x8 blocks go to the AVX2 kernels on CPUs that have them. Blocks are column-major, so the
+// innermost loops run down contiguous columns
+
+// Computes c += a * b for three blocks
+template <int B>
+static inline void blockMultiplyAdd(const int* a, const int* b, int* c, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  if constexpr (B == 4 || B == 8) {
+    if (blockAvx2) {
+      B == 4 ? blockMultiplyAdd4Avx2(a, b, c) : blockMultiplyAdd8Avx2(a, b, c);
+      return;
+    }
+  }
+#endif
+  const int size = B > 0 ? B : n;
+  for (int col = 0; col < size; col++) {
+    for (int k = 0; k < size; k++) {
+      int scale = b[col * size + k];
+      for (int r = 0; r < size; r++) {
+        c[col * size + r] += a[k * size + r] * scale;
+      }
+    }
+  }
+}
+
+// Computes c += sign * a for two blocks
+template <int B>
+static inline void blockAdd(const int* a, int sign, int* c, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  if constexpr (B == 4 || B == 8) {
+    if (blockAvx2) {
+      blockAddAvx2(a, sign, c, B * B);
+      return;
+    }
+  }
+#endif
+  const int size = B > 0 ? B : n;
+  for (int e = 0; e < size * size; e++) {
+    c[e] += sign * a[e];
+  }
+}
+
+// Computes y += a * x for a block and the slices of x and y it covers. With a compile-time size the
+// sums are kept in a local array, which stays in registers because it cannot alias x, and y is written
+// once at the end
+template <int B>
+static inline void blockMultiplyVector(const int* a, const double* x, double* y, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  if constexpr (B == 4 || B == 8) {
+    if (blockAvx2) {
+      B == 4 ? blockMultiplyVector4Avx2(a, x, y) : blockMultiplyVector8Avx2(a, x, y);
+      return;
+    }
+  }
+#endif
+  const int size = B > 0 ? B : n;
+  double sum[B > 0 ? B : 1] = {};
+  double* out = B > 0 ? sum : y;
+  for (int col = 0; col < size; col++) {
+    double scale = x[col];
+    for (int r = 0; r < size; r++) {
+      out[r] += a[col * size + r] * scale;
+    }
+  }
+  if constexpr (B > 0) {
+    for (int r = 0; r < B; r++) {
+      y[r] += sum[r];
+    }
+  }
+}
+
+// Default constructor initializes an empty 0x0 matrix with 1x1 blocks
+BSRMatrix::BSRMatrix() : BSRMatrix(0, 0, 1) {}
+
+// Constructor with parameters initializes an all-zero matrix with the specified rows, columns and
+// block size
+BSRMatrix::BSRMatrix(int rows, int cols, int blockSize) {
+  numRows = rows;
+  numCols = cols;
+  this->blockSize = blockSize;
+  numBlockRows = (rows + blockSize - 1) / blockSize;
+  numBlockCols = (cols + blockSize - 1) / blockSize;
+  blockRowPtr.assign(numBlockRows + 1, 0);
+}
+
+// Converts a CSR matrix into blocks of the given size, or of the size picked by detectBlockSize if it
+// is 0 or less. Each block row gathers the block columns of its rows with a marker array, sorts them,
+// and scatters the entries into their blocks
+BSRMatrix::BSRMatrix(const CSRMatrix& csr, int blockSize)
+    : BSRMatrix(csr.numRows, csr.numCols, blockSize > 0 ? blockSize : detectBlockSize(csr)) {
+  int b = this->blockSize;
+  vector<int> position(numBlockCols, -1); // Block of every block column in the current block row
+  vector<int> cols;
+  for (int bi = 0; bi < numBlockRows; bi++) {
+    int firstRow = bi * b, lastRow = min(numRows, firstRow + b);
+    cols.clear();
+    for (int p = csr.rowPtr[firstRow]; p < csr.rowPtr[lastRow]; p++) {
+      int bj = csr.colIdx[p] / b;
+      if (position[bj] < 0) {
+        position[bj] = 0;
+        cols.push_back(bj);
+      }
+    }
+    sort(cols.begin(), cols.end());
+    for (size_t c = 0; c < cols.size(); c++) {
+      position[cols[c]] = blockColIdx.size();
+      blockColIdx.push_back(cols[c]);
+    }
+    values.resize(blockColIdx.size() * b * b, 0);
+
+    for (int i = firstRow; i < lastRow; i++) {
+      for (int p = csr.rowPtr[i]; p < csr.rowPtr[i + 1]; p++) {
+        int j = csr.colIdx[p];
+        values[((size_t)position[j / b] * b + j % b) * b + i - firstRow] = csr.values[p];
+      }
+    }
+    for (size_t c = 0; c < cols.size(); c++) {
+      position[cols[c]] = -1;
+    }
+    blockRowPtr[bi + 1] = blockColIdx.size();
+  }
+}
+
+// Picks the block size that stores a CSR matrix in the fewest bytes: a block of size b costs one
+// column index plus b*b values, zeros included, against one index and one value per entry in CSR.
+// Returns 1 if no block size of 2, 3, 4, 6 or 8 beats CSR
+int BSRMatrix::detectBlockSize(const CSRMatrix& csr) {
+  static const int candidates[] = {2, 3, 4, 6, 8};
+  long long bestBytes = 8LL * csr.nnz() + 4LL * csr.numRows;
+  int best = 1;
+  for (int b : candidates) {
+    int numBlockCols = (csr.numCols + b - 1) / b;
+    vector<int> seen(numBlockCols, -1); // Last block row that used every block column
+    long long blocks = 0;
+    for (int i = 0; i < csr.numRows; i++) {
+      for (int p = csr.rowPtr[i]; p < csr.rowPtr[i + 1]; p++) {
+        int bj = csr.colIdx[p] / b;
+        if (seen[bj] != i / b) {
+          seen[bj] = i / b;
+          blocks++;
+        }
+      }
+    }
+    long long bytes = blocks * (4 + 4LL * b * b) + 4LL * (csr.numRows / b + 1);
+    if (bytes < bestBytes) {
+      bestBytes = bytes;
+      best = b;
+    }
+  }
+  return best;
+}
+
+// Returns the number of stored blocks
+int BSRMatrix::numBlocks() const {
+  return blockColIdx.size();
+}
+
+// Converts the blocks back into CSR arrays, leaving out the zeros stored inside blocks
+CSRMatrix BSRMatrix::toCSR() const {
+  CSRMatrix csr(numRows, numCols);
+  int b = blockSize;
+  for (int i = 0; i < numRows; i++) {
+    int bi = i / b;
+    for (int k = blockRowPtr[bi]; k < blockRowPtr[bi + 1]; k++) {
+      const int* block = values.data() + (size_t)k * b * b;
+      for (int c = 0; c < b && blockColIdx[k] * b + c < numCols; c++) {
+        if (block[c * b + i % b] != 0) {
+          csr.colIdx.push_back(blockColIdx[k] * b + c);
+          csr.values.push_back(block[c * b + i % b]);
+        }
+      }
+    }
+    csr.rowPtr[i + 1] = csr.colIdx.size();
+  }
+  return csr;
+}
+
+// Adds (sign = 1) or subtracts (sign = -1) two BSR matrices with the same block size by merging each
+// pair of block rows with two pointers. Blocks whose values all cancel are not stored
+static BSRMatrix addBSR(const BSRMatrix& a, const BSRMatrix& b, int sign) {
+  STATS_ONLY(StatsTimer timer(SparseStats::BSR_ADD));
+  BSRMatrix result(a.numRows, a.numCols, a.blockSize);
+  int area = a.blockSize * a.blockSize;
+  result.blockColIdx.reserve(a.numBlocks() + b.numBlocks());
+  result.values.reserve((size_t)(a.numBlocks() + b.numBlocks()) * area);
+
+  withBlockSize(a.blockSize, [&](auto size) {
+    constexpr int B = decltype(size)::value;
+    for (int bi = 0; bi < a.numBlockRows; bi++) {
+      int p = a.blockRowPtr[bi], pEnd = a.blockRowPtr[bi + 1];
+      int q = b.blockRowPtr[bi], qEnd = b.blockRowPtr[bi + 1];
+      while (p < pEnd || q < qEnd) {
+        size_t start = result.values.size();
+        result.values.resize(start + area, 0);
+        int* block = result.values.data() + start;
+        if (p == pEnd || (q < qEnd && b.blockColIdx[q] < a.blockColIdx[p])) {
+          result.blockColIdx.push_back(b.blockColIdx[q]);
+          blockAdd<B>(b.values.data() + (size_t)q * area, sign, block, a.blockSize);
+          q++;
+        }
+        else if (q == qEnd || a.blockColIdx[p] < b.blockColIdx[q]) {
+          result.blockColIdx.push_back(a.blockColIdx[p]);
+          blockAdd<B>(a.values.data() + (size_t)p * area, 1, block, a.blockSize);
+          p++;
+        }
+        else {
+          result.blockColIdx.push_back(a.blockColIdx[p]);
+          blockAdd<B>(a.values.data() + (size_t)p * area, 1, block, a.blockSize);
+          blockAdd<B>(b.values.data() + (size_t)q * area, sign, block, a.blockSize);
+          p++;
+          q++;
+        }
+        if (all_of(block, block + area, [](int v) { return v == 0; })) {
+          result.blockColIdx.pop_back();
+          result.values.resize(start);
+        }
+      }
+      result.blockRowPtr[bi + 1] = result.blockColIdx.size();
+    }
+  });
+  STATS_ONLY(timer.setEntries(result.numBlocks()));
+  return result;
+}
+
+// Operator overloading for BSR addition. An operand with a different block size is converted first
+BSRMatrix BSRMatrix::operator+(const BSRMatrix& other) const {
+  return other.blockSize == blockSize ? addBSR(*this, other, 1) : addBSR(*this, BSRMatrix(other.toCSR(), blockSize), 1);
+}
+
+// Operator overloading for BSR subtraction. An operand with a different block size is converted first
+BSRMatrix BSRMatrix::operator-(const BSRMatrix& other) const {
+  return other.blockSize == blockSize ? addBSR(*this, other, -1) : addBSR(*this, BSRMatrix(other.toCSR(), blockSize), -1);
+}
+
+// Multiplies two BSR matrices with the same block size, one block row at a time: the block columns of
+// the result row are gathered and sorted as in the CSR conversion, and then every pair of blocks
+// A(I,K), B(K,J) is multiplied into block (I,J) with the block microkernel
+static BSRMatrix multiplyBSR(const BSRMatrix& a, const BSRMatrix& b) {
+  STATS_ONLY(StatsTimer timer(SparseStats::BSR_MULTIPLY));
+  BSRMatrix result(a.numRows, b.numCols, a.blockSize);
+  int area = a.blockSize * a.blockSize;
+  vector<int> position(b.numBlockCols, -1); // Block of every block column in the current block row
+  vector<int> cols;
+  STATS_ONLY(long long products = 0);
+
+  withBlockSize(a.blockSize, [&](auto size) {
+    constexpr int B = decltype(size)::value;
+    for (int bi = 0; bi < a.numBlockRows; bi++) {
+      cols.clear();
+      for (int p = a.blockRowPtr[bi]; p < a.blockRowPtr[bi + 1]; p++) {
+        int bk = a.blockColIdx[p];
+        for (int q = b.blockRowPtr[bk]; q < b.blockRowPtr[bk + 1]; q++) {
+          if (position[b.blockColIdx[q]] < 0) {
+            position[b.blockColIdx[q]] = 0;
+            cols.push_back(b.blockColIdx[q]);
+          }
+        }
+      }
+      sort(cols.begin(), cols.end());
+      for (size_t c = 0; c < cols.size(); c++) {
+        position[cols[c]] = result.blockColIdx.size();
+        result.blockColIdx.push_back(cols[c]);
+      }
+      result.values.resize(result.blockColIdx.size() * area, 0);
+
+      for (int p = a.blockRowPtr[bi]; p < a.blockRowPtr[bi + 1]; p++) {
+        int bk = a.blockColIdx[p];
+        const int* left = a.values.data() + (size_t)p * area;
+        for (int q = b.blockRowPtr[bk]; q < b.blockRowPtr[bk + 1]; q++) {
+          int* out = result.values.data() + (size_t)position[b.blockColIdx[q]] * area;
+          blockMultiplyAdd<B>(left, b.values.data() + (size_t)q * area, out, a.blockSize);
+        }
+        STATS_ONLY(products += (long long)(b.blockRowPtr[bk + 1] - b.blockRowPtr[bk]) * area * a.blockSize);
+      }
+      for (size_t c = 0; c < cols.size(); c++) {
+        position[cols[c]] = -1;
+      }
+      result.blockRowPtr[bi + 1] = result.blockColIdx.size();
+    }
+  });
+  STATS_ONLY(SparseStats::add(SparseStats::PARTIAL_PRODUCTS, products));
+  STATS_ONLY(timer.setEntries(result.numBlocks()));
+  return result;
+}
+
+// Operator overloading for BSR multiplication. An operand with a different block size is converted first
+BSRMatrix BSRMatrix::operator*(const BSRMatrix& other) const {
+  return other.blockSize == blockSize ? multiplyBSR(*this, other) : multiplyBSR(*this, BSRMatrix(other.toCSR(), blockSize));
+}
+
+// Computes y = A*x one block row at a time, on the thread pool for large matrices. x and y are padded
+// to whole blocks when the matrix does not divide evenly into them
+void BSRMatrix::multiplyVector(const vector<double>& x, vector<double>& y) const {
+  STATS_ONLY(StatsTimer timer(SparseStats::SPMV));
+  STATS_ONLY(timer.setEntries(numRows));
+  int b = blockSize, area = b * b;
+  vector<double> xPadded, yPadded;
+  const double* in = x.data();
+  if (numBlockCols * b != numCols) {
+    xPadded.assign(numBlockCols * b, 0.0);
+    copy(x.begin(), x.begin() + numCols, xPadded.begin());
+    in = xPadded.data();
+  }
+  yPadded.assign(numBlockRows * b, 0.0);
+  double* out = yPadded.data();
+
+  CompressedView blocks = {numBlockRows, numBlockCols, blockRowPtr.data(), blockColIdx.data(), values.data()};
+  withBlockSize(b, [&](auto size) {
+    constexpr int B = decltype(size)::value;
+    runRowKernel(blocks, (long long)numBlocks() * area, [&](int begin, int end) {
+      for (int bi = begin; bi < end; bi++) {
+        for (int k = blockRowPtr[bi]; k < blockRowPtr[bi + 1]; k++) {
+          blockMultiplyVector<B>(values.data() + (size_t)k * area, in + (size_t)blockColIdx[k] * b, out + (size_t)bi * b, b);
+        }
+      }
+    });
+  });
+  yPadded.resize(numRows);
+  y.swap(yPadded);
+}
+
+// Prints the BSR matrix in the same dense layout as SparseMatrix::print
+void BSRMatrix::print() const {
+  toCSR().print();
+}
+
+// LineReader reads a file in large chunks and hands out one line at a time as a pointer range into its
+// buffer, so no per-line or per-token stream objects are created
+class LineReader {
+public:
+  LineReader(FILE* file);
+  bool nextLine(const char*& begin, const char*& end);
+  long long lineNumber() const;
+private:
+  static constexpr size_t CHUNK = 1 << 20; // Bytes read from the file at a time
+  FILE* file;
+  vector<char> buffer;
+  size_t start;  // Start of the unread part of the buffer
+  size_t filled; // End of the valid part of the buffer
+  bool atEnd;
+  long long lines;
+};
+
+// Constructor reads from an already opened file
+LineReader::LineReader(FILE* file) : file(file), buffer(CHUNK), start(0), filled(0), atEnd(false), lines(0) {}
+
+// Returns the next line without its line terminator, or false at the end of the file
+bool LineReader::nextLine(const char*& begin, const char*& end) {
+  while (true) {
+    char* newline = (char*)memchr(buffer.data() + start, '\n', filled - start);
+    if (newline != nullptr || (atEnd && start < filled)) {
+      begin = buffer.data() + start;
+      end = newline != nullptr ? newline : buffer.data() + filled;
+      start = end - buffer.data() + (newline != nullptr ? 1 : 0);
+      if (end > begin && end[-1] == '\r') {
+        end--;
+      }
+      lines++;
+      return true;
+    }
+    if (atEnd) {
+      return false;
+    }
+
+    // Move the partial line to the front, growing the buffer if a single line fills it, and read more
+    memmove(buffer.data(), buffer.data() + start, filled - start);
+    filled -= start;
+    start = 0;
+    if (filled + CHUNK > buffer.size()) {
+      buffer.resize(filled + CHUNK);
+    }
+    size_t got = fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+    filled += got;
+    if (got == 0) {
+      atEnd = true;
+    }
+  }
+}
+
+// Returns the number of the line returned last, starting at 1
+long long LineReader::lineNumber() const {
+  return lines;
+}
+
+// Skips spaces and tabs
+static void skipBlanks(const char*& p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+}
+
+// Parses a decimal integer at p and advances past it
+static bool parseInteger(const char*& p, const char* end, long long& out) {
+  skipBlanks(p, end);
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+  if (p == end || !isdigit((unsigned char)*p)) {
+    return false;
+  }
+  long long value = 0;
+  while (p < end && isdigit((unsigned char)*p)) {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+  out = negative ? -value : value;
+  return true;
+}
+
+// Parses a decimal number with optional fraction and exponent at p and advances past it
+static bool parseNumber(const char*& p, const char* end, double& out) {
+  skipBlanks(p, end);
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+  double value = 0;
+  int digits = 0;
+  while (p < end && isdigit((unsigned char)*p)) {
+    value = value * 10 + (*p - '0');
+    p++;
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    double scale = 0.1;
+    while (p < end && isdigit((unsigned char)*p)) {
+      value += (*p - '0') * scale;
+      scale *= 0.1;
+      p++;
+      digits++;
+    }
+  }
+  if (digits == 0) {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    long long exponent;
+    if (!parseInteger(p, end, exponent)) {
+      return false;
+    }
+    value *= pow(10.0, (double)exponent);
+  }
+  out = negative ? -value : value;
+  return true;
+}
+
+// Returns true if only blanks are left on the line
+static bool atLineEnd(const char* p, const char* end) {
+  skipBlanks(p, end);
+  return p == end;
+}
+
+// Loads a matrix from a binary snapshot, a Matrix Market coordinate file or, if the file has no Matrix
+// Market banner, from plain "row column value" triplets. Indices are 1-based in both formats; for plain triplets the size is
+// taken from the largest indices. Values must be integers that fit in an int, also in real files, and zeros
+// are dropped. Symmetric files may only hold the lower triangle and skew-symmetric ones only the part below
+// the diagonal, as the format requires. Entries go through a COOBuilder, so no per-entry insert() walk is
+// needed. Returns false and sets error on failure
+bool loadMatrixFile(const string& path, SparseMatrix& matrix, string& error) {
+  STATS_ONLY(StatsTimer timer(SparseStats::LOAD));
+
+  // Binary snapshots are mapped instead of parsed
+  if (path != "-" && isSnapshotFile(path)) {
+    MappedMatrix mapped;
+    if (!mapped.open(path, error)) {
+      return false;
+    }
+    matrix = mapped.toSparseMatrix();
+    return true;
+  }
+
+  FILE* file = path == "-" ? stdin : fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    error = path + ": cannot open file";
+    return false;
+  }
+
+  LineReader reader(file);
+  COOBuilder builder(0, 0);
+  const char* begin;
+  const char* end;
+  bool haveLine = reader.nextLine(begin, end);
+  bool matrixMarket = haveLine && end - begin >= 14 && memcmp(begin, "%%MatrixMarket", 14) == 0;
+  bool pattern = false, symmetric = false, skew = false;
+  long long rows = 0, cols = 0, expected = -1, count = 0;
+  const long long INT_LIMIT = numeric_limits<int>::max(); // Largest size, index and value a matrix can hold
+
+  // Fails with a message naming the current line
+  auto fail = [&](const string& message) {
+    error = path + ":" + to_string(reader.lineNumber()) + ": " + message;
+    if (file != stdin) {
+      fclose(file);
+    }
+    return false;
+  };
+
+  if (matrixMarket) {
+    // Banner: %%MatrixMarket matrix coordinate <field> <symmetry>
+    string banner(begin, end);
+    for (size_t c = 0; c < banner.size(); c++) {
+      banner[c] = tolower(banner[c]);
+    }
+    istringstream words(banner);
+    string tag, object, format, field, symmetry;
+    words >> tag >> object >> format >> field >> symmetry;
+    if (object != "matrix" || format != "coordinate") {
+      return fail("only coordinate matrices are supported");
+    }
+    if (field != "integer" && field != "real" && field != "pattern") {
+      return fail("unsupported field '" + field + "'");
+    }
+    if (symmetry != "general" && symmetry != "symmetric" && symmetry != "skew-symmetric") {
+      return fail("unsupported symmetry '" + symmetry + "'");
+    }
+    pattern = field == "pattern";
+    symmetric = symmetry != "general";
+    skew = symmetry == "skew-symmetric";
+
+    // Size line: rows columns entries, after any comment lines
+    do {
+      haveLine = reader.nextLine(begin, end);
+    } while (haveLine && (begin == end || *begin == '%'));
+    const char* p = begin;
+    if (!haveLine || !parseInteger(p, end, rows) || !parseInteger(p, end, cols) ||
+        !parseInteger(p, end, expected) || !atLineEnd(p, end) || rows < 0 || cols < 0 || expected < 0) {
+      return fail("expected 'rows columns entries'");
+    }
+    if (rows > INT_LIMIT || cols > INT_LIMIT) {
+      return fail("matrix size " + to_string(rows) + "x" + to_string(cols) + " is too large");
+    }
+    if (symmetric && rows != cols) {
+      return fail("symmetric matrices must be square");
+    }
+    // Positions an entry may take: the whole matrix, or the stored triangle of a symmetric one
+    long long positions = !symmetric ? rows * cols : skew ? rows * (rows - 1) / 2 : rows * (rows + 1) / 2;
+    if (expected > positions) {
+      return fail(to_string(expected) + " entries do not fit in a " + to_string(rows) + "x" + to_string(cols) + " matrix");
+    }
+    // The count is only a hint: reserve at most RESERVE_LIMIT entries up front and let the builder grow
+    const long long RESERVE_LIMIT = 1 << 24;
+    builder.setSize(rows, cols);
+    builder.reserve(min(symmetric ? 2 * expected : expected, RESERVE_LIMIT));
+    haveLine = reader.nextLine(begin, end);
+  }
+
+  for (; haveLine; haveLine = reader.nextLine(begin, end)) {
+    const char* p = begin;
+    skipBlanks(p, end);
+    if (p == end || *p == '%' || *p == '#') {
+      continue; // Blank or comment line
+    }
+
+    long long row, col;
+    double value = 1;
+    if (!parseInteger(p, end, row) || !parseInteger(p, end, col) ||
+        (!pattern && !parseNumber(p, end, value)) || !atLineEnd(p, end)) {
+      return fail("expected 'row column value'");
+    }
+    if (row < 1 || col < 1 || row > INT_LIMIT || col > INT_LIMIT || (matrixMarket && (row > rows || col > cols))) {
+      return fail("index out of range");
+    }
+    if (symmetric && (row < col || (skew && row == col))) {
+      return fail(skew ? "skew-symmetric files may only hold entries below the diagonal"
+                       : "symmetric files may only hold entries on or below the diagonal");
+    }
+    if (value != nearbyint(value) || fabs(value) > INT_LIMIT) {
+      return fail("values must be integers that fit in an int");
+    }
+    if (matrixMarket && ++count > expected) {
+      return fail("more entries than declared");
+    }
+
+    rows = max(rows, row);
+    cols = max(cols, col);
+    int stored = (int)value; // Exact, checked above
+    if (stored != 0) {
+      builder.add(row - 1, col - 1, stored);
+      if (symmetric && row != col) {
+        builder.add(col - 1, row - 1, skew ? -stored : stored);
+      }
+    }
+  }
+
+  if (matrixMarket && count != expected) {
+    return fail("expected " + to_string(expected) + " entries, found " + to_string(count));
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  if (!matrixMarket) {
+    builder.setSize(rows, cols);
+  }
+  STATS_ONLY(timer.setEntries(builder.size()));
+  matrix = builder.build();
+  return true;
+}
+
+// Generates an n x n matrix with random values in 1..9 and roughly density * n * n entries in one of the
+// benchmark patterns:
+//   uniform - entries at uniformly random positions
+//   banded  - every entry within a band around the diagonal
+//   block   - dense square blocks along the diagonal
+//   rmat    - recursive matrix (R-MAT) graph with a power-law degree distribution
+CSRMatrix generateMatrix(const string& pattern, int n, double density, unsigned seed) {
+  mt19937_64 random(seed);
+  uniform_int_distribution<int> value(1, 9);
+  long long target = max(1LL, (long long)(density * n * n));
+  COOBuilder builder(n, n, COOBuilder::KEEP_LAST);
+  builder.reserve(target);
+
+  if (pattern == "banded") {
+    int halfWidth = max(0, (int)((density * n - 1) / 2));
+    for (int i = 0; i < n; i++) {
+      for (int j = max(0, i - halfWidth); j <= min(n - 1, i + halfWidth); j++) {
+        builder.add(i, j, value(random));
+      }
+    }
+  }
+  else if (pattern == "block") {
+    int blockSize = max(1, (int)(density * n));
+    for (int start = 0; start < n; start += blockSize) {
+      int last = min(n, start + blockSize);
+      for (int i = start; i < last; i++) {
+        for (int j = start; j < last; j++) {
+          builder.add(i, j, value(random));
+        }
+      }
+    }
+  }
+  else if (pattern == "rmat") {
+    // Pick a quadrant per level with probabilities a, b, c, d until the cell is a single entry
+    const double a = 0.57, b = 0.19, c = 0.19;
+    uniform_real_distribution<double> unit(0, 1);
+    int levels = 0;
+    while ((1LL << levels) < n) {
+      levels++;
+    }
+    for (long long e = 0; e < target; e++) {
+      int row = 0, col = 0;
+      for (int level = 0; level < levels; level++) {
+        double r = unit(random);
+        row = row * 2 + (r >= a + b ? 1 : 0);
+        col = col * 2 + ((r >= a && r < a + b) || r >= a + b + c ? 1 : 0);
+      }
+      if (row < n && col < n) {
+        builder.add(row, col, value(random));
+      }
+    }
+  }
+  else {
+    uniform_int_distribution<int> index(0, n - 1);
+    for (long long e = 0; e < target; e++) {
+      builder.add(index(random), index(random), value(random));
+    }
+  }
+  return builder.toCSR();
+}
+
+// BenchResult holds the measurements of one operation on one workload
+struct BenchResult {
+  string pattern, operation;
+  int size;
+  long long nnz;         // Entries of the first operand
+  long long items;       // Entries processed (or multiply-adds for products) per run
+  double minSeconds, medianSeconds, meanSeconds;
+  double allocationsPerRun;
+  double allocatedBytesPerRun;
+  long long peakRssKb;   // Peak resident set size of the process after the operation
+};
+
+// Returns the peak resident set size of the process in kilobytes
+static long long peakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Times an operation: warmup runs first, then reps measured runs. run performs the operation and
+// returns whatever it allocated, which is released outside the timed region
+static BenchResult timeOperation(const string& operation, int warmup, int reps, const function<function<void()>()>& run) {
+  BenchResult result;
+  result.operation = operation;
+  for (int w = 0; w < warmup; w++) {
+    run()();
+  }
+
+  vector<double> seconds;
+  long long allocations = allocationCount.load(), bytes = allocationBytes.load();
+  for (int r = 0; r < reps; r++) {
+    auto start = chrono::steady_clock::now();
+    function<void()> release = run();
+    seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    release();
+  }
+  result.allocationsPerRun = (double)(allocationCount.load() - allocations) / reps;
+  result.allocatedBytesPerRun = (double)(allocationBytes.load() - bytes) / reps;
+
+  sort(seconds.begin(), seconds.end());
+  result.minSeconds = seconds.front();
+  result.medianSeconds = seconds[seconds.size() / 2];
+  result.meanSeconds = 0;
+  for (double t : seconds) {
+    result.meanSeconds += t / seconds.size();
+  }
+  result.peakRssKb = peakRssKb();
+  return result;
+}
+
+// Parses the whole of text as a number. Returns false if it is empty, has trailing characters or is out of range
+template <typename T>
+static bool parseNumber(const char* text, T& value) {
+  const char* end = text + strlen(text);
+  from_chars_result parsed = from_chars(text, end, value);
+  return parsed.ec == errc() && parsed.ptr == end && end != text;
+}
+
+// Runs every operation on every requested workload and prints a table, plus JSON if requested.
+// Returns the process exit code
+int runBenchmark(int argc, char** argv) {
+  int size = 2000, reps = 5, warmup = 1;
+  double density = 0.005;
+  string patternArg = "all", jsonPath;
+  unsigned seed = 1;
+
+  for (int a = 2; a < argc; a++) {
+    string arg = argv[a];
+    if (a + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++a];
+    int threads = 0;
+    bool valid = true;
+    if (arg == "-n") {
+      valid = parseNumber(value, size);
+    }
+    else if (arg == "-d") {
+      valid = parseNumber(value, density);
+    }
+    else if (arg == "-r") {
+      valid = parseNumber(value, reps);
+    }
+    else if (arg == "-w") {
+      valid = parseNumber(value, warmup);
+    }
+    else if (arg == "-p") {
+      patternArg = value;
+    }
+    else if (arg == "-s") {
+      valid = parseNumber(value, seed);
+    }
+    else if (arg == "-t") {
+      valid = parseNumber(value, threads) && threads >= 0;
+      if (valid) {
+        SparseMatrix::setNumThreads(threads);
+      }
+    }
+    else if (arg == "--json") {
+      jsonPath = value;
+    }
+    else {
+      cerr << "Unknown benchmark option " << arg << endl;
+      return 1;
+    }
+    if (!valid) {
+      cerr << "Invalid value " << value << " for " << arg << endl;
+      return 1;
+    }
+  }
+  if (size <= 0 || reps <= 0 || warmup < 0 || density <= 0 || density > 1) {
+    cerr << "Invalid benchmark options" << endl;
+    return 1;
+  }
+
+  vector<string> patterns;
+  if (patternArg == "all") {
+    patterns = {"uniform", "banded", "block", "rmat"};
+  }
+  else {
+    patterns.push_back(patternArg);
+  }
+
+  vector<BenchResult> results;
+  for (size_t w = 0; w < patterns.size(); w++) {
+    const string& pattern = patterns[w];
+    CSRMatrix csrA = generateMatrix(pattern, size, density, seed);
+    CSRMatrix csrB = generateMatrix(pattern, size, density, seed + 1);
+    SparseMatrix a(csrA), b(csrB);
+
+    // Multiply-adds performed by A*B: every entry (i, k) of A meets every entry of row k of B
+    long long products = 0;
+    for (int p = 0; p < csrA.nnz(); p++) {
+      int k = csrA.colIdx[p];
+      products += csrB.rowPtr[k + 1] - csrB.rowPtr[k];
+    }
+
+    // Entries of A in random order for the insert benchmark
+    vector<Triplet> shuffled;
+    for (int i = 0; i < size; i++) {
+      for (int p = csrA.rowPtr[i]; p < csrA.rowPtr[i + 1]; p++) {
+        shuffled.push_back(Triplet{i, csrA.colIdx[p], csrA.values[p]});
+      }
+    }
+    shuffle(shuffled.begin(), shuffled.end(), mt19937(seed));
+
+    // Keeps a result alive until the returned function is called outside the timed region
+    auto releaseMatrix = [](SparseMatrix&& m) {
+      shared_ptr<SparseMatrix> result = make_shared<SparseMatrix>(std::move(m));
+      return function<void()>([result]() mutable { result.reset(); });
+    };
+    vector<pair<BenchResult, long long>> measured;
+    measured.push_back(make_pair(timeOperation("insert", warmup, reps, [&] {
+      SparseMatrix m(size, size);
+      for (size_t e = 0; e < shuffled.size(); e++) {
+        m.insert(shuffled[e].row, shuffled[e].col, shuffled[e].value);
+      }
+      return releaseMatrix(std::move(m));
+    }), (long long)shuffled.size()));
+    measured.push_back(make_pair(timeOperation("transpose", warmup, reps, [&] {
+      return releaseMatrix(a.transpose());
+    }), (long long)csrA.nnz()));
+    measured.push_back(make_pair(timeOperation("add", warmup, reps, [&] {
+      return releaseMatrix(a + b);
+    }), (long long)csrA.nnz() + csrB.nnz()));
+    measured.push_back(make_pair(timeOperation("subtract", warmup, reps, [&] {
+      return releaseMatrix(a - b);
+    }), (long long)csrA.nnz() + csrB.nnz()));
+    measured.push_back(make_pair(timeOperation("multiply", warmup, reps, [&] {
+      return releaseMatrix(a * b);
+    }), products));
+
+    // Numeric phase only: the plan is built once and its result arrays are reused across runs
+    MultiplyPlan plan(csrA, csrB);
+    CSRMatrix planned;
+    measured.push_back(make_pair(timeOperation("plan_mul", warmup, reps, [&] {
+      plan.execute(csrA, csrB, planned);
+      return function<void()>([] {});
+    }), products));
+
+    // Streaming updates to a live product: every run sets UPDATES entries at random positions, alternating
+    // between A and B, and brings the product up to date after every UPDATE_BATCH of them
+    const int UPDATES = 256, UPDATE_BATCH = 16;
+    IncrementalProduct incremental(a, b);
+    mt19937 updateRandom(seed);
+    measured.push_back(make_pair(timeOperation("inc_update", warmup, reps, [&] {
+      for (int u = 0; u < UPDATES; u++) {
+        int row = updateRandom() % size, col = updateRandom() % size, value = updateRandom() % 9 + 1;
+        if (u % 2 == 0) {
+          incremental.setLeft(row, col, value);
+        }
+        else {
+          incremental.setRight(row, col, value);
+        }
+        if ((u + 1) % UPDATE_BATCH == 0) {
+          incremental.update();
+        }
+      }
+      return function<void()>([] {});
+    }), (long long)UPDATES));
+
+    for (size_t m = 0; m < measured.size(); m++) {
+      BenchResult result = measured[m].first;
+      result.pattern = pattern;
+      result.size = size;
+      result.nnz = csrA.nnz();
+      result.items = measured[m].second;
+      results.push_back(result);
+    }
+  }
+
+  // Human-readable table; it goes to stderr when the JSON is written to stdout
+  ostream& table = jsonPath == "-" ? cerr : cout;
+  char line[256];
+  snprintf(line, sizeof(line), "%-8s %-10s %10s %12s %12s %12s %10s %12s %10s\n", "pattern", "operation", "nnz",
+           "median ms", "min ms", "items/s", "GFLOP/s", "allocs/run", "peak MB");
+  table << line;
+  for (size_t r = 0; r < results.size(); r++) {
+    const BenchResult& res = results[r];
+    double gflops = res.operation == "multiply" || res.operation == "plan_mul" ? 2.0 * res.items / res.medianSeconds / 1e9 : 0;
+    char allocations[32] = "-"; // Only known in builds that count allocations
+    if (SparseStats::countsAllocations()) {
+      snprintf(allocations, sizeof(allocations), "%.0f", res.allocationsPerRun);
+    }
+    snprintf(line, sizeof(line), "%-8s %-10s %10lld %12.3f %12.3f %12.4g %10.3f %12s %10.1f\n", res.pattern.c_str(),
+             res.operation.c_str(), res.nnz, res.medianSeconds * 1e3, res.minSeconds * 1e3, res.items / res.medianSeconds,
+             gflops, allocations, res.peakRssKb / 1024.0);
+    table << line;
+  }
+
+  if (jsonPath.empty()) {
+    return 0;
+  }
+
+  // Machine-readable results
+  ostringstream json;
+  json << "{\n  \"size\": " << size << ",\n  \"density\": " << density << ",\n  \"reps\": " << reps
+       << ",\n  \"warmup\": " << warmup << ",\n  \"threads\": " << SparseMatrix::getNumThreads()
+       << ",\n  \"results\": [\n";
+  for (size_t r = 0; r < results.size(); r++) {
+    const BenchResult& res = results[r];
+    double gflops = res.operation == "multiply" || res.operation == "plan_mul" ? 2.0 * res.items / res.medianSeconds / 1e9 : 0;
+    json << "    {\"pattern\": \"" << res.pattern << "\", \"operation\": \"" << res.operation
+         << "\", \"nnz\": " << res.nnz << ", \"items\": " << res.items
+         << ", \"min_seconds\": " << res.minSeconds << ", \"median_seconds\": " << res.medianSeconds
+         << ", \"mean_seconds\": " << res.meanSeconds << ", \"items_per_second\": " << res.items / res.medianSeconds
+         << ", \"gflops\": " << gflops;
+    if (SparseStats::countsAllocations()) {
+      json << ", \"allocations_per_run\": " << res.allocationsPerRun
+           << ", \"allocated_bytes_per_run\": " << res.allocatedBytesPerRun;
+    }
+    json << ", \"peak_rss_kb\": " << res.peakRssKb << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+  }
+  json << "  ]\n}\n";
+
+  if (jsonPath == "-") {
+    cout << json.str();
+    return 0;
+  }
+  ofstream out(jsonPath);
+  out << json.str();
+  if (!out) {
+    cerr << jsonPath << ": write failed" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// SelfTest checks the kernels against reference results computed with plain loops over dense copies
+// of the linked list matrices, and prints one line per check
+class SelfTest {
 public:
-  SparseMatrix();
-  SparseMatrix(int rows, int cols);
-  ~SparseMatrix();
-  void insert(int row, int col, int value);
-  void print() const;
-  SparseMatrix* transpose();
-  SparseMatrix* operator+(SparseMatrix& other);
-  SparseMatrix* operator-(SparseMatrix& other);
-  SparseMatrix* operator*(SparseMatrix& other);
+  typedef vector<vector<long long>> Dense;
+  SelfTest(int size, unsigned seed);
+  void check(const string& name, bool passed);
+  int failures() const;
+  CSRMatrix randomCSR(int rows, int cols, double density);
+  static Dense toDense(const SparseMatrix& matrix);
+  static Dense toDense(const CompressedView& matrix);
+  static Dense product(const Dense& a, const Dense& b);
+  static Dense sum(const Dense& a, const Dense& b, int sign);
+  static Dense transpose(const Dense& a);
+  static bool matches(const CompressedView& matrix, const Dense& expected);
+  static bool matches(const SparseMatrix& matrix, const Dense& expected);
+  static bool sameArrays(const CompressedView& x, const CompressedView& y);
+  int size;
+  mt19937_64 random;
+private:
+  int checks, failed;
 };
 
-// Default constructor initializes the sparse matrix with 0 rows, 0 columns, and NULL headers
-SparseMatrix::SparseMatrix() {
-  numRows = 0;
-  numCols = 0;
-  colHeaders = NULL;
-  rowHeaders = NULL;
+// Constructor seeds the generator for the random operands
+SelfTest::SelfTest(int size, unsigned seed) : size(size), random(seed), checks(0), failed(0) {}
+
+// Records and prints the outcome of one check
+void SelfTest::check(const string& name, bool passed) {
+  checks++;
+  failed += passed ? 0 : 1;
+  printf("%-4s %s\n", passed ? "ok" : "FAIL", name.c_str());
+}
+
+// Returns the number of checks that failed so far
+int SelfTest::failures() const {
+  return failed;
+}
+
+// Returns a rows x cols matrix with roughly density * rows * cols entries in -9..9, without zeros, so
+// products have both cancellations and entries of either sign
+CSRMatrix SelfTest::randomCSR(int rows, int cols, double density) {
+  COOBuilder builder(rows, cols, COOBuilder::KEEP_LAST);
+  uniform_int_distribution<int> row(0, rows - 1), col(0, cols - 1), value(1, 9), sign(0, 1);
+  long long count = (long long)(density * rows * cols);
+  for (long long e = 0; e < count; e++) {
+    builder.add(row(random), col(random), sign(random) ? value(random) : -value(random));
+  }
+  return builder.toCSR();
+}
+
+// Reads a linked list matrix into a dense array through point access
+SelfTest::Dense SelfTest::toDense(const SparseMatrix& matrix) {
+  Dense dense(matrix.getRows(), vector<long long>(matrix.getCols(), 0));
+  for (int i = 0; i < matrix.getRows(); i++) {
+    for (int j = 0; j < matrix.getCols(); j++) {
+      dense[i][j] = matrix.get(i, j);
+    }
+  }
+  return dense;
+}
+
+// Copies CSR arrays into a dense array
+SelfTest::Dense SelfTest::toDense(const CompressedView& matrix) {
+  Dense dense(matrix.numMajor, vector<long long>(matrix.numMinor, 0));
+  for (int i = 0; i < matrix.numMajor; i++) {
+    for (int p = matrix.ptr[i]; p < matrix.ptr[i + 1]; p++) {
+      dense[i][matrix.idx[p]] = matrix.val[p];
+    }
+  }
+  return dense;
+}
+
+// Multiplies two dense arrays with the textbook triple loop
+SelfTest::Dense SelfTest::product(const Dense& a, const Dense& b) {
+  int inner = b.size(), cols = b.empty() ? 0 : b[0].size();
+  Dense c(a.size(), vector<long long>(cols, 0));
+  for (size_t i = 0; i < a.size(); i++) {
+    for (int k = 0; k < inner; k++) {
+      if (a[i][k] != 0) {
+        for (int j = 0; j < cols; j++) {
+          c[i][j] += a[i][k] * b[k][j];
+        }
+      }
+    }
+  }
+  return c;
+}
+
+// Adds (sign 1) or subtracts (sign -1) two dense arrays of the same shape
+SelfTest::Dense SelfTest::sum(const Dense& a, const Dense& b, int sign) {
+  Dense c = a;
+  for (size_t i = 0; i < c.size(); i++) {
+    for (size_t j = 0; j < c[i].size(); j++) {
+      c[i][j] += sign * b[i][j];
+    }
+  }
+  return c;
+}
+
+// Transposes a dense array
+SelfTest::Dense SelfTest::transpose(const Dense& a) {
+  int cols = a.empty() ? 0 : a[0].size();
+  Dense t(cols, vector<long long>(a.size()));
+  for (size_t i = 0; i < a.size(); i++) {
+    for (int j = 0; j < cols; j++) {
+      t[j][i] = a[i][j];
+    }
+  }
+  return t;
+}
+
+// Returns true if CSR arrays hold exactly the nonzeros of a dense array, with the columns of every row
+// strictly increasing. Stored zeros are allowed, as products keep the sums that cancel
+bool SelfTest::matches(const CompressedView& matrix, const Dense& expected) {
+  if (matrix.numMajor != (int)expected.size() || (!expected.empty() && matrix.numMinor != (int)expected[0].size())) {
+    return false;
+  }
+  for (int i = 0; i < matrix.numMajor; i++) {
+    long long found = 0, nonzeros = 0;
+    for (int p = matrix.ptr[i]; p < matrix.ptr[i + 1]; p++) {
+      if ((p > matrix.ptr[i] && matrix.idx[p] <= matrix.idx[p - 1]) || matrix.val[p] != expected[i][matrix.idx[p]]) {
+        return false;
+      }
+      found += matrix.val[p] != 0 ? 1 : 0;
+    }
+    for (long long value : expected[i]) {
+      nonzeros += value != 0 ? 1 : 0;
+    }
+    if (found != nonzeros) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if both the row lists and the column lists of a linked list matrix hold exactly the
+// nonzeros of a dense array
+bool SelfTest::matches(const SparseMatrix& matrix, const Dense& expected) {
+  if (matrix.getRows() != (int)expected.size()) {
+    return false;
+  }
+  return matches(matrix.toCSR().view(), expected) && matches(matrix.toCSC().view(), transpose(expected));
+}
+
+// Returns true if two CSR views have the same shape and identical arrays
+bool SelfTest::sameArrays(const CompressedView& x, const CompressedView& y) {
+  int nnz = x.ptr[x.numMajor];
+  return x.numMajor == y.numMajor && x.numMinor == y.numMinor && equal(x.ptr, x.ptr + x.numMajor + 1, y.ptr) &&
+         equal(x.idx, x.idx + nnz, y.idx) && equal(x.val, x.val + nnz, y.val);
 }
 
-// Constructor with parameters initializes the sparse matrix with specified rows and columns
-SparseMatrix::SparseMatrix(int rows, int cols) {
-  numRows = rows;
-  numCols = cols;
-  colHeaders = new Header*[numCols];
-  rowHeaders = new Header*[numRows];
+// Checks the compressed row and column kernels: sums, differences, transposes and products on the
+// arrays, and the conversions between the two forms and the linked list
+static void testCompressed(SelfTest& test, const CSRMatrix& a, const CSRMatrix& b, const CSRMatrix& c, const string& where) {
+  SelfTest::Dense denseA = SelfTest::toDense(a.view()), denseB = SelfTest::toDense(b.view());
+  SelfTest::Dense denseC = SelfTest::toDense(c.view()), expected = SelfTest::product(denseA, denseB);
+  SelfTest::Dense sum = SelfTest::sum(denseA, denseC, 1), difference = SelfTest::sum(denseA, denseC, -1);
+  SelfTest::Dense transposed = SelfTest::transpose(denseA);
+  test.check("addCSR and subtractCSR" + where, SelfTest::matches(addCSR(a.view(), c.view()).view(), sum) &&
+                                               SelfTest::matches(subtractCSR(a.view(), c.view()).view(), difference));
+  test.check("transposeCSR" + where, SelfTest::matches(transposeCSR(a.view()).view(), transposed));
+  test.check("CSRMatrix operators" + where, SelfTest::matches((a + c).view(), sum) && SelfTest::matches((a - c).view(), difference) &&
+                                            SelfTest::matches((a * b).view(), expected) &&
+                                            SelfTest::matches(a.transpose().view(), transposed));
 
-  // Create column headers and set the column index
-  for (int i = 0; i < numCols; i++) {
-    colHeaders[i] = new Header(-1, i);
+  // A CSC view of a matrix is the CSR view of its transpose
+  CSCMatrix cscA(a), cscB(b), cscC(c);
+  test.check("CSCMatrix conversions" + where, SelfTest::matches(cscA.view(), transposed) && SelfTest::sameArrays(cscA.toCSR().view(), a.view()) &&
+                                              SelfTest::sameArrays(SparseMatrix(cscA).toCSR().view(), a.view()) &&
+                                              SelfTest::sameArrays(SparseMatrix(a).toCSC().view(), cscA.view()));
+  test.check("CSCMatrix operators" + where, SelfTest::matches((cscA + cscC).toCSR().view(), sum) &&
+                                            SelfTest::matches((cscA - cscC).toCSR().view(), difference) &&
+                                            SelfTest::matches((cscA * cscB).toCSR().view(), expected) &&
+                                            SelfTest::matches(cscA.transpose().toCSR().view(), transposed));
+}
+
+// Checks both duplicate policies of COOBuilder on triplets added in random order, many of them at the
+// same positions, through single adds and batches
+static void testBuilder(SelfTest& test) {
+  int rows = test.size / 2 + 3, cols = test.size / 3 + 5;
+  uniform_int_distribution<int> row(0, rows - 1), col(0, cols / 4), value(-3, 3);
+  COOBuilder summed(rows, cols), last(rows, cols, COOBuilder::KEEP_LAST);
+  SelfTest::Dense sums(rows, vector<long long>(cols, 0)), lastValues = sums;
+  // Every other group of 64 triplets is added as one batch
+  vector<Triplet> batch;
+  for (int e = 0; e < rows * 8; e++) {
+    Triplet t = {row(test.random), col(test.random), value(test.random)};
+    sums[t.row][t.col] += t.value;
+    lastValues[t.row][t.col] = t.value;
+    if (e / 64 % 2 == 0) {
+      summed.add(t.row, t.col, t.value);
+      last.add(t.row, t.col, t.value);
+    }
+    else {
+      batch.push_back(t);
+    }
+    if (batch.size() == 64 || (e + 1 == rows * 8 && !batch.empty())) {
+      summed.add(batch);
+      last.add(batch);
+      batch.clear();
+    }
   }
-  
-  // Create row headers and set the row index
-  for (int i = 0; i < numRows; i++) {
-    rowHeaders[i] = new Header(i, -1);
+  test.check("COOBuilder summing duplicates", summed.size() == (size_t)rows * 8 && SelfTest::matches(summed.toCSR().view(), sums) &&
+                                              SelfTest::matches(summed.build(), sums));
+  test.check("COOBuilder keeping the last duplicate", SelfTest::matches(last.toCSR().view(), lastValues) &&
+                                                      SelfTest::matches(last.build(), lastValues));
+}
+
+// Checks the linked list transpose and TransposedView as either operand of +, - and *. A and C are
+// n x m
+static void testTransposes(SelfTest& test, const SparseMatrix& a, const SparseMatrix& c) {
+  SelfTest::Dense denseA = SelfTest::toDense(a), denseC = SelfTest::toDense(c);
+  SelfTest::Dense transposedA = SelfTest::transpose(denseA), transposedC = SelfTest::transpose(denseC);
+  SparseMatrix ct = c.transpose();
+  test.check("transpose", SelfTest::matches(a.transpose(), transposedA) && SelfTest::matches(ct, transposedC) &&
+                          SelfTest::matches(a.transposedView().materialize(), transposedA));
+  test.check("TransposedView sums", SelfTest::matches(a.transposedView() + ct, SelfTest::sum(transposedA, transposedC, 1)) &&
+                                    SelfTest::matches(a.transposedView() - ct, SelfTest::sum(transposedA, transposedC, -1)) &&
+                                    SelfTest::matches(ct + a.transposedView(), SelfTest::sum(transposedC, transposedA, 1)) &&
+                                    SelfTest::matches(ct - a.transposedView(), SelfTest::sum(transposedC, transposedA, -1)));
+  test.check("TransposedView products", SelfTest::matches(a.transposedView() * a, SelfTest::product(transposedA, denseA)) &&
+                                        SelfTest::matches(a * c.transposedView(), SelfTest::product(denseA, transposedC)) &&
+                                        SelfTest::matches(a.transposedView() * ct.transposedView(), SelfTest::product(transposedA, denseC)));
+}
+
+// Checks linked list sums and differences on one thread and on the pool, with enough rows for the
+// parallel path. The second operand shares half of its positions with the first, some of them with
+// the negated value, so sums cancel
+static void testSums(SelfTest& test, int threads) {
+  int rows = 1024 + test.size, cols = test.size / 2;
+  CSRMatrix x = test.randomCSR(rows, cols, 0.05);
+  COOBuilder builder(rows, cols, COOBuilder::KEEP_LAST);
+  for (int i = 0; i < rows; i++) {
+    for (int p = x.rowPtr[i]; p < x.rowPtr[i + 1]; p += 2) {
+      builder.add(i, x.colIdx[p], p % 3 == 0 ? -x.values[p] : x.values[p] + 1);
+    }
+  }
+  CSRMatrix other = test.randomCSR(rows, cols, 0.05);
+  for (int i = 0; i < rows; i++) {
+    for (int p = other.rowPtr[i]; p < other.rowPtr[i + 1]; p++) {
+      builder.add(i, other.colIdx[p], other.values[p]);
+    }
   }
+  SparseMatrix a(x), b(builder.toCSR());
+  SelfTest::Dense denseA = SelfTest::toDense(a), denseB = SelfTest::toDense(b);
+  int previousThreads = SparseMatrix::getNumThreads();
+  for (int t : {1, threads}) {
+    SparseMatrix::setNumThreads(t);
+    string where = t == 1 ? " (serial)" : " (" + to_string(t) + " threads)";
+    test.check("add and subtract" + where, SelfTest::matches(a + b, SelfTest::sum(denseA, denseB, 1)) &&
+                                           SelfTest::matches(a - b, SelfTest::sum(denseA, denseB, -1)) && (a - a).nnz() == 0);
+  }
+  SparseMatrix::setNumThreads(previousThreads);
 }
 
-// Destructor for freeing the memory occupied by the sparse matrix
-SparseMatrix::~SparseMatrix() {
-  // Delete row headers and nodes in each row
-  for (int i = 0; i < numRows; i++) {
-    Node* curr = rowHeaders[i]->right;
-    while (curr != rowHeaders[i]) {
-      Node* temp = curr;
-      if (curr->right != nullptr) {
-        curr = curr->right;
-      }
-      else {
-        break;
+// Checks SpMV, transposed SpMV and SpMM on one thread and on the pool, on a matrix with enough entries
+// for the parallel paths. The vectors hold halves, so every sum is exact whatever the order
+static void testSpmv(SelfTest& test, int threads) {
+  int rows = 5 * test.size, cols = test.size;
+  CSRMatrix csr = test.randomCSR(rows, cols, 0.1);
+  SparseMatrix matrix(csr);
+  SelfTest::Dense dense = SelfTest::toDense(csr.view());
+
+  // Returns the dense product of the matrix, or of its transpose, with a row-major block of k columns
+  auto reference = [&](const vector<double>& x, int k, bool transposed) {
+    vector<double> y((size_t)(transposed ? cols : rows) * k, 0.0);
+    for (int i = 0; i < rows; i++) {
+      for (int j = 0; j < cols; j++) {
+        for (int c = 0; c < k; c++) {
+          if (transposed) {
+            y[(size_t)j * k + c] += dense[i][j] * x[(size_t)i * k + c];
+          }
+          else {
+            y[(size_t)i * k + c] += dense[i][j] * x[(size_t)j * k + c];
+          }
+        }
       }
     }
-    delete rowHeaders[i]; // Delete the row header
+    return y;
+  };
+  auto halves = [](size_t count) {
+    vector<double> x(count);
+    for (size_t j = 0; j < count; j++) {
+      x[j] = (double)(j % 7) - 3.5;
+    }
+    return x;
+  };
+
+  int previousThreads = SparseMatrix::getNumThreads();
+  for (int t : {1, threads}) {
+    SparseMatrix::setNumThreads(t);
+    string where = string(" (") + spmvKernelName() + ", " + (t == 1 ? "serial)" : to_string(t) + " threads)");
+    vector<double> x = halves(cols), xt = halves(rows), y;
+    csr.multiplyVector(x, y);
+    test.check("multiplyVector" + where, y == reference(x, 1, false) && matrix.multiplyVector(x) == y);
+    csr.multiplyTransposeVector(xt, y);
+    test.check("multiplyTransposeVector" + where, y == reference(xt, 1, true) && matrix.multiplyTransposeVector(xt) == y);
+    bool denseMatches = true;
+    for (int k : {1, 3, 8, 11}) {
+      vector<double> block = halves((size_t)cols * k);
+      csr.multiplyDense(block, k, y);
+      denseMatches = denseMatches && y == reference(block, k, false);
+    }
+    test.check("multiplyDense" + where, denseMatches);
   }
-  delete[] rowHeaders; // Delete the array of row headers
-  
-  // Delete column headers and nodes in each column
-  for (int i = 0; i < numCols; i++) {
-    Node* curr = colHeaders[i]->down;
-    while (curr != colHeaders[i]) {
-      Node* temp = curr;
-      if (curr->down != nullptr) {
-        curr = curr->down;
-      }
-      else {
-        break;
+  SparseMatrix::setNumThreads(previousThreads);
+}
+
+// Checks lazy expressions over every kind of leaf: fused sums and scaling, a sum added into product rows,
+// products whose operands are themselves expressions, and transposed operands. A and C are n x m, B is m x k
+static void testLazy(SelfTest& test, const CSRMatrix& csrA, const CSRMatrix& csrB, const CSRMatrix& csrC) {
+  SparseMatrix a(csrA), b(csrB), c(csrC), ct = c.transpose();
+  SelfTest::Dense denseA = SelfTest::toDense(csrA.view()), denseB = SelfTest::toDense(csrB.view());
+  SelfTest::Dense denseC = SelfTest::toDense(csrC.view()), doubled = SelfTest::sum(denseA, denseA, 1);
+  SelfTest::Dense product = SelfTest::product(denseA, denseB), tripled = SelfTest::sum(SelfTest::sum(product, product, 1), product, 1);
+  CSRMatrix extra = test.randomCSR(csrA.numRows, csrB.numCols, 0.05);
+  SelfTest::Dense denseExtra = SelfTest::toDense(extra.view());
+
+  test.check("lazy sums and scaling", SelfTest::matches((2 * lazy(a) - lazy(c)).evaluate(), SelfTest::sum(doubled, denseC, -1)) &&
+                                      SelfTest::matches((-lazy(csrA) + lazy(ct.transposedView())).evaluateCSR().view(),
+                                                        SelfTest::sum(denseC, denseA, -1)));
+  test.check("lazy product plus a sum", SelfTest::matches((lazy(a) * lazy(b) + lazy(extra)).evaluate(), SelfTest::sum(product, denseExtra, 1)) &&
+                                        SelfTest::matches((lazy(extra) - 3 * (lazy(csrA) * lazy(csrB.view()))).evaluateCSR().view(),
+                                                          SelfTest::sum(denseExtra, tripled, -1)));
+  test.check("lazy products of expressions", SelfTest::matches(((lazy(a) + lazy(c)) * lazy(b)).evaluate(),
+                                                               SelfTest::product(SelfTest::sum(denseA, denseC, 1), denseB)) &&
+                                             SelfTest::matches((lazy(a.transposedView()) * (lazy(a) - lazy(c))).evaluate(),
+                                                               SelfTest::product(SelfTest::transpose(denseA), SelfTest::sum(denseA, denseC, -1))));
+}
+
+// Checks the in-place operators, including operands that alias the target and lazy right-hand sides,
+// and the copy and move operations. A and C are n x m, B is m x k
+static void testInPlace(SelfTest& test, const CSRMatrix& csrA, const CSRMatrix& csrB, const CSRMatrix& csrC) {
+  SparseMatrix a(csrA), b(csrB), c(csrC);
+  SelfTest::Dense denseA = SelfTest::toDense(csrA.view()), denseB = SelfTest::toDense(csrB.view());
+  SelfTest::Dense denseC = SelfTest::toDense(csrC.view());
+
+  // Returns a dense array times an integer
+  auto scale = [](SelfTest::Dense d, int factor) {
+    for (vector<long long>& row : d) {
+      for (long long& value : row) {
+        value *= factor;
       }
     }
-    if (colHeaders[i] != nullptr) {
-      delete colHeaders[i]; // Delete the column header
+    return d;
+  };
+
+  // x = A + C - A - 3C cancels every entry of A, so nodes must be removed as well as updated and linked
+  SparseMatrix x = a;
+  x += c;
+  x -= a;
+  x.axpy(-3, c);
+  SelfTest::Dense expected = scale(denseC, -2);
+  test.check("+=, -= and axpy", SelfTest::matches(x, expected) && x.nnz() == x.toCSR().nnz());
+
+  x *= -2;
+  bool scaled = SelfTest::matches(x, scale(expected, -2));
+  x += x;
+  bool doubled = SelfTest::matches(x, scale(expected, -4));
+  x -= x;
+  test.check("*= and aliased += and -=", scaled && doubled && x.nnz() == 0);
+
+  SparseMatrix y = a;
+  y += 2 * lazy(c) - lazy(a);
+  SparseMatrix z(test.randomCSR(a.getRows(), b.getCols(), 0.05));
+  z -= lazy(a) * lazy(b) + lazy(z);
+  test.check("+= and -= with lazy expressions", SelfTest::matches(y, scale(denseC, 2)) &&
+                                                SelfTest::matches(z, scale(SelfTest::product(denseA, denseB), -1)));
+
+  SparseMatrix copied(a), moved(std::move(copied));
+  SparseMatrix assigned;
+  assigned = moved;
+  test.check("copy and move", SelfTest::matches(moved, denseA) && SelfTest::matches(assigned, denseA) && copied.nnz() == 0);
+}
+
+// Checks insert, get, set and erase against a dense copy on a wide and a tall matrix, whose long rows
+// and columns are indexed on first access, with values of 0 removing entries. Every operation's
+// answer is checked, and the row and column lists are compared with the copy after every round
+static void testPointAccess(SelfTest& test) {
+  for (bool wide : {true, false}) {
+    int rows = wide ? 6 : 8 * test.size, cols = wide ? 8 * test.size : 6;
+    SparseMatrix matrix(rows, cols);
+    SelfTest::Dense dense(rows, vector<long long>(cols, 0));
+    uniform_int_distribution<int> row(0, rows - 1), col(0, cols - 1), value(-2, 9), operation(0, 3);
+    bool answers = true, lists = true;
+    for (int round = 0; round < 8 && answers && lists; round++) {
+      for (int step = 0; step < 4 * test.size; step++) {
+        int i = row(test.random), j = col(test.random), v = value(test.random);
+        switch (operation(test.random)) {
+          case 0:
+            if (v != 0) {
+              matrix.insert(i, j, v);
+              dense[i][j] = v;
+            }
+            break;
+          case 1:
+            matrix.set(i, j, v);
+            dense[i][j] = v;
+            break;
+          case 2:
+            answers = answers && matrix.erase(i, j) == (dense[i][j] != 0);
+            dense[i][j] = 0;
+            break;
+          default:
+            answers = answers && matrix.get(i, j) == dense[i][j];
+            break;
+        }
+      }
+      lists = SelfTest::matches(matrix, dense);
     }
+    answers = answers && SelfTest::toDense(matrix) == dense;
+    test.check(string("get, set and erase (") + (wide ? "long rows)" : "long columns)"), answers && lists);
   }
-  delete[] colHeaders; // Delete the array of column headers
-  
 }
 
-// Function for inserting a new internal node with the given row, column, and value into the sparse matrix
-void SparseMatrix::insert(int row, int col, int value) {
-  // Create a new interrnal node with the given row, column, and value
-  Internal* node = new Internal(row, col, value);
+// Checks that a MultiplyPlan reproduces the product for several sets of values on the patterns it was
+// built for, and that it refuses operands with another pattern without touching the result
+static void testMultiplyPlan(SelfTest& test, const CSRMatrix& csrA, const CSRMatrix& csrB) {
+  MultiplyPlan plan(csrA, csrB);
+  CSRMatrix a = csrA, b = csrB, result;
+  uniform_int_distribution<int> value(1, 9);
+  bool reused = true;
+  for (int round = 0; round < 3 && reused; round++) {
+    for (int& v : a.values) {
+      v = round % 2 == 0 ? value(test.random) : -value(test.random);
+    }
+    for (int& v : b.values) {
+      v = value(test.random) - 5;
+    }
+    reused = plan.matches(a.view(), b.view()) && plan.execute(a, b, result) && result.nnz() == plan.nnz() &&
+             SelfTest::matches(result.view(), SelfTest::product(SelfTest::toDense(a.view()), SelfTest::toDense(b.view())));
+  }
+  test.check("MultiplyPlan::execute on new values", reused);
 
-  Node* currRowHeader = rowHeaders[row]; // Get the current row header for the given row
-  Node* currColHeader = colHeaders[col]; // Get the current column header for the given column
+  // Move one entry of A to a column its row does not hold
+  CSRMatrix moved = a, before = result;
+  int row = 0;
+  while (row < moved.numRows && (moved.rowPtr[row + 1] == moved.rowPtr[row] || moved.rowPtr[row + 1] - moved.rowPtr[row] == moved.numCols)) {
+    row++;
+  }
+  bool refused = row < moved.numRows;
+  if (refused) {
+    int p = moved.rowPtr[row], j = 0;
+    while (binary_search(moved.colIdx.begin() + moved.rowPtr[row], moved.colIdx.begin() + moved.rowPtr[row + 1], j)) {
+      j++;
+    }
+    moved.colIdx[p] = j;
+    sort(moved.colIdx.begin() + moved.rowPtr[row], moved.colIdx.begin() + moved.rowPtr[row + 1]);
+    refused = !plan.matches(moved.view(), b.view()) && !plan.execute(moved, b, result) && SelfTest::sameArrays(result.view(), before.view());
+  }
+  test.check("MultiplyPlan refuses other patterns", refused);
+}
 
-  
-  // Find the correct position in the row to insert the new node
-  while (currRowHeader->right != NULL && currRowHeader->right != currRowHeader && currRowHeader->right->col < col) {
-    currRowHeader = currRowHeader->right;
+// Checks multiplyChain and multiplyChainCSR on a chain whose best order is not left to right, and
+// that chains that cannot be multiplied are refused
+static void testChain(SelfTest& test) {
+  vector<int> dims = {test.size, test.size / 10 + 1, test.size, test.size / 10 + 1, test.size / 2};
+  vector<CSRMatrix> csr;
+  vector<SparseMatrix> matrices;
+  for (size_t i = 0; i + 1 < dims.size(); i++) {
+    csr.push_back(test.randomCSR(dims[i], dims[i + 1], 0.05));
+    matrices.push_back(SparseMatrix(csr.back()));
   }
-  
-  // Find the correct position in the column to insert the new node
-  while (currColHeader->down != NULL && currColHeader->down != currColHeader && currColHeader->down->row < row) {
-    currColHeader = currColHeader->down;
+  SelfTest::Dense expected = SelfTest::toDense(csr[0].view());
+  vector<CompressedView> views;
+  vector<const SparseMatrix*> pointers;
+  for (size_t i = 0; i < csr.size(); i++) {
+    if (i > 0) {
+      expected = SelfTest::product(expected, SelfTest::toDense(csr[i].view()));
+    }
+    views.push_back(csr[i].view());
+    pointers.push_back(&matrices[i]);
   }
 
-  // Insert the new node into the row
-  node->right = currRowHeader->right;
-  currRowHeader->right = node;
-  node->left = currRowHeader;
+  string error;
+  ChainReport report;
+  CSRMatrix csrResult;
+  SparseMatrix result;
+  long long stepProducts = 0;
+  bool multiplied = multiplyChainCSR(views, csrResult, error, &report) && SelfTest::matches(csrResult.view(), expected);
+  for (const ChainStep& step : report.steps) {
+    stepProducts += step.products;
+  }
+  multiplied = multiplied && report.steps.size() == csr.size() - 1 && report.cost == stepProducts;
+  multiplied = multiplied && multiplyChain(pointers, result, error) && SelfTest::matches(result, expected);
+  test.check("multiplyChain " + report.order, multiplied);
 
-  // Update the links of the neighboring nodes
-  if (node != NULL && node->right != NULL) {
-    node->right->left = node;
+  vector<CompressedView> mismatched = {views[0], views[2]};
+  test.check("multiplyChain refuses mismatched and empty chains", !multiplyChainCSR(mismatched, csrResult, error) &&
+                                                                  !multiplyChainCSR({}, csrResult, error));
+}
+
+// Writes text to a file. Returns false on failure
+static bool writeTextFile(const string& path, const string& text) {
+  ofstream out(path, ios::binary);
+  out << text;
+  return (bool)out;
+}
+
+// Checks loadMatrixFile on every supported kind of file in the scratch directory, and that malformed
+// files, including headers that declare impossible sizes or counts, are refused with an error
+static void testLoader(SelfTest& test, const string& dir, const CSRMatrix& csrA) {
+  string path = dir + "/load.mtx", error;
+  SelfTest::Dense denseA = SelfTest::toDense(csrA.view());
+
+  // A general integer file with its entries in random order, and the same entries as real values in
+  // plain triplets, whose size comes from the largest indices
+  vector<string> lines;
+  for (int i = 0; i < csrA.numRows; i++) {
+    for (int p = csrA.rowPtr[i]; p < csrA.rowPtr[i + 1]; p++) {
+      lines.push_back(to_string(i + 1) + " " + to_string(csrA.colIdx[p] + 1) + " " + to_string(csrA.values[p]));
+    }
+  }
+  shuffle(lines.begin(), lines.end(), test.random);
+  string general = "%%MatrixMarket matrix coordinate integer general\n% comment\n" + to_string(csrA.numRows) + " " +
+                   to_string(csrA.numCols) + " " + to_string(lines.size()) + "\n";
+  string triplets = "# comment\n";
+  for (const string& line : lines) {
+    general += line + "\n";
+    triplets += line + ".0\n";
+  }
+  SparseMatrix loaded;
+  bool ok = writeTextFile(path, general) && loadMatrixFile(path, loaded, error) && SelfTest::matches(loaded, denseA);
+  ok = ok && writeTextFile(path, triplets) && loadMatrixFile(path, loaded, error);
+  if (ok) {
+    // The triplet file is only as large as its largest indices
+    SelfTest::Dense trimmed(loaded.getRows(), vector<long long>(loaded.getCols(), 0));
+    for (int i = 0; i < loaded.getRows(); i++) {
+      copy(denseA[i].begin(), denseA[i].begin() + loaded.getCols(), trimmed[i].begin());
+    }
+    ok = loaded.getRows() <= csrA.numRows && loaded.getCols() <= csrA.numCols && SelfTest::matches(loaded, trimmed);
   }
+  test.check("loadMatrixFile general and triplet files", ok);
 
-  // Insert the new node into the column
-  node->down = currColHeader->down;
-  currColHeader->down = node;
-  node->up = currColHeader;
+  // Symmetric files store the lower triangle, which is mirrored (negated for skew-symmetric ones)
+  SelfTest::Dense symmetric(4, vector<long long>(4, 0)), skew = symmetric;
+  symmetric[0][0] = 1, symmetric[2][0] = symmetric[0][2] = 1, symmetric[3][1] = symmetric[1][3] = 1;
+  skew[2][0] = 5, skew[0][2] = -5, skew[3][2] = -7, skew[2][3] = 7;
+  ok = writeTextFile(path, "%%MatrixMarket matrix coordinate pattern symmetric\n4 4 3\n1 1\n3 1\n4 2\n") &&
+       loadMatrixFile(path, loaded, error) && SelfTest::matches(loaded, symmetric) &&
+       writeTextFile(path, "%%MatrixMarket matrix coordinate real skew-symmetric\n4 4 2\n3 1 5\n4 3 -7e0\n") &&
+       loadMatrixFile(path, loaded, error) && SelfTest::matches(loaded, skew);
+  test.check("loadMatrixFile symmetric and skew-symmetric files", ok);
 
-  // Update the links of the neighboring nodes
-  if (node->down != NULL) {
-    node->down->up = node;
+  vector<string> malformed = {
+    "%%MatrixMarket matrix coordinate integer general\n2 2 4000000000\n1 1 1\n",
+    "%%MatrixMarket matrix coordinate integer symmetric\n3000 3000 9000000000000000000\n1 1 1\n",
+    "%%MatrixMarket matrix coordinate integer general\n3000000000 2 1\n1 1 1\n",
+    "%%MatrixMarket matrix coordinate integer symmetric\n2 3 1\n1 1 1\n",
+    "%%MatrixMarket matrix coordinate integer general\n2 2 1\n3 1 1\n",
+    "%%MatrixMarket matrix coordinate integer general\n2 2 2\n1 1 1\n",
+    "%%MatrixMarket matrix coordinate integer general\n2 2 1\n1 1 1\n2 2 1\n",
+    "%%MatrixMarket matrix coordinate real general\n2 2 1\n1 1 1.5\n",
+    "%%MatrixMarket matrix coordinate integer general\n2 2 1\n1 1 3000000000\n",
+    "%%MatrixMarket matrix coordinate integer symmetric\n2 2 1\n1 2 1\n",
+    "%%MatrixMarket matrix coordinate integer skew-symmetric\n2 2 1\n1 1 1\n",
+    "%%MatrixMarket matrix array integer general\n2 2\n1\n2\n3\n4\n",
+    "1 1 1\n2 x 1\n",
+    "0 1 1\n",
+  };
+  int refused = 0;
+  for (const string& text : malformed) {
+    error.clear();
+    refused += writeTextFile(path, text) && !loadMatrixFile(path, loaded, error) && !error.empty() ? 1 : 0;
   }
+  test.check("loadMatrixFile refuses " + to_string(refused) + " of " + to_string(malformed.size()) + " malformed files",
+             refused == (int)malformed.size());
+  unlink(path.c_str());
 }
 
-// Function for transposing the current matrix, creating a new matrix with swapped dimensions
-SparseMatrix* SparseMatrix::transpose() {
-  // Create a new matrix with the swapped dimensions
-  SparseMatrix* result = new SparseMatrix(numCols, numRows);
+// Checks that snapshots with corrupt structure are refused with the matching error by MappedMatrix and
+// by the out-of-core product, on either side, instead of being handed to the kernels
+static void testCorruptSnapshots(SelfTest& test, const string& dir, const CSRMatrix& csrA) {
+  string good = dir + "/good.spmx", transposed = dir + "/transposed.spmx", bad = dir + "/bad.spmx", output = dir + "/out.spmx", error;
+  CSRMatrix csrT = csrA.transpose();
+  if (!saveSnapshot(csrA.view(), good, error) || !saveSnapshot(csrT.view(), transposed, error)) {
+    test.check("save a snapshot to corrupt", false);
+    return;
+  }
+  ifstream in(good, ios::binary);
+  string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  SnapshotHeader header;
+  memcpy(&header, bytes.data(), sizeof(header));
 
-  for (int i = 0; i < numRows; i++) {
-    Node* node = rowHeaders[i]->right;
-    while (node != nullptr) {
-      result->insert(node->col, node->row, node->value); // Insert the transposed values into the new matrix
-      node = node->right;
+  // Returns the bytes of the snapshot with one int of an array replaced
+  auto patched = [&](uint64_t offset, int index, int value) {
+    string copy = bytes;
+    memcpy(&copy[offset + (uint64_t)index * sizeof(int)], &value, sizeof(int));
+    return copy;
+  };
+
+  // Every corruption is refused when the snapshot is mapped, as the right operand of the out-of-core
+  // product is. The left operand is streamed and checked panel by panel, which refuses the indices that
+  // would be out of range; columns out of order within a row are harmless there
+  struct Corruption {
+    string bytes, problem;
+    bool refusedOnLeft;
+  };
+  vector<Corruption> corruptions = {
+    {patched(header.colIdxOffset, csrA.nnz() / 2, 0x7fffffff), "corrupt column indices", true},
+    {patched(header.colIdxOffset, csrA.nnz() / 2, -1), "corrupt column indices", true},
+    {patched(header.rowPtrOffset, csrA.numRows / 2, 0x40000000), "corrupt row pointers", true},
+    {patched(header.rowPtrOffset, 0, 1), "corrupt row pointers", false},
+    {bytes.substr(0, header.valuesOffset), "corrupt snapshot header", true},
+  };
+
+  // Swap the first two columns of a row that has two, if any
+  for (int row = 0; row < csrA.numRows; row++) {
+    int first = csrA.rowPtr[row];
+    if (csrA.rowPtr[row + 1] - first >= 2) {
+      string swapped = patched(header.colIdxOffset, first, csrA.colIdx[first + 1]);
+      memcpy(&swapped[header.colIdxOffset + (uint64_t)(first + 1) * sizeof(int)], &csrA.colIdx[first], sizeof(int));
+      corruptions.push_back({swapped, "corrupt column indices", false});
+      break;
     }
   }
-  return result; // Return the transposed matrix
+  int refused = 0;
+  for (const Corruption& corruption : corruptions) {
+    MappedMatrix mapped;
+    string mapError, leftError, rightError;
+    bool ok = writeTextFile(bad, corruption.bytes) && !mapped.open(bad, mapError) &&
+              mapError.find(corruption.problem) != string::npos &&
+              !multiplyOutOfCore(transposed, bad, output, 1 << 20, rightError) && !rightError.empty();
+    if (corruption.refusedOnLeft) {
+      ok = ok && !multiplyOutOfCore(bad, transposed, output, 1 << 20, leftError) && !leftError.empty();
+    }
+    refused += ok ? 1 : 0;
+  }
+  test.check("corrupt snapshots refused (" + to_string(refused) + " of " + to_string(corruptions.size()) + ")",
+             refused == (int)corruptions.size());
+  for (const string& path : {good, transposed, bad, output}) {
+    unlink(path.c_str());
+  }
 }
 
-// Operator overloading for matrix addition: Adds the first matrix and second matrix
-SparseMatrix* SparseMatrix::operator+(SparseMatrix& other) {
-  // Create a new SparseMatrix object for storing the result
-  SparseMatrix* result = new SparseMatrix(numRows, numCols);
+// Returns the number of scratch files of the out-of-core product left in a directory
+static int countScratchFiles(const string& dir) {
+  int count = 0;
+  DIR* listing = opendir(dir.c_str());
+  if (listing == nullptr) {
+    return -1;
+  }
+  while (dirent* entry = readdir(listing)) {
+    count += strncmp(entry->d_name, ".spmx-", 6) == 0 ? 1 : 0;
+  }
+  closedir(listing);
+  return count;
+}
 
-  for (int i = 0; i < numRows; i++) {
-    Node* node1 = rowHeaders[i]->right; // Get the first node in the current row of the first matrix
-    Node* node2 = other.rowHeaders[i]->right; // Get the first node in the current row of the second matrix
+// Checks that the out-of-core product may write over either of its operands, that it leaves files
+// next to the output alone, and that a failed product leaves an existing output untouched
+static void testOutOfCoreOutput(SelfTest& test, const string& dir, const CSRMatrix& square) {
+  string left = dir + "/left.spmx", right = dir + "/right.spmx", output = dir + "/product.spmx", error;
+  string neighbour = output + ".values";
+  SelfTest::Dense dense = SelfTest::toDense(square.view()), expected = SelfTest::product(dense, dense);
+  bool ok = true;
+  for (bool overLeft : {true, false}) {
+    MappedMatrix result;
+    ok = ok && saveSnapshot(square.view(), left, error) && saveSnapshot(square.view(), right, error) &&
+         multiplyOutOfCore(left, right, overLeft ? left : right, 16 << 10, error) && result.open(overLeft ? left : right, error) &&
+         SelfTest::matches(result.view(), expected);
+  }
+  test.check("out-of-core multiply over an operand", ok);
+
+  MappedMatrix result;
+  CSRMatrix wide(square.numRows, square.numCols + 1);
+  ok = writeTextFile(neighbour, "keep") && saveSnapshot(square.view(), left, error) && saveSnapshot(wide.view(), output, error) &&
+       multiplyOutOfCore(left, left, output, 16 << 10, error) && result.open(output, error) && SelfTest::matches(result.view(), expected);
+  result.close();
+  ifstream kept(neighbour);
+  string text;
+  ok = ok && getline(kept, text) && text == "keep";
+
+  // A product that fails once the output is being written, here on a column index out of range, must
+  // leave the previous output in place
+  CSRMatrix broken = square;
+  broken.colIdx[broken.nnz() / 2] = broken.numCols + 5;
+  ok = ok && saveSnapshot(broken.view(), right, error) && !multiplyOutOfCore(right, left, output, 16 << 10, error) &&
+       result.open(output, error) && SelfTest::matches(result.view(), expected);
+  test.check("out-of-core multiply leaves other files alone", ok && countScratchFiles(dir) == 0);
+  for (const string& path : {left, right, output, neighbour}) {
+    unlink(path.c_str());
+  }
+}
+
+// Returns true if calling f throws invalid_argument
+template <class F>
+static bool throwsInvalidArgument(F f) {
+  try {
+    f();
+  }
+  catch (const invalid_argument&) {
+    return true;
+  }
+  return false;
+}
+
+// Checks that masked and pruned products of operands with mismatched shapes are refused. A is n x m
+// and B is m x k
+static void testShapeChecks(SelfTest& test, const CSRMatrix& csrA, const CSRMatrix& csrB) {
+  SparseMatrix a(csrA), b(csrB);
+  CSRMatrix mask(csrA.numRows, csrB.numCols), wrongMask(csrA.numRows, csrB.numCols + 1);
+  test.check("masked products refuse mismatched shapes",
+             throwsInvalidArgument([&] { multiplyMaskedCSR(csrA.view(), csrA.view(), mask.view()); }) &&
+             throwsInvalidArgument([&] { multiplyMaskedCSR(csrA.view(), csrB.view(), wrongMask.view(), true); }) &&
+             throwsInvalidArgument([&] { a.multiplyMasked(a, SparseMatrix(mask)); }) &&
+             throwsInvalidArgument([&] { a.multiplyMasked(b, SparseMatrix(wrongMask)); }));
+  test.check("pruned products refuse mismatched shapes",
+             throwsInvalidArgument([&] { multiplyPrunedCSR(csrA.view(), csrA.view(), PruneOptions{1, 0, 0}); }) &&
+             throwsInvalidArgument([&] { a.multiplyPruned(a, PruneOptions{0, 0, 2}); }));
+}
+
+// Runs the self-test on random matrices. Returns the process exit code: 0 if every check passed
+int runSelfTest(int argc, char** argv) {
+  int size = 400, threads = 4;
+  unsigned seed = 1;
+  for (int a = 2; a < argc; a++) {
+    string arg = argv[a];
+    if (a + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++a];
+    bool valid = true;
+    if (arg == "-n") {
+      valid = parseNumber(value, size) && size >= 8;
+    }
+    else if (arg == "-s") {
+      valid = parseNumber(value, seed);
+    }
+    else if (arg == "-t") {
+      valid = parseNumber(value, threads) && threads >= 2;
+    }
+    else {
+      cerr << "Unknown test option " << arg << endl;
+      return 1;
+    }
+    if (!valid) {
+      cerr << "Invalid value " << value << " for " << arg << endl;
+      return 1;
+    }
+  }
+
+  // A (n x m) times B (m x k) with distinct dimensions. At the default size A is dense enough for the
+  // parallel paths
+  SelfTest test(size, seed);
+  int n = size, m = size - size / 4, k = size + size / 5;
+  CSRMatrix csrA = test.randomCSR(n, m, 0.1), csrB = test.randomCSR(m, k, 0.1);
+  SparseMatrix a(csrA), b(csrB);
+  SelfTest::Dense denseA = SelfTest::toDense(a), denseB = SelfTest::toDense(b);
+  SelfTest::Dense expected = SelfTest::product(denseA, denseB);
+  test.check("linked list round trip", SelfTest::matches(csrA.view(), denseA) && SelfTest::matches(csrB.view(), denseB));
+
+  // Plain products and compressed arithmetic, on one thread and on the pool. C has the shape of A
+  CSRMatrix csrC = test.randomCSR(n, m, 0.1);
+  int previousThreads = SparseMatrix::getNumThreads();
+  for (int t : {1, threads}) {
+    SparseMatrix::setNumThreads(t);
+    string where = t == 1 ? " (serial)" : " (" + to_string(t) + " threads)";
+    test.check("multiply" + where, SelfTest::matches((a * b).toCSR().view(), expected));
+    test.check("multiplyCSR" + where, SelfTest::matches(multiplyCSR(csrA.view(), csrB.view()).view(), expected));
+    testCompressed(test, csrA, csrB, csrC, where);
+
+    // Masked products: the product at the mask's positions, and everywhere else with complement
+    CSRMatrix mask = test.randomCSR(n, k, 0.2);
+    SelfTest::Dense inside = expected, outside = expected;
+    SelfTest::Dense denseMask = SelfTest::toDense(mask.view());
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < k; j++) {
+        (denseMask[i][j] != 0 ? outside : inside)[i][j] = 0;
+      }
+    }
+    test.check("masked multiply" + where, SelfTest::matches(multiplyMaskedCSR(csrA.view(), csrB.view(), mask.view()).view(), inside));
+    test.check("complement masked multiply" + where,
+               SelfTest::matches(multiplyMaskedCSR(csrA.view(), csrB.view(), mask.view(), true).view(), outside));
+
+    // Pruned products: drop small magnitudes, then keep the topK largest of every row, ties to the
+    // lower column
+    for (PruneOptions options : {PruneOptions{20, 0, 0}, PruneOptions{0, 0.5, 0}, PruneOptions{5, 0.1, 3}}) {
+      SelfTest::Dense pruned = expected;
+      for (vector<long long>& row : pruned) {
+        long long largest = 0;
+        for (long long value : row) {
+          largest = max(largest, llabs(value));
+        }
+        double limit = max((double)options.threshold, options.relative * largest);
+        vector<int> kept;
+        for (int j = 0; j < k; j++) {
+          if (row[j] != 0 && llabs(row[j]) >= limit) {
+            kept.push_back(j);
+          }
+        }
+        stable_sort(kept.begin(), kept.end(), [&](int x, int y) { return llabs(row[x]) > llabs(row[y]); });
+        if (options.topK > 0 && (int)kept.size() > options.topK) {
+          kept.resize(options.topK);
+        }
+        vector<long long> keep(k, 0);
+        for (int j : kept) {
+          keep[j] = row[j];
+        }
+        row.swap(keep);
+      }
+      test.check("pruned multiply threshold " + to_string(options.threshold) + " relative " + to_string(options.relative).substr(0, 4) +
+                 " top-k " + to_string(options.topK) + where,
+                 SelfTest::matches(multiplyPrunedCSR(csrA.view(), csrB.view(), options).view(), pruned));
+    }
+  }
+  SparseMatrix::setNumThreads(previousThreads);
+  testBuilder(test);
+  testTransposes(test, a, SparseMatrix(csrC));
+  testSums(test, threads);
+  testSpmv(test, threads);
+  testLazy(test, csrA, csrB, csrC);
+  testInPlace(test, csrA, csrB, csrC);
+  testPointAccess(test);
+  testMultiplyPlan(test, csrA, csrB);
+  testChain(test);
+  testShapeChecks(test, csrA, csrB);
 
-    while (node1 != nullptr || node2 != nullptr) {
-      // If node1 is null or node2 has a smaller column index, insert node2 into the result matrix
-      if (node1 == nullptr || (node2 != nullptr && node2->col < node1->col)) {
-        result->insert(i, node2->col, node2->value);
-        node2 = node2->right;
+  // Block sparse rows for every specialized size and one that is not
+  for (int blockSize : {2, 3, 4, 5, 8}) {
+    BSRMatrix left(csrA, blockSize), right(csrB, blockSize), same(test.randomCSR(n, m, 0.1), blockSize);
+    SelfTest::Dense sum = SelfTest::toDense(same.toCSR().view()), difference = sum;
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < m; j++) {
+        sum[i][j] = denseA[i][j] + sum[i][j];
+        difference[i][j] = denseA[i][j] - difference[i][j];
       }
-      // If node2 is null or node1 has a smaller column index, insert node1 into the result matrix
-      else if (node2 == nullptr || (node1 != nullptr && node1->col < node2->col)) {
-        result->insert(i, node1->col, node1->value);
-        node1 = node1->right;
+    }
+    vector<double> x(m), y;
+    for (int j = 0; j < m; j++) {
+      x[j] = j % 7 - 3.5;
+    }
+    left.multiplyVector(x, y);
+    bool vectorMatches = (int)y.size() == n;
+    for (int i = 0; i < n && vectorMatches; i++) {
+      double expectedY = 0;
+      for (int j = 0; j < m; j++) {
+        expectedY += denseA[i][j] * x[j];
+      }
+      vectorMatches = y[i] == expectedY;
+    }
+    string blocks = " (" + to_string(blockSize) + "x" + to_string(blockSize) + " blocks)";
+    test.check("BSR multiply" + blocks, SelfTest::matches((left * right).toCSR().view(), expected));
+    test.check("BSR add and subtract" + blocks, SelfTest::matches((left + same).toCSR().view(), sum) &&
+                                                SelfTest::matches((left - same).toCSR().view(), difference));
+    test.check("BSR multiplyVector" + blocks, vectorMatches);
+  }
+
+  // Snapshots, the out-of-core product and the file loader, in a scratch directory
+  const char* tmp = getenv("TMPDIR");
+  string pattern = string(tmp != nullptr && *tmp != '\0' ? tmp : "/tmp") + "/sparse-test-XXXXXX";
+  vector<char> directory(pattern.begin(), pattern.end());
+  directory.push_back('\0');
+  if (mkdtemp(directory.data()) == nullptr) {
+    test.check("create a scratch directory in " + pattern, false);
+  }
+  else {
+    string dir = directory.data(), pathA = dir + "/a.spmx", pathB = dir + "/b.spmx", pathC = dir + "/c.spmx", error;
+    bool saved = saveSnapshot(csrA.view(), pathA, error) && saveSnapshot(csrB.view(), pathB, error);
+    MappedMatrix mapped;
+    bool roundTrip = saved && mapped.open(pathA, error) && SelfTest::sameArrays(mapped.view(), csrA.view()) &&
+                     SelfTest::sameArrays(mapped.toSparseMatrix().toCSR().view(), csrA.view());
+    mapped.close();
+    test.check("snapshot round trip", roundTrip);
+    for (size_t budget : {(size_t)16 << 10, (size_t)64 << 20}) {
+      MappedMatrix result;
+      bool multiplied = saved && multiplyOutOfCore(pathA, pathB, pathC, budget, error) && result.open(pathC, error) &&
+                        SelfTest::matches(result.view(), expected);
+      test.check("out-of-core multiply (" + (budget < (1 << 20) ? to_string(budget >> 10) + "K" : to_string(budget >> 20) + "M") +
+                 " budget)", multiplied);
+    }
+    if (!error.empty()) {
+      cerr << error << endl;
+    }
+    testLoader(test, dir, csrA);
+    testCorruptSnapshots(test, dir, csrA);
+    testOutOfCoreOutput(test, dir, test.randomCSR(n, n, 0.05));
+    for (const string& path : {pathA, pathB, pathC}) {
+      unlink(path.c_str());
+    }
+    rmdir(dir.c_str());
+  }
+
+  // Incremental products under batches of point updates to both operands
+  IncrementalProduct incremental(a, b);
+  SelfTest::Dense left = denseA, right = denseB;
+  uniform_int_distribution<int> value(-9, 9), batch(1, 40);
+  bool incrementalMatches = true;
+  for (int round = 0; round < 20 && incrementalMatches; round++) {
+    for (int change = batch(test.random); change > 0; change--) {
+      bool toLeft = test.random() % 2 == 0;
+      int row = test.random() % (toLeft ? n : m), col = test.random() % (toLeft ? m : k), v = value(test.random);
+      if (toLeft) {
+        incremental.setLeft(row, col, v);
+        left[row][col] = v;
       }
-      // If both nodes have the same column index, add their values and insert the sum into the result matrix
       else {
-        result->insert(i, node1->col, node1->value + node2->value);
-        node1 = node1->right;
-        node2 = node2->right;
+        incremental.setRight(row, col, v);
+        right[row][col] = v;
       }
     }
+    incremental.update();
+    incrementalMatches = SelfTest::matches(incremental.product().toCSR().view(), SelfTest::product(left, right));
   }
-  return result; // Return the result matrix
+  test.check("IncrementalProduct::update", incrementalMatches);
+
+  // Permutations: entry (i, j) of the permuted matrix comes from (rowOrder[i], colOrder[j]), and the
+  // inverse permutations restore the original arrays
+  CSRMatrix square = test.randomCSR(n, n, 0.05);
+  SelfTest::Dense denseSquare = SelfTest::toDense(square.view());
+  vector<int> shuffled(n);
+  iota(shuffled.begin(), shuffled.end(), 0);
+  shuffle(shuffled.begin(), shuffled.end(), test.random);
+  vector<pair<string, vector<int>>> orders = {{"random", shuffled}, {"rcm", reverseCuthillMcKee(square.view())},
+                                              {"degree", degreeOrdering(square.view())},
+                                              {"partition", partitionOrdering(square.view(), 4)}};
+  for (const pair<string, vector<int>>& order : orders) {
+    const vector<int>& p = order.second;
+    vector<int> sorted = p;
+    sort(sorted.begin(), sorted.end());
+    bool isPermutation = (int)sorted.size() == n;
+    for (int i = 0; i < n && isPermutation; i++) {
+      isPermutation = sorted[i] == i;
+    }
+    bool permuted = false;
+    if (isPermutation) {
+      SelfTest::Dense moved(n, vector<long long>(n));
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+          moved[i][j] = denseSquare[p[i]][p[(j + 1) % n]];
+        }
+      }
+      vector<int> colOrder(n);
+      for (int j = 0; j < n; j++) {
+        colOrder[j] = p[(j + 1) % n];
+      }
+      CSRMatrix forward = permuteCSR(square.view(), p, colOrder);
+      CSRMatrix back = permuteCSR(forward.view(), inversePermutation(p), inversePermutation(colOrder));
+      permuted = SelfTest::matches(forward.view(), moved) && SelfTest::sameArrays(back.view(), square.view());
+    }
+    test.check("permuteCSR and its inverse (" + order.first + " ordering)", permuted);
+  }
+
+  printf("%d failed\n", test.failures());
+  return test.failures() == 0 ? 0 : 1;
 }
 
-// Operator overloading for matrix subtraction: Subtracts the second matrix from the first matrix
-SparseMatrix* SparseMatrix::operator-(SparseMatrix& other) {
-  // Create a new SparseMatrix object for storing the result
-  SparseMatrix* result = new SparseMatrix(numRows, numCols);
+// Prints the command line usage of the batch mode
+static void printUsage(const char* program) {
+  cerr << "Usage: " << program << " <command> <A> [B ...] [-o OUTPUT] [-f mm|coo|dense] [-t THREADS] [-m BUDGET] [--stats]\n\n"
+       << "Commands:\n"
+       << "  transpose A      Transpose A\n"
+       << "  add A B          A + B\n"
+       << "  sub A B          A - B\n"
+       << "  mul A B [C ...]  A * B, or a chain A * B * C ... in the order estimated to be cheapest\n"
+       << "  reorder A        Renumber the rows and columns of square A together to improve locality\n"
+       << "                   -r rcm|degree|partition (default rcm)\n"
+       << "  bench [options]  Benchmark every operation on generated matrices\n"
+       << "                   -n SIZE -d DENSITY -r REPS -w WARMUP -s SEED -t THREADS\n"
+       << "                   -p uniform|banded|block|rmat|all  --json FILE ('-' for stdout)\n"
+       << "  test [options]   Check the kernels against dense reference results on random matrices\n"
+       << "                   -n SIZE -s SEED -t THREADS (at least 2)\n\n"
+       << "Inputs are binary snapshots, Matrix Market coordinate files or plain 'row column value'\n"
+       << "triplets (1-based); '-' reads standard input. The result is written as Matrix Market to OUTPUT,\n"
+       << "or to standard output if -o is not given; an OUTPUT ending in .spmx is written as a binary\n"
+       << "snapshot. -f coo writes plain triplets instead, and -f dense a dense preview of the top-left\n"
+       << "32x32 block. --stats prints the operation counters as JSON to standard error. Run without\n"
+       << "arguments for the interactive calculator.\n\n"
+       << "-m BUDGET multiplies out of core: A and B must be snapshots and OUTPUT must end in .spmx. A is\n"
+       << "streamed from disk in row panels and the result is written as it is computed, keeping the\n"
+       << "panels within BUDGET bytes (K, M and G suffixes are accepted).\n\n"
+       << "--threshold T, --relative R and --top-k K prune a product of two matrices as every row is\n"
+       << "computed: entries below T in magnitude, or below R times the largest magnitude in their row,\n"
+       << "are dropped, and of the rest only the K largest in magnitude are kept.\n";
+}
 
-  for (int i = 0; i < numRows; i++) {
-    Node* node1 = rowHeaders[i]->right; // Get the first node in the current row of the first matrix
-    Node* node2 = other.rowHeaders[i]->right; // Get the first node in the current row of the second matrix
+// Parses a byte count with an optional K, M or G suffix. Returns false if the text is not one
+static bool parseByteSize(const string& text, size_t& bytes) {
+  char* end;
+  double value = strtod(text.c_str(), &end);
+  string suffix = end;
+  double scale = suffix.empty() ? 1 : suffix == "K" || suffix == "k" ? 1 << 10 : suffix == "M" || suffix == "m" ? 1 << 20
+               : suffix == "G" || suffix == "g" ? 1 << 30 : 0;
+  if (end == text.c_str() || scale == 0 || value <= 0) {
+    return false;
+  }
+  bytes = value * scale;
+  return true;
+}
 
-    while (node1 != nullptr || node2 != nullptr) {
-      // If node1 is null or node2 has a smaller column index, insert the negation of node2 into the result matrix
-      if (node1 == nullptr || (node2 != nullptr && node2->col < node1->col)) {
-        result->insert(i, node2->col, -1 * node2->value);
-        node2 = node2->right;
+// Checks that the operands of add, sub or mul have compatible shapes. Returns false after printing an
+// error if they do not
+static bool checkOperandShapes(const string& command, int aRows, int aCols, int bRows, int bCols) {
+  bool compatible = command == "mul" ? aCols == bRows : aRows == bRows && aCols == bCols;
+  if (!compatible) {
+    cerr << "Unable to " << command << " a " << aRows << "x" << aCols << " matrix and a " << bRows << "x" << bCols
+         << " matrix" << endl;
+  }
+  return compatible;
+}
+
+// Runs one operation from the command line without prompting. Returns the process exit code
+int runBatch(int argc, char** argv) {
+  string command = argv[1];
+  if (command == "bench") {
+    return runBenchmark(argc, argv);
+  }
+  if (command == "test") {
+    return runSelfTest(argc, argv);
+  }
+  vector<string> inputs;
+  string output = "-";
+  string format = "mm";
+  bool printStats = false;
+  size_t memoryBudget = 0; // Nonzero for an out-of-core multiplication
+  string ordering = "rcm";
+  PruneOptions prune;
+  bool pruned = false; // Whether any pruning option was given
+
+  for (int a = 2; a < argc; a++) {
+    string arg = argv[a];
+    if ((arg == "-o" || arg == "-t" || arg == "-f" || arg == "-m" || arg == "-r") && a + 1 < argc) {
+      if (arg == "-o") {
+        output = argv[++a];
+      }
+      else if (arg == "-r") {
+        ordering = argv[++a];
+        if (ordering != "rcm" && ordering != "degree" && ordering != "partition") {
+          cerr << "Unknown ordering " << ordering << ", expected rcm, degree or partition" << endl;
+          return 1;
+        }
       }
-      // If node2 is null or node1 has a smaller column index, insert node1 into the result matrix
-      else if (node2 == nullptr || (node1 != nullptr && node1->col < node2->col)) {
-        result->insert(i, node1->col, node1->value);
-        node1 = node1->right;
+      else if (arg == "-f") {
+        format = argv[++a];
+      }
+      else if (arg == "-m") {
+        if (!parseByteSize(argv[++a], memoryBudget)) {
+          cerr << "Invalid memory budget " << argv[a] << endl;
+          return 1;
+        }
       }
-      // If both nodes have the same column index, subtract their values and insert the difference into the result matrix
       else {
-        result->insert(i, node1->col, node1->value - node2->value);
-        node1 = node1->right;
-        node2 = node2->right;
+        int threads;
+        if (!parseNumber(argv[++a], threads) || threads < 0) {
+          cerr << "Invalid thread count " << argv[a] << endl;
+          return 1;
+        }
+        SparseMatrix::setNumThreads(threads);
+      }
+    }
+    else if ((arg == "--threshold" || arg == "--relative" || arg == "--top-k") && a + 1 < argc) {
+      const char* value = argv[++a];
+      bool valid = arg == "--threshold" ? parseNumber(value, prune.threshold) && prune.threshold >= 0
+                 : arg == "--relative" ? parseNumber(value, prune.relative) && prune.relative >= 0
+                 : parseNumber(value, prune.topK) && prune.topK >= 0;
+      if (!valid) {
+        cerr << "Invalid value " << value << " for " << arg << endl;
+        return 1;
       }
+      pruned = true;
+    }
+    else if (arg == "--stats") {
+      printStats = true;
+    }
+    else if (arg == "-h" || arg == "--help") {
+      printUsage(argv[0]);
+      return 0;
+    }
+    else {
+      inputs.push_back(arg);
     }
   }
-  return result; // Return the result matrix
-}
 
-// Operator overloading for matrix multiplication: Multiplies the first matrix with the second matrix
-SparseMatrix* SparseMatrix::operator*(SparseMatrix& other) {
-  // Create a new SparseMatrix object for storing the result
-  SparseMatrix* result = new SparseMatrix(numRows, other.numCols);
+  size_t operands = command == "transpose" || command == "reorder" ? 1 : (command == "add" || command == "sub" || command == "mul") ? 2 : 0;
+  bool chain = command == "mul" && inputs.size() > 2 && memoryBudget == 0; // A product of three or more matrices
+  if (operands == 0 || (inputs.size() != operands && !chain) || (format != "mm" && format != "coo" && format != "dense")) {
+    printUsage(argv[0]);
+    return 1;
+  }
 
-  for (int i = 0; i < numRows; i++) {
-    Node* node1 = rowHeaders[i]->right; // Get the first node in the current row of the first matrix
-    while (node1 != nullptr) {
-      Node* node2 = other.rowHeaders[node1->col]->right; // Get the first node in the current row of the second matrix
-      while (node2 != nullptr) {
-        double newValue = node1->value * node2->value;
-        int col = node2->col;
-        Node* resNode = result->rowHeaders[i];
+  if (pruned && (command != "mul" || chain || memoryBudget > 0)) {
+    cerr << "--threshold, --relative and --top-k need mul with two operands and no -m" << endl;
+    return 1;
+  }
 
-        // Find the correct position to insert the new node in the result matrix
-        while (resNode->right != nullptr && resNode->right->col < col) {
-          resNode = resNode->right;
-        }
+  // Out-of-core products go from snapshot files to a snapshot file without loading the operands
+  bool snapshotOutput = output.size() > 5 && output.compare(output.size() - 5, 5, ".spmx") == 0;
+  if (memoryBudget > 0) {
+    if (command != "mul" || !snapshotOutput || !isSnapshotFile(inputs[0]) || !isSnapshotFile(inputs[1])) {
+      cerr << "-m needs mul with snapshot operands and a .spmx output" << endl;
+      return 1;
+    }
+    string error;
+    OutOfCoreStats report;
+    if (!multiplyOutOfCore(inputs[0], inputs[1], output, memoryBudget, error, &report)) {
+      cerr << error << endl;
+      return 1;
+    }
+    if (printStats) {
+      cerr << "out of core: " << report.panels << " panels, " << report.nnz << " entries, " << report.bytesRead
+           << " bytes read, " << report.bytesWritten << " bytes written, waited " << report.readWaitSeconds
+           << " s for reads and " << report.writeWaitSeconds << " s for writes\n";
+      cerr << SparseStats::toJSON();
+    }
+    return 0;
+  }
 
-        // If a node with the same column index already exists in the result matrix, update its value by adding the new value
-        if (resNode->right != nullptr && resNode->right->col == col) {
-          resNode->right->value += newValue;
-        }
-        // If the node with the same column index does not exist insert a new node in the result matrix
-        else {
-          result->insert(i, col, newValue);
-        }
-        node2 = node2->right;
+  // Snapshot operands of a single operation are used in place through their mappings and the CSR entry
+  // points, instead of being copied into linked lists first
+  bool inPlace = !chain && command != "reorder";
+  for (const string& input : inputs) {
+    inPlace = inPlace && input != "-" && isSnapshotFile(input);
+  }
+
+  SparseMatrix result;
+  CSRMatrix mappedResult; // The result of an in-place operation
+  bool computed = true;
+  if (inPlace) {
+    vector<MappedMatrix> snapshots(inputs.size());
+    for (size_t m = 0; m < inputs.size(); m++) {
+      string error;
+      if (!snapshots[m].open(inputs[m], error)) {
+        cerr << error << endl;
+        return 1;
+      }
+    }
+    CompressedView a = snapshots[0].view();
+    if (command == "transpose") {
+      mappedResult = transposeCSR(a);
+    }
+    else {
+      CompressedView b = snapshots[1].view();
+      computed = checkOperandShapes(command, a.numMajor, a.numMinor, b.numMajor, b.numMinor);
+      if (computed) {
+        mappedResult = command == "add" ? addCSR(a, b) : command == "sub" ? subtractCSR(a, b)
+                     : pruned ? multiplyPrunedCSR(a, b, prune) : multiplyCSR(a, b);
       }
-      node1 = node1->right;
+    }
+    if (computed && !snapshotOutput) {
+      result = SparseMatrix(mappedResult);
     }
   }
-  return result; // Return the result matrix
-}
+  else {
+    // Load the operands
+    vector<SparseMatrix> matrices(inputs.size());
+    for (size_t m = 0; m < inputs.size(); m++) {
+      string error;
+      if (!loadMatrixFile(inputs[m], matrices[m], error)) {
+        cerr << error << endl;
+        return 1;
+      }
+    }
 
-// Prints the sparse matrix in a readable format
-void SparseMatrix::print() const {
-  for (int i = 0; i < numRows; i++) {
-    Node* node = rowHeaders[i]->right; // Get the first node in the current row of the sparse matrix
-    
-    for (int j = 0; j < numCols; j++) {
-      // If there is a node and its column index matches the current column index, print its value
-      if (node != nullptr && node != rowHeaders[i] && node->col == j) {
-        cout << node->value << "\t"; // Print the value of the node
-        node = node->right; // Move to the next node in the row
+    // Check the dimensions and compute the result
+    const SparseMatrix& a = matrices[0];
+    if (command == "transpose") {
+      result = a.transpose();
+    }
+    else if (command == "reorder") {
+      if (a.getRows() != a.getCols()) {
+        cerr << "Unable to reorder a " << a.getRows() << "x" << a.getCols() << " matrix, it must be square" << endl;
+        computed = false;
       }
-      // If the current node does not exist or its column index does not match the current column, print 0
       else {
-        cout << "0\t"; // Print 0 if there is no node at the current position
+        const int PART_SIZE = 4096; // Rows per part of a partition ordering
+        CSRMatrix csr = a.toCSR();
+        vector<int> order = ordering == "degree" ? degreeOrdering(csr.view())
+                          : ordering == "partition" ? partitionOrdering(csr.view(), (a.getRows() + PART_SIZE - 1) / PART_SIZE)
+                          : reverseCuthillMcKee(csr.view());
+        CSRMatrix permuted = permuteCSR(csr.view(), order, order);
+        OrderingMetrics before = orderingMetrics(csr.view()), after = orderingMetrics(permuted.view());
+        cerr << ordering << ": bandwidth " << before.bandwidth << " -> " << after.bandwidth << ", profile "
+             << before.profile << " -> " << after.profile << endl;
+        result = SparseMatrix(permuted);
+      }
+    }
+    else if (chain) {
+      vector<const SparseMatrix*> factors;
+      for (const SparseMatrix& matrix : matrices) {
+        factors.push_back(&matrix);
+      }
+      string error;
+      ChainReport report;
+      computed = multiplyChain(factors, result, error, &report);
+      if (!computed) {
+        cerr << error << endl;
+      }
+      else if (printStats) {
+        cerr << "chain: " << report.order << ", estimated " << report.estimatedCost << " partial products (left to right "
+             << report.leftToRightCost << "), computed " << report.cost << ", planned in " << report.planSeconds
+             << " s, multiplied in " << report.multiplySeconds << " s\n";
+        for (const ChainStep& step : report.steps) {
+          cerr << "  M" << step.first << "..M" << step.split << " * M" << step.split + 1 << "..M" << step.last
+               << ": estimated " << step.estimatedProducts << " products and " << step.estimatedNnz << " entries, computed "
+               << step.products << " products and " << step.nnz << " entries\n";
+        }
+      }
+    }
+    else {
+      const SparseMatrix& b = matrices[1];
+      computed = checkOperandShapes(command, a.getRows(), a.getCols(), b.getRows(), b.getCols());
+      if (computed) {
+        result = command == "add" ? a + b : command == "sub" ? a - b : pruned ? a.multiplyPruned(b, prune) : a * b;
       }
     }
-    cout << endl; // Move to the next row
   }
-}
 
- // This function prompts the user to enter values for a matrix and stores the non-zero values in the provided SparseMatrix object
-void enterMatrixValues(int row, int col, SparseMatrix* CreateMatrix) {  
-  // Initialize the matrix array with zeros
-  float matrixArray[row][col];
-  for (int i = 0; i < row; i++) {
-    for (int j = 0; j < col; j++) {
-      matrixArray[i][j] = 0;
+  int status = 1;
+  if (computed && snapshotOutput) {
+    string error;
+    status = (inPlace ? saveSnapshot(mappedResult.view(), output, error) : result.saveSnapshot(output, error)) ? 0 : 1;
+    if (status != 0) {
+      cerr << error << endl;
+    }
+  }
+  else if (computed) {
+    FILE* out = output == "-" ? stdout : fopen(output.c_str(), "wb");
+    if (out == nullptr) {
+      cerr << output << ": cannot open file for writing" << endl;
     }
+    else {
+      const int PREVIEW_SIZE = 32; // Largest dense preview in rows and columns
+      bool written = true;
+      if (format == "dense") {
+        result.printWindow(0, 0, PREVIEW_SIZE, PREVIEW_SIZE, out);
+      }
+      else {
+        written = result.writeCoordinate(out, format == "mm");
+      }
+      status = written && fflush(out) == 0 && !ferror(out) ? 0 : 1;
+      if (out != stdout && fclose(out) != 0) {
+        status = 1;
+      }
+      if (status != 0) {
+        cerr << output << ": write failed" << endl;
+      }
+    }
+  }
+
+  if (printStats) {
+    cerr << SparseStats::toJSON();
   }
+  return status;
+}
+
+ // This function prompts the user to enter values for a matrix and stores the non-zero values in the provided SparseMatrix object.
+ // Only the entered entries are staged, so memory and time are proportional to the number of entries rather than row * col
+void enterMatrixValues(int row, int col, SparseMatrix& CreateMatrix) {  
+  // Stage the entries; an entry entered again for the same position replaces the earlier one
+  COOBuilder staged(row - 1, col - 1, COOBuilder::KEEP_LAST);
       
   string enterRowString;
   int enterRow;
@@ -331,7 +7358,7 @@ void enterMatrixValues(int row, int col, SparseMatrix* CreateMatrix) {
 
         // Check if the input is a number
         bool isNumber = true;
-        for (int i = 0; i < enterRowString.length(); i++) {
+        for (size_t i = 0; i < enterRowString.length(); i++) {
           // Allow a single negative sign at the beginning
           if (i == 0 && enterRowString[i] == '-') {
             isNumber = true;
@@ -407,8 +7434,8 @@ void enterMatrixValues(int row, int col, SparseMatrix* CreateMatrix) {
         cout << "\nRow: " << enterRow << " Column: " << enterCol << " Value: ";
       }
 
-      // Add the entered value to the matrix array
-      matrixArray[enterRow][enterCol] = enterVal;
+      // Add the entered value to the staged entries (rows and columns are entered 1-based)
+      staged.add(enterRow - 1, enterCol - 1, (int)enterVal);
 
       cout << "\033[2J\033[1;1H"; // Clear the console
       cout << "Enter the row, column, and value for entries in the matrix\n";    
@@ -416,17 +7443,18 @@ void enterMatrixValues(int row, int col, SparseMatrix* CreateMatrix) {
   }
   cout << "\033[2J\033[1;1H"; // Clear the console
 
-  // Transfer the non-zero values from the matrix array to the SparseMatrix object
-  for (int i = 0; i < row; i++) {
-    for (int j = 0; j < col; j++) {
-      if (matrixArray[i][j] != 0) {
-        CreateMatrix->insert(i-1, j-1, matrixArray[i][j]);
-      }
-    }
-  }
+  // Transfer the non-zero values to the SparseMatrix object in one sorted pass. A zero entered last
+  // for a position removes the entry
+  CSRMatrix entries = staged.toCSR();
+  entries.dropZeros();
+  CreateMatrix.assign(entries);
 }
 
-int main() {
+int main(int argc, char** argv) {
+  // Any arguments select the non-interactive batch mode
+  if (argc > 1) {
+    return runBatch(argc, argv);
+  }
 
   char operation;
   int row;
@@ -617,39 +7645,43 @@ int main() {
     }
   }
   
-  // Create new SparseMatrix objects for the matrices
-  SparseMatrix* FirstMatrix = new SparseMatrix(row-1, col-1); 
-  SparseMatrix* SecondMatrix = new SparseMatrix(row-1, col-1);
-  SparseMatrix* MultMatrix = new SparseMatrix(row2-1, col2-1);
-  SparseMatrix* ResultMatrix = new SparseMatrix(row-1, col-1);
+  // Create the SparseMatrix objects for the matrices. The second operand of a multiplication is only
+  // sized when row2/col2 have been entered
+  SparseMatrix FirstMatrix(row-1, col-1); 
+  SparseMatrix SecondMatrix(row-1, col-1);
+  SparseMatrix MultMatrix;
+  SparseMatrix ResultMatrix;
+  if (operation == '*') {
+    MultMatrix = SparseMatrix(row2-1, col2-1);
+  }
 
   // Prompt the user to enter matrix values and print the matrices based on the selected operation
   if (operation == 'T' || operation == 't') {
     enterMatrixValues(row, col, FirstMatrix);
     cout << "Matrix: \n" << endl;
-    FirstMatrix->print();
+    FirstMatrix.print();
   }
   else if (operation == '*') {
     enterMatrixValues(row, col, FirstMatrix);
     cout << "First Matrix: \n" << endl;
-    FirstMatrix->print();
+    FirstMatrix.print();
     cout << "\nSecond Matrix: \n" << endl;
     enterMatrixValues(row2, col2, MultMatrix);
     cout << "First Matrix: \n" << endl;
-    FirstMatrix->print();
+    FirstMatrix.print();
     cout << "\nSecond Matrix: \n" << endl;
-    MultMatrix->print();
+    MultMatrix.print();
   }
   else if (operation == '+' || operation == '-') {
     enterMatrixValues(row, col, FirstMatrix);
     cout << "First Matrix: \n" << endl;
-    FirstMatrix->print();
+    FirstMatrix.print();
     cout << "\nSecond Matrix: \n" << endl;
     enterMatrixValues(row, col, SecondMatrix);
     cout << "First Matrix: \n" << endl;
-    FirstMatrix->print();
+    FirstMatrix.print();
     cout << "\nSecond Matrix: \n" << endl;
-    SecondMatrix->print();
+    SecondMatrix.print();
   }
   
   cout << endl;
@@ -657,30 +7689,26 @@ int main() {
   // Perform matrix operations based on the user's input and print the corresponding results
   if (operation == 'T' || operation == 't') {
     cout << "Transposed Matrix: \n" << endl;
-    ResultMatrix = FirstMatrix->transpose();
-    ResultMatrix->print();
+    ResultMatrix = FirstMatrix.transpose();
+    ResultMatrix.print();
   }
   else if (operation == '*') {
     cout << "First Matrix * Second Matrix: \n" << endl;
-    ResultMatrix = *FirstMatrix * *MultMatrix;
-    ResultMatrix->print();
+    ResultMatrix = FirstMatrix * MultMatrix;
+    ResultMatrix.print();
   }
   else if (operation == '+') {
     cout << "First Matrix + Second Matrix: \n" << endl;
-    ResultMatrix = *FirstMatrix + *SecondMatrix;
-    ResultMatrix->print();
+    ResultMatrix = FirstMatrix + SecondMatrix;
+    ResultMatrix.print();
   }
   else if (operation == '-') {
     cout << "First Matrix - Second Matrix: \n" << endl;
-    ResultMatrix = *FirstMatrix - *SecondMatrix;
-    ResultMatrix->print();
+    ResultMatrix = FirstMatrix - SecondMatrix;
+    ResultMatrix.print();
   }
   
-  // Deallocate memory for the matrices
-  delete FirstMatrix;
-  delete SecondMatrix;
-  delete MultMatrix;
-  delete ResultMatrix;
+  // The matrices free their memory when they go out of scope
 
   return 0;
 }